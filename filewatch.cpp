@@ -0,0 +1,256 @@
+#include "filewatch.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#define SETTLETIME 100 // Milliseconds the file has to be left alone before we consider a save finished
+
+FileWatcher::FileWatcher()
+{
+#ifdef _WIN32
+    mHandle = INVALID_HANDLE_VALUE;
+    mLastWriteTime = 0;
+#else
+    mFd = -1;
+    mWd = -1;
+#endif
+}
+
+FileWatcher::~FileWatcher()
+{
+    Close();
+}
+
+RwBool FileWatcher::Open(const RwChar* path)
+{
+    std::string fullPath = path;
+    size_t slash = fullPath.find_last_of("/\\");
+
+    if (slash == std::string::npos) {
+        mDir = ".";
+        mName = fullPath;
+    } else {
+        mDir = (slash == 0) ? fullPath.substr(0, 1) : fullPath.substr(0, slash);
+        mName = fullPath.substr(slash + 1);
+    }
+
+#ifdef _WIN32
+    mHandle = FindFirstChangeNotificationA(mDir.c_str(), FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+
+    if (mHandle == INVALID_HANDLE_VALUE) {
+        printf("Error: Failed to watch directory %s\n", mDir.c_str());
+        return FALSE;
+    }
+
+    mLastWriteTime = GetLastWriteTime();
+#else
+    mFd = inotify_init1(IN_CLOEXEC);
+
+    if (mFd < 0) {
+        printf("Error: Failed to initialize inotify\n");
+        return FALSE;
+    }
+
+    mWd = inotify_add_watch(mFd, mDir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MODIFY);
+
+    if (mWd < 0) {
+        printf("Error: Failed to watch directory %s\n", mDir.c_str());
+        Close();
+        return FALSE;
+    }
+#endif
+
+    return TRUE;
+}
+
+void FileWatcher::Close()
+{
+#ifdef _WIN32
+    if (mHandle != INVALID_HANDLE_VALUE) {
+        FindCloseChangeNotification(mHandle);
+        mHandle = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (mFd >= 0) {
+        close(mFd);
+        mFd = -1;
+        mWd = -1;
+    }
+#endif
+}
+
+#ifdef _WIN32
+
+RwUInt64 FileWatcher::GetLastWriteTime()
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    std::string path = mDir + "/" + mName;
+
+    if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data)) {
+        return 0;
+    }
+
+    return ((RwUInt64)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+}
+
+RwBool FileWatcher::Wait()
+{
+    // Change notifications are for the whole directory, so check if it was actually our file
+    for (;;) {
+        if (WaitForSingleObject(mHandle, INFINITE) != WAIT_OBJECT_0) {
+            return FALSE;
+        }
+
+        if (!FindNextChangeNotification(mHandle)) {
+            return FALSE;
+        }
+
+        RwUInt64 writeTime = GetLastWriteTime();
+
+        if (writeTime != 0 && writeTime != mLastWriteTime) {
+            break;
+        }
+    }
+
+    // Wait for the directory to settle down
+    for (;;) {
+        DWORD result = WaitForSingleObject(mHandle, SETTLETIME);
+
+        if (result == WAIT_TIMEOUT) {
+            break;
+        }
+
+        if (result != WAIT_OBJECT_0 || !FindNextChangeNotification(mHandle)) {
+            return FALSE;
+        }
+    }
+
+    mLastWriteTime = GetLastWriteTime();
+
+    return TRUE;
+}
+
+#else
+
+// Reads pending events, waiting up to timeoutMs for the first one (-1 waits forever).
+// changedOut is set to TRUE if any of them were for our file.
+RwBool FileWatcher::ReadEvents(int timeoutMs, RwBool* changedOut)
+{
+    struct pollfd pfd;
+    pfd.fd = mFd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    *changedOut = FALSE;
+
+    int result = poll(&pfd, 1, timeoutMs);
+
+    if (result < 0) {
+        return FALSE;
+    }
+
+    if (result == 0) {
+        return TRUE;
+    }
+
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length = read(mFd, buffer, sizeof(buffer));
+
+    if (length <= 0) {
+        return FALSE;
+    }
+
+    for (char* p = buffer; p < buffer + length; ) {
+        struct inotify_event* event = (struct inotify_event*)p;
+
+        if (event->len && strcmp(event->name, mName.c_str()) == 0) {
+            *changedOut = TRUE;
+        }
+
+        p += sizeof(struct inotify_event) + event->len;
+    }
+
+    return TRUE;
+}
+
+RwBool FileWatcher::Wait()
+{
+    RwBool changed = FALSE;
+
+    while (!changed) {
+        if (!ReadEvents(-1, &changed)) {
+            return FALSE;
+        }
+    }
+
+    // Wait for the file to settle down
+    for (;;) {
+        if (!ReadEvents(SETTLETIME, &changed)) {
+            return FALSE;
+        }
+
+        if (!changed) {
+            break;
+        }
+    }
+
+    return TRUE;
+}
+
+#endif
+
+RwBool AtomicReplaceFile(const RwChar* tempPath, const RwChar* path)
+{
+#ifdef _WIN32
+    if (!MoveFileExA(tempPath, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+#else
+    if (rename(tempPath, path) != 0) {
+#endif
+        printf("Error: Failed to replace %s\n", path);
+        remove(tempPath);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+RwBool HashFile(const RwChar* path, RwUInt64* hashOut)
+{
+    FILE* file = fopen(path, "rb");
+
+    if (!file) {
+        return FALSE;
+    }
+
+    RwUInt64 hash = 0xCBF29CE484222325;
+    RwUInt8 buffer[65536];
+    size_t length;
+
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        for (size_t i = 0; i < length; i++) {
+            hash ^= buffer[i];
+            hash *= 0x100000001B3;
+        }
+    }
+
+    RwBool error = ferror(file) != 0;
+
+    fclose(file);
+
+    if (error) {
+        return FALSE;
+    }
+
+    *hashOut = hash;
+
+    return TRUE;
+}
\ No newline at end of file
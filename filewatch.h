@@ -0,0 +1,43 @@
+#pragma once
+
+#include "rw.h"
+
+#include <string>
+
+// Watches a single file for changes.
+// The file's directory is watched rather than the file itself, since most programs (Blender included)
+// save by writing a temporary file and renaming it over the old one.
+struct FileWatcher
+{
+    FileWatcher();
+    ~FileWatcher();
+
+    RwBool Open(const RwChar* path);
+    void Close();
+
+    // Blocks until the file has been changed and nothing has touched it for a little while
+    // (so we don't read it halfway through a save). Returns FALSE on error.
+    RwBool Wait();
+
+private:
+    std::string mDir;
+    std::string mName;
+
+#ifdef _WIN32
+    void* mHandle;
+    RwUInt64 mLastWriteTime;
+
+    RwUInt64 GetLastWriteTime();
+#else
+    int mFd;
+    int mWd;
+
+    RwBool ReadEvents(int timeoutMs, RwBool* changedOut);
+#endif
+};
+
+// Replaces path with tempPath, so other programs never see a half-written file.
+RwBool AtomicReplaceFile(const RwChar* tempPath, const RwChar* path);
+
+// FNV-1a hash of a file's contents. Returns FALSE if the file couldn't be read.
+RwBool HashFile(const RwChar* path, RwUInt64* hashOut);
\ No newline at end of file
@@ -0,0 +1,216 @@
+#include "heatmap.h"
+#include "jspbuilder.h"
+#include "jspstats.h"
+#include "parallel.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include <algorithm>
+
+#define QUERYSTACKSIZE (MAXBSPDEPTH * 2)
+
+JSPHeatmap::JSPHeatmap()
+{
+    queryRadius = 0.5f;
+    mJSP = NULL;
+}
+
+void JSPHeatmap::Init(const JSP* jsp, const RpClump* clump)
+{
+    assert(jsp);
+    assert(clump);
+
+    mJSP = jsp;
+
+    RwUInt32 numVerts = JSPBuilder::CalcAtomicStripOffsets(clump, &mAtomicOffsets);
+    assert(numVerts == mJSP->stripVecList.size());
+}
+
+const RwV3d* JSPHeatmap::GetTriangleVerts(RwUInt32 index) const
+{
+    const ClumpCollBSPTriangle& tri = mJSP->colltree.triangles[index];
+    return &mJSP->stripVecList[mAtomicOffsets[tri.v.i.atomIndex] + tri.v.i.meshVertIndex];
+}
+
+void JSPHeatmap::Query(const RwV3d* point, JSPQueryCost* costOut) const
+{
+    assert(mJSP);
+
+    const std::vector<ClumpCollBSPBranchNode>& branchNodes = mJSP->colltree.branchNodes;
+    const std::vector<ClumpCollBSPTriangle>& triangles = mJSP->colltree.triangles;
+
+    costOut->numBranchNodes = 0;
+    costOut->numTriangles = 0;
+
+    if (branchNodes.empty()) {
+        // No tree, every triangle gets tested
+        costOut->numTriangles = (RwInt32)triangles.size();
+        costOut->cost = JSPCOST_TRIANGLE * costOut->numTriangles;
+        return;
+    }
+
+    RwV3d inf = { point->x - queryRadius, point->y - queryRadius, point->z - queryRadius };
+    RwV3d sup = { point->x + queryRadius, point->y + queryRadius, point->z + queryRadius };
+
+    RwUInt32 stack[QUERYSTACKSIZE];
+    RwInt32 stackSize = 1;
+
+    stack[0] = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_BRANCH, 0, 0);
+
+    while (stackSize > 0) {
+        RwUInt32 info = stack[--stackSize];
+        RwUInt32 index = CLUMPCOLL_GETINDEX(info);
+
+        if (CLUMPCOLL_GETNODETYPE(info) == kCLUMPCOLL_TRIANGLE) {
+            for (RwUInt32 t = index; t < triangles.size(); t++) {
+                costOut->numTriangles++;
+
+                if (!(triangles[t].flags & kCLUMPCOLL_HASNEXT)) {
+                    break;
+                }
+            }
+
+            continue;
+        }
+
+        const ClumpCollBSPBranchNode& node = branchNodes[index];
+        RwInt32 axis = CLUMPCOLL_GETAXIS(node.leftInfo);
+
+        costOut->numBranchNodes++;
+
+        // The left child covers everything up to its plane, the right child everything from its plane on
+        assert(stackSize + 2 <= QUERYSTACKSIZE);
+
+        if (GETCOORD(inf, axis) <= node.leftValue) {
+            stack[stackSize++] = node.leftInfo;
+        }
+
+        if (GETCOORD(sup, axis) >= node.rightValue) {
+            stack[stackSize++] = node.rightInfo;
+        }
+    }
+
+    costOut->cost = JSPCOST_BRANCH * costOut->numBranchNodes + JSPCOST_TRIANGLE * costOut->numTriangles;
+}
+
+void JSPHeatmap::QueryTriangles(std::vector<JSPQueryCost>* costsOut, RwInt32 numThreads) const
+{
+    assert(mJSP);
+
+    RwInt32 numTriangles = (RwInt32)mJSP->colltree.triangles.size();
+
+    costsOut->resize(numTriangles);
+
+    ParallelForBlocks(numTriangles, numThreads, [&](RwInt32, RwInt32 begin, RwInt32 end) {
+        for (RwInt32 i = begin; i < end; i++) {
+            const RwV3d* v = GetTriangleVerts(i);
+
+            RwV3d center;
+            center.x = (v[0].x + v[1].x + v[2].x) / 3.0f;
+            center.y = (v[0].y + v[1].y + v[2].y) / 3.0f;
+            center.z = (v[0].z + v[1].z + v[2].z) / 3.0f;
+
+            Query(&center, &(*costsOut)[i]);
+        }
+    });
+}
+
+// Blue, cyan, green, yellow, red
+static void GetHeatColor(RwReal t, RwUInt8* rgbOut)
+{
+    static const RwReal colors[5][3] = {
+        { 0.0f, 0.0f, 1.0f },
+        { 0.0f, 1.0f, 1.0f },
+        { 0.0f, 1.0f, 0.0f },
+        { 1.0f, 1.0f, 0.0f },
+        { 1.0f, 0.0f, 0.0f }
+    };
+
+    t = std::min(std::max(t, 0.0f), 1.0f) * 4.0f;
+
+    RwInt32 i = std::min((RwInt32)t, 3);
+    RwReal f = t - i;
+
+    for (RwInt32 c = 0; c < 3; c++) {
+        rgbOut[c] = (RwUInt8)((colors[i][c] + (colors[i + 1][c] - colors[i][c]) * f) * 255.0f + 0.5f);
+    }
+}
+
+RwBool JSPHeatmap::WritePLY(RwStream* stream, const std::vector<JSPQueryCost>* costs) const
+{
+    assert(mJSP);
+    assert(stream);
+    assert(costs->size() == mJSP->colltree.triangles.size());
+
+    RwUInt32 numTriangles = (RwUInt32)costs->size();
+
+    // Costs tend to span orders of magnitude (a few bad spots and lots of cheap ones), so the colors go by log cost
+    RwReal minCost = INFINITY;
+    RwReal maxCost = 0.0f;
+
+    for (const JSPQueryCost& cost : *costs) {
+        minCost = std::min(minCost, cost.cost);
+        maxCost = std::max(maxCost, cost.cost);
+    }
+
+    RwReal logMin = (numTriangles > 0) ? logf(std::max(minCost, 1.0f)) : 0.0f;
+    RwReal logRange = (numTriangles > 0) ? logf(std::max(maxCost, 1.0f)) - logMin : 0.0f;
+
+    char header[512];
+    sprintf(header,
+            "ply\n"
+            "format binary_little_endian 1.0\n"
+            "comment jspgen traversal cost heatmap, cost %g (blue) to %g (red)\n"
+            "element vertex %u\n"
+            "property float x\n"
+            "property float y\n"
+            "property float z\n"
+            "property uchar red\n"
+            "property uchar green\n"
+            "property uchar blue\n"
+            "element face %u\n"
+            "property list uchar int vertex_indices\n"
+            "end_header\n",
+            (numTriangles > 0) ? minCost : 0.0f, maxCost, numTriangles * 3, numTriangles);
+
+    RwUInt32 headerLength = (RwUInt32)strlen(header);
+
+    if (stream->Write(header, headerLength) != headerLength) {
+        return FALSE;
+    }
+
+    // Every triangle gets its own vertices, so each one can have its own color
+    for (RwUInt32 i = 0; i < numTriangles; i++) {
+        const RwV3d* v = GetTriangleVerts(i);
+        RwReal t = (logRange > 0.0f) ? (logf(std::max((*costs)[i].cost, 1.0f)) - logMin) / logRange : 0.0f;
+
+        RwUInt8 rgb[3];
+        GetHeatColor(t, rgb);
+
+        for (RwInt32 j = 0; j < 3; j++) {
+            stream->Write32<rwLITTLEENDIAN>(&v[j], sizeof(RwV3d));
+            stream->Write8(rgb, sizeof(rgb));
+        }
+    }
+
+    for (RwUInt32 i = 0; i < numTriangles; i++) {
+        RwUInt8 count = 3;
+        RwUInt32 indices[3] = { i * 3, i * 3 + 1, i * 3 + 2 };
+
+        // Every other triangle in a strip is wound the other way, same as in JSPBuilder::CalcStripNormal
+        if (mJSP->colltree.triangles[i].flags & kCLUMPCOLL_ISREVERSE) {
+            std::swap(indices[1], indices[2]);
+        }
+
+        stream->Write8(&count);
+
+        if (stream->Write32<rwLITTLEENDIAN>(indices, sizeof(indices)) != sizeof(indices)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
\ No newline at end of file
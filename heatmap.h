@@ -0,0 +1,43 @@
+#pragma once
+
+#include "rw.h"
+#include "jsp.h"
+
+#include <vector>
+
+// Work done by the tree's traversal for one query
+struct JSPQueryCost
+{
+    RwInt32 numBranchNodes;     // Branch nodes visited
+    RwInt32 numTriangles;       // Triangles tested
+    RwReal cost;                // Weighted like the cost model (JSPCOST_BRANCH, JSPCOST_TRIANGLE)
+};
+
+// Traversal cost heatmap, for finding the spots in a level where collision is slow.
+// Runs a query at the center of every triangle of a built tree, the way the game's collision checks walk it (a box
+// around the point, visiting every child the box reaches), and writes the model colored by what each one cost.
+// Like JSPRayCaster, it uses the JSP's own tree and strip vec list, and nothing changes after Init.
+struct JSPHeatmap
+{
+    RwReal queryRadius;     // Half the size of each query's box, about the size of a character
+
+    JSPHeatmap();
+
+    void Init(const JSP* jsp, const RpClump* clump);
+
+    void Query(const RwV3d* point, JSPQueryCost* costOut) const;
+
+    // Queries every triangle of the tree, in tree order, spread over numThreads threads
+    void QueryTriangles(std::vector<JSPQueryCost>* costsOut, RwInt32 numThreads) const;
+
+    // Writes the tree's triangles as a binary PLY mesh with vertex colors, each triangle colored by its query's cost
+    // from blue (the cheapest) to red (the most expensive). costs are the ones from QueryTriangles.
+    RwBool WritePLY(RwStream* stream, const std::vector<JSPQueryCost>* costs) const;
+
+    // Vertices of a triangle of the tree
+    const RwV3d* GetTriangleVerts(RwUInt32 index) const;
+
+private:
+    const JSP* mJSP;
+    std::vector<RwUInt32> mAtomicOffsets;   // Where each atomic's vertices start in the strip vec list
+};
\ No newline at end of file
@@ -0,0 +1,345 @@
+#include "hip.h"
+
+#include <stdio.h>
+#include <assert.h>
+
+static RwBool ReadHipChunkHeader(RwStream* stream, RwUInt32* idOut, RwUInt32* sizeOut)
+{
+    RwUInt32 header[2];
+
+    if (stream->Read32<rwBIGENDIAN>(header, sizeof(header)) != sizeof(header)) {
+        return FALSE;
+    }
+
+    *idOut = header[0];
+    *sizeOut = header[1];
+
+    return TRUE;
+}
+
+// Reads the next chunk header, making sure the chunk fits inside its parent.
+// Returns FALSE at the end of the parent (or on error, with *errorOut set).
+static RwBool ReadHipChildHeader(RwStream* stream, RwUInt32 parentEnd, RwUInt32* idOut, RwUInt32* endOut, RwBool* errorOut)
+{
+    RwUInt32 size;
+
+    *errorOut = FALSE;
+
+    if (stream->Tell() + 8 > parentEnd || !ReadHipChunkHeader(stream, idOut, &size)) {
+        return FALSE;
+    }
+
+    if (size > parentEnd - stream->Tell()) {
+        printf("Error: HIP/HOP chunk %c%c%c%c is truncated\n",
+               (char)(*idOut >> 24), (char)(*idOut >> 16), (char)(*idOut >> 8), (char)*idOut);
+        *errorOut = TRUE;
+        return FALSE;
+    }
+
+    *endOut = stream->Tell() + size;
+
+    return TRUE;
+}
+
+RwBool HipArchive::Read(const void* buffer, RwUInt32 length)
+{
+    data.assign((const RwUInt8*)buffer, (const RwUInt8*)buffer + length);
+    assets.clear();
+    layers.clear();
+    mPCNTPos = 0;
+    mSTRMPos = 0;
+    mDPAKPos = 0;
+
+    RwStream stream;
+    stream.Open(data.data(), length);
+
+    RwUInt32 id, end;
+    RwBool error;
+
+    if (!ReadHipChildHeader(&stream, length, &id, &end, &error) || id != 'HIPA') {
+        printf("Error: Not a HIP/HOP archive\n");
+        return FALSE;
+    }
+
+    stream.Seek(end);
+
+    while (ReadHipChildHeader(&stream, length, &id, &end, &error)) {
+        switch (id) {
+        case 'PACK':
+        {
+            RwUInt32 childID, childEnd;
+            while (ReadHipChildHeader(&stream, end, &childID, &childEnd, &error)) {
+                if (childID == 'PCNT') {
+                    mPCNTPos = stream.Tell();
+                }
+                stream.Seek(childEnd);
+            }
+            break;
+        }
+        case 'DICT':
+            if (!ReadDICT(&stream, end)) {
+                return FALSE;
+            }
+            break;
+        case 'STRM':
+            mSTRMPos = stream.Tell() - 8;
+            if (!ReadSTRM(&stream, end)) {
+                return FALSE;
+            }
+            break;
+        }
+
+        if (error) {
+            return FALSE;
+        }
+
+        stream.Seek(end);
+    }
+
+    if (error) {
+        return FALSE;
+    }
+
+    if (!mDPAKPos) {
+        printf("Error: HIP/HOP archive has no asset data\n");
+        return FALSE;
+    }
+
+    RwUInt32 dpakEnd = mDPAKPos + 8 + GetValue(mDPAKPos + 4);
+
+    for (HipAsset& asset : assets) {
+        if (asset.offset < mDPAKPos + 8 || asset.offset > dpakEnd || asset.size > dpakEnd - asset.offset) {
+            printf("Error: HIP/HOP asset %08X is outside the asset data\n", asset.id);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+RwBool HipArchive::ReadDICT(RwStream* stream, RwUInt32 end)
+{
+    RwUInt32 id, childEnd;
+    RwBool error;
+
+    while (ReadHipChildHeader(stream, end, &id, &childEnd, &error)) {
+        if (id == 'ATOC' && !ReadATOC(stream, childEnd)) {
+            return FALSE;
+        }
+
+        if (id == 'LTOC' && !ReadLTOC(stream, childEnd)) {
+            return FALSE;
+        }
+
+        stream->Seek(childEnd);
+    }
+
+    return !error;
+}
+
+RwBool HipArchive::ReadATOC(RwStream* stream, RwUInt32 end)
+{
+    RwUInt32 id, childEnd;
+    RwBool error;
+
+    while (ReadHipChildHeader(stream, end, &id, &childEnd, &error)) {
+        if (id == 'AHDR') {
+            // id, type, offset, size, plus, flags (then ADBG, which we don't need)
+            RwUInt32 ahdr[6];
+            HipAsset asset;
+            asset.headerPos = stream->Tell();
+
+            if (childEnd - asset.headerPos < sizeof(ahdr) || stream->Read32<rwBIGENDIAN>(ahdr, sizeof(ahdr)) != sizeof(ahdr)) {
+                printf("Error: HIP/HOP asset header is truncated\n");
+                return FALSE;
+            }
+
+            asset.id = ahdr[0];
+            asset.type = ahdr[1];
+            asset.offset = ahdr[2];
+            asset.size = ahdr[3];
+
+            assets.push_back(asset);
+        }
+
+        stream->Seek(childEnd);
+    }
+
+    return !error;
+}
+
+RwBool HipArchive::ReadLTOC(RwStream* stream, RwUInt32 end)
+{
+    RwUInt32 id, childEnd;
+    RwBool error;
+
+    while (ReadHipChildHeader(stream, end, &id, &childEnd, &error)) {
+        if (id == 'LHDR') {
+            // type, asset count, asset IDs (then LDBG)
+            RwUInt32 lhdr[2];
+
+            if (childEnd - stream->Tell() < sizeof(lhdr) || stream->Read32<rwBIGENDIAN>(lhdr, sizeof(lhdr)) != sizeof(lhdr) ||
+                lhdr[1] > (childEnd - stream->Tell()) / sizeof(RwUInt32)) {
+                printf("Error: HIP/HOP layer header is truncated\n");
+                return FALSE;
+            }
+
+            HipLayer layer;
+            layer.type = lhdr[0];
+            layer.assetIDs.resize(lhdr[1]);
+
+            if (lhdr[1]) {
+                stream->Read32<rwBIGENDIAN>(layer.assetIDs.data(), lhdr[1] * sizeof(RwUInt32));
+            }
+
+            layers.push_back(layer);
+        }
+
+        stream->Seek(childEnd);
+    }
+
+    return !error;
+}
+
+RwBool HipArchive::ReadSTRM(RwStream* stream, RwUInt32 end)
+{
+    RwUInt32 id, childEnd;
+    RwBool error;
+
+    while (ReadHipChildHeader(stream, end, &id, &childEnd, &error)) {
+        if (id == 'DPAK') {
+            mDPAKPos = stream->Tell() - 8;
+        }
+
+        stream->Seek(childEnd);
+    }
+
+    return !error;
+}
+
+HipAsset* HipArchive::FindAsset(RwUInt32 id)
+{
+    for (HipAsset& asset : assets) {
+        if (asset.id == id) {
+            return &asset;
+        }
+    }
+
+    return NULL;
+}
+
+void HipArchive::FindLayerAssets(RwUInt32 layerType, RwUInt32 assetType, std::vector<HipAsset*>* assetsOut)
+{
+    for (HipLayer& layer : layers) {
+        if (layer.type != layerType) {
+            continue;
+        }
+
+        for (RwUInt32 id : layer.assetIDs) {
+            HipAsset* asset = FindAsset(id);
+
+            if (asset && asset->type == assetType) {
+                assetsOut->push_back(asset);
+            }
+        }
+    }
+}
+
+void HipArchive::ReplaceAssetData(HipAsset* asset, const std::vector<RwUInt8>* newData)
+{
+    assert(asset);
+    assert(newData);
+
+    RwUInt32 start = asset->offset;
+    RwUInt32 newSize = (RwUInt32)newData->size();
+    RwUInt32 newEnd = start + newSize;
+    RwUInt32 dpakEnd = mDPAKPos + 8 + GetValue(mDPAKPos + 4);
+
+    // Find where the next asset's data starts
+    RwUInt32 nextStart = dpakEnd;
+
+    for (HipAsset& other : assets) {
+        if (&other != asset && other.offset >= start + asset->size && other.offset < nextStart) {
+            nextStart = other.offset;
+        }
+    }
+
+    // Everything from tailStart on gets moved to tailDest.
+    // If there are assets after this one, they're only moved if they have to be, by a multiple of the alignment.
+    RwUInt32 tailStart, tailDest;
+
+    if (nextStart == dpakEnd) {
+        tailStart = dpakEnd;
+        tailDest = (newEnd + 31) & ~31;
+    } else {
+        tailStart = nextStart;
+        tailDest = nextStart;
+
+        if (newEnd > nextStart) {
+            tailDest += (newEnd - nextStart + HIPMAXALIGNMENT - 1) & ~(HIPMAXALIGNMENT - 1);
+        }
+    }
+
+    std::vector<RwUInt8> newFile;
+    newFile.reserve(tailDest + (data.size() - tailStart));
+    newFile.insert(newFile.end(), data.begin(), data.begin() + start);
+    newFile.insert(newFile.end(), newData->begin(), newData->end());
+    newFile.resize(tailDest, HIPPADDING);
+    newFile.insert(newFile.end(), data.begin() + tailStart, data.end());
+
+    data.swap(newFile);
+
+    // Fix up the headers
+    RwUInt32 delta = tailDest - tailStart; // May wrap around, that's fine
+
+    asset->size = newSize;
+    SetValue(asset->headerPos + 12, newSize);
+
+    for (HipAsset& other : assets) {
+        if (&other != asset && other.offset >= tailStart) {
+            other.offset += delta;
+            SetValue(other.headerPos + 8, other.offset);
+        }
+    }
+
+    SetValue(mDPAKPos + 4, GetValue(mDPAKPos + 4) + delta);
+    SetValue(mSTRMPos + 4, GetValue(mSTRMPos + 4) + delta);
+
+    // Keep the max asset and layer sizes up to date, the game uses them to size its buffers
+    if (mPCNTPos) {
+        if (newSize > GetValue(mPCNTPos + 8)) {
+            SetValue(mPCNTPos + 8, newSize);
+        }
+
+        for (HipLayer& layer : layers) {
+            RwUInt32 layerSize = 0;
+            RwBool found = FALSE;
+
+            for (RwUInt32 id : layer.assetIDs) {
+                HipAsset* layerAsset = FindAsset(id);
+
+                if (layerAsset) {
+                    layerSize += layerAsset->size;
+                    found |= (layerAsset == asset);
+                }
+            }
+
+            if (found && layerSize > GetValue(mPCNTPos + 12)) {
+                SetValue(mPCNTPos + 12, layerSize);
+            }
+        }
+    }
+}
+
+RwUInt32 HipArchive::GetValue(RwUInt32 pos) const
+{
+    return ((RwUInt32)data[pos] << 24) | ((RwUInt32)data[pos + 1] << 16) | ((RwUInt32)data[pos + 2] << 8) | data[pos + 3];
+}
+
+void HipArchive::SetValue(RwUInt32 pos, RwUInt32 value)
+{
+    data[pos] = (RwUInt8)(value >> 24);
+    data[pos + 1] = (RwUInt8)(value >> 16);
+    data[pos + 2] = (RwUInt8)(value >> 8);
+    data[pos + 3] = (RwUInt8)value;
+}
\ No newline at end of file
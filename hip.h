@@ -0,0 +1,64 @@
+#pragma once
+
+#include "rw.h"
+
+// HIP/HOP archives. These are made of big endian chunks:
+//   HIPA
+//   PACK (PVER, PFLG, PCNT, PCRT, PMOD, PLAT)
+//   DICT
+//     ATOC (AINF, AHDR per asset (with ADBG))
+//     LTOC (LINF, LHDR per layer (with LDBG))
+//   STRM (DHDR, DPAK with every asset's data)
+// Only the parts needed to find assets by layer and replace an asset's data are read.
+
+#define HIPLAYER_BSP 2
+#define HIPLAYER_JSPINFO 10
+
+#define HIPASSET_JSP 'JSP '
+
+#define HIPPADDING 0x33             // Heavy Iron pads with '3'
+#define HIPMAXALIGNMENT 0x800       // Assets that move are moved by a multiple of this so they stay aligned
+
+struct HipAsset
+{
+    RwUInt32 id;
+    RwUInt32 type;
+    RwUInt32 offset;    // Offset of the asset's data from the start of the file
+    RwUInt32 size;
+    RwUInt32 headerPos; // Offset of the asset's AHDR data, for patching
+};
+
+struct HipLayer
+{
+    RwUInt32 type;
+    std::vector<RwUInt32> assetIDs;
+};
+
+struct HipArchive
+{
+    std::vector<RwUInt8> data;  // The whole file
+    std::vector<HipAsset> assets;
+    std::vector<HipLayer> layers;
+
+    RwBool Read(const void* buffer, RwUInt32 length);
+
+    HipAsset* FindAsset(RwUInt32 id);
+
+    // Finds every asset of a type in every layer of a type, in layer order
+    void FindLayerAssets(RwUInt32 layerType, RwUInt32 assetType, std::vector<HipAsset*>* assetsOut);
+
+    // Replaces an asset's data, moving the assets after it if it no longer fits
+    void ReplaceAssetData(HipAsset* asset, const std::vector<RwUInt8>* newData);
+
+private:
+    RwUInt32 mPCNTPos;  // Offset of the PCNT data
+    RwUInt32 mSTRMPos;  // Offsets of the STRM and DPAK chunk headers
+    RwUInt32 mDPAKPos;
+
+    RwBool ReadDICT(RwStream* stream, RwUInt32 end);
+    RwBool ReadATOC(RwStream* stream, RwUInt32 end);
+    RwBool ReadLTOC(RwStream* stream, RwUInt32 end);
+    RwBool ReadSTRM(RwStream* stream, RwUInt32 end);
+    RwUInt32 GetValue(RwUInt32 pos) const;
+    void SetValue(RwUInt32 pos, RwUInt32 value);
+};
\ No newline at end of file
@@ -1,5 +1,7 @@
 #include "jsp.h"
 
+#include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 #define JSP_RWLIBRARYID 0x1003FFFF // 3.4.0.3
@@ -21,14 +23,142 @@ struct JSPHeader
     RwUInt32 jspNodeList;
 };
 
+// Reads a collision tree written for any platform.
+// The tree's endianness is detected from its magic number, and the stream is switched over to it.
+RwBool ClumpCollBSPTree::Read(RwStream* stream)
+{
+    assert(stream);
+
+    RwUInt32 chunkLength;
+    if (!stream->FindChunk(0xBEEF01, &chunkLength)) {
+        printf("Error: JSP has no collision tree\n");
+        return FALSE;
+    }
+
+    ClumpCollBSPHeader header;
+    if (stream->Read(&header, sizeof(header)) != sizeof(header)) {
+        return FALSE;
+    }
+
+    if (header.magic == 'LOCC') {
+        stream->endian = rwENDIAN;
+    } else if (header.magic == SWAP32((RwUInt32)'LOCC')) {
+        stream->endian = (rwENDIAN == rwLITTLEENDIAN) ? rwBIGENDIAN : rwLITTLEENDIAN;
+        header.numBranchNodes = SWAP32(header.numBranchNodes);
+        header.numTriangles = SWAP32(header.numTriangles);
+    } else {
+        printf("Error: Invalid collision tree magic %08X\n", header.magic);
+        return FALSE;
+    }
+
+    // Check the counts against the chunk before allocating anything for them
+    RwUInt64 treeSize = sizeof(ClumpCollBSPHeader) + (RwUInt64)sizeof(ClumpCollBSPBranchNode) * header.numBranchNodes +
+                        (RwUInt64)sizeof(ClumpCollBSPTriangle) * header.numTriangles;
+
+    if (treeSize > chunkLength) {
+        printf("Error: Collision tree has %u branch nodes and %u triangles, more than its chunk can hold\n",
+               header.numBranchNodes, header.numTriangles);
+        return FALSE;
+    }
+
+    RwBool success = (stream->endian == rwBIGENDIAN) ?
+        ReadNodes<rwBIGENDIAN>(stream, header.numBranchNodes, header.numTriangles) :
+        ReadNodes<rwLITTLEENDIAN>(stream, header.numBranchNodes, header.numTriangles);
+
+    if (!success) {
+        return FALSE;
+    }
+
+    // Make sure every node points somewhere valid, so the tree can be walked safely.
+    // Branch nodes are in depth-first order, so a child always comes after its parent, which also rules out cycles.
+    for (RwUInt32 parent = 0; parent < header.numBranchNodes; parent++) {
+        RwUInt32 infos[2] = { branchNodes[parent].leftInfo, branchNodes[parent].rightInfo };
+
+        for (RwUInt32 info : infos) {
+            RwUInt32 index = CLUMPCOLL_GETINDEX(info);
+            RwUInt32 nodeType = CLUMPCOLL_GETNODETYPE(info);
+
+            if ((nodeType == kCLUMPCOLL_BRANCH && (index >= header.numBranchNodes || index <= parent)) ||
+                (nodeType == kCLUMPCOLL_TRIANGLE && index > header.numTriangles) ||
+                (nodeType != kCLUMPCOLL_BRANCH && nodeType != kCLUMPCOLL_TRIANGLE)) {
+                printf("Error: Invalid collision tree node info %08X\n", info);
+                return FALSE;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+template <RwEndian E>
+RwBool ClumpCollBSPTree::ReadNodes(RwStream* stream, RwUInt32 numBranchNodes, RwUInt32 numTriangles)
+{
+    branchNodes.resize(numBranchNodes);
+    triangles.resize(numTriangles);
+
+    for (ClumpCollBSPBranchNode& branchNode : branchNodes) {
+        stream->Read32<E>(&branchNode.leftInfo);
+        stream->Read32<E>(&branchNode.rightInfo);
+        stream->Read32<E>(&branchNode.leftValue);
+        if (stream->Read32<E>(&branchNode.rightValue) != sizeof(branchNode.rightValue)) {
+            return FALSE;
+        }
+    }
+
+    for (ClumpCollBSPTriangle& triangle : triangles) {
+        stream->Read16<E>(&triangle.v.i.atomIndex);
+        stream->Read16<E>(&triangle.v.i.meshVertIndex);
+        stream->Read8(&triangle.flags);
+        stream->Read8(&triangle.platData);
+        if (stream->Read16<E>(&triangle.matIndex) != sizeof(triangle.matIndex)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
 RwBool ClumpCollBSPTree::Write(RwStream* stream)
 {
     assert(stream);
 
+    return (stream->endian == rwBIGENDIAN) ? Write<rwBIGENDIAN>(stream) : Write<rwLITTLEENDIAN>(stream);
+}
+
+template <RwEndian E>
+RwBool ClumpCollBSPTree::Write(RwStream* stream)
+{
+    if (!WriteHeader<E>(stream, (RwUInt32)branchNodes.size(), (RwUInt32)triangles.size())) {
+        return FALSE;
+    }
+
+    for (ClumpCollBSPBranchNode& branchNode : branchNodes) {
+        WriteBranchNode<E>(stream, &branchNode);
+    }
+
+    for (ClumpCollBSPTriangle& triangle : triangles) {
+        WriteTriangle<E>(stream, &triangle);
+    }
+
+    return TRUE;
+}
+
+RwUInt32 ClumpCollBSPTree::GetWriteSize(RwUInt32 numBranchNodes, RwUInt32 numTriangles)
+{
+    return sizeof(RwChunkHeader) + sizeof(ClumpCollBSPHeader) +
+           sizeof(ClumpCollBSPBranchNode) * numBranchNodes + sizeof(ClumpCollBSPTriangle) * numTriangles;
+}
+
+// Writes the chunk header and the tree header.
+// The chunk length only depends on the node and triangle counts, so the branch nodes and triangles
+// can be streamed out afterwards from wherever they live (see JSPBuilder::Write).
+template <RwEndian E>
+RwBool ClumpCollBSPTree::WriteHeader(RwStream* stream, RwUInt32 numBranchNodes, RwUInt32 numTriangles)
+{
+    assert(stream);
+
     RwUInt32 headerSize = sizeof(ClumpCollBSPHeader);
-    RwUInt32 numBranchNodes = (RwUInt32)branchNodes.size();
     RwUInt32 branchNodesSize = sizeof(ClumpCollBSPBranchNode) * numBranchNodes;
-    RwUInt32 numTriangles = (RwUInt32)triangles.size();
     RwUInt32 trianglesSize = sizeof(ClumpCollBSPTriangle) * numTriangles;
 
     RwChunkHeader chunkHeader;
@@ -45,23 +175,105 @@ RwBool ClumpCollBSPTree::Write(RwStream* stream)
     header.numBranchNodes = numBranchNodes;
     header.numTriangles = numTriangles;
 
-    if (stream->Write32(&header, sizeof(header)) != sizeof(header)) {
+    if (stream->Write32<E>(&header, sizeof(header)) != sizeof(header)) {
         return FALSE;
     }
 
-    for (ClumpCollBSPBranchNode& branchNode : branchNodes) {
-        stream->Write32(&branchNode.leftInfo);
-        stream->Write32(&branchNode.rightInfo);
-        stream->Write32(&branchNode.leftValue);
-        stream->Write32(&branchNode.rightValue);
+    return TRUE;
+}
+
+template <RwEndian E>
+void ClumpCollBSPTree::WriteBranchNode(RwStream* stream, const ClumpCollBSPBranchNode* branchNode)
+{
+    stream->Write32<E>(&branchNode->leftInfo);
+    stream->Write32<E>(&branchNode->rightInfo);
+    stream->Write32<E>(&branchNode->leftValue);
+    stream->Write32<E>(&branchNode->rightValue);
+}
+
+template <RwEndian E>
+void ClumpCollBSPTree::WriteTriangle(RwStream* stream, const ClumpCollBSPTriangle* triangle)
+{
+    stream->Write16<E>(&triangle->v.i.atomIndex);
+    stream->Write16<E>(&triangle->v.i.meshVertIndex);
+    stream->Write8(&triangle->flags);
+    stream->Write8(&triangle->platData);
+    stream->Write16<E>(&triangle->matIndex);
+}
+
+RwBool JSP::Read(RwStream* stream)
+{
+    assert(stream);
+
+    if (!colltree.Read(stream)) {
+        return FALSE;
     }
 
-    for (ClumpCollBSPTriangle& triangle : triangles) {
-        stream->Write16(&triangle.v.i.atomIndex);
-        stream->Write16(&triangle.v.i.meshVertIndex);
-        stream->Write8(&triangle.flags);
-        stream->Write8(&triangle.platData);
-        stream->Write16(&triangle.matIndex);
+    // The stream is in the collision tree's endianness from here on
+    return (stream->endian == rwBIGENDIAN) ? ReadNodeList<rwBIGENDIAN>(stream) : ReadNodeList<rwLITTLEENDIAN>(stream);
+}
+
+template <RwEndian E>
+RwBool JSP::ReadNodeList(RwStream* stream)
+{
+    RwUInt32 chunkLength;
+    if (!stream->FindChunk(0xBEEF02, &chunkLength)) {
+        printf("Error: JSP has no node list\n");
+        return FALSE;
+    }
+
+    JSPHeader header;
+    stream->Read(header.idtag, sizeof(header.idtag));
+    stream->Read32<E>(&header.version);
+    stream->Read32<E>(&header.jspNodeCount);
+    stream->Read32<E>(&header.clump);
+    stream->Read32<E>(&header.colltree);
+
+    if (stream->Read32<E>(&header.jspNodeList) != sizeof(header.jspNodeList)) {
+        return FALSE;
+    }
+
+    if (memcmp(header.idtag, "JSP", 4) != 0) {
+        printf("Error: Invalid JSP idtag\n");
+        return FALSE;
+    }
+
+    if (sizeof(JSPHeader) + (RwUInt64)sizeof(JSPNodeInfo) * header.jspNodeCount > chunkLength) {
+        printf("Error: JSP has %u nodes, more than its chunk can hold\n", header.jspNodeCount);
+        return FALSE;
+    }
+
+    jspNodeList.resize(header.jspNodeCount);
+
+    if (!jspNodeList.empty()) {
+        RwUInt32 jspNodeListSize = sizeof(JSPNodeInfo) * header.jspNodeCount;
+        if (stream->Read32<E>(&jspNodeList[0], jspNodeListSize) != jspNodeListSize) {
+            return FALSE;
+        }
+    }
+
+    // Only GameCube JSPs have a strip vec list
+    stripVecList.clear();
+
+    if (stream->FindChunk(0xBEEF03, &chunkLength)) {
+        RwUInt32 stripVecCount;
+        if (stream->Read32<E>(&stripVecCount) != sizeof(stripVecCount)) {
+            return FALSE;
+        }
+
+        if (sizeof(RwUInt32) + (RwUInt64)sizeof(RwV3d) * stripVecCount > chunkLength) {
+            printf("Error: JSP has %u strip vertices, more than its chunk can hold\n", stripVecCount);
+            return FALSE;
+        }
+
+        stripVecList.resize(stripVecCount);
+
+        if (!stripVecList.empty()) {
+            RwUInt32 stripVecListSize = sizeof(RwV3d) * stripVecCount;
+            if (stream->Read32<E>(&stripVecList[0], stripVecListSize) != stripVecListSize) {
+                return FALSE;
+            }
+        }
     }
 
     return TRUE;
@@ -71,10 +283,30 @@ RwBool JSP::Write(RwStream* stream, RwBool writeStripVecList)
 {
     assert(stream);
 
-    if (!colltree.Write(stream)) {
-        return FALSE;
+    if (stream->endian == rwBIGENDIAN) {
+        return colltree.Write<rwBIGENDIAN>(stream) && WriteNodeList<rwBIGENDIAN>(stream, writeStripVecList);
+    }
+
+    return colltree.Write<rwLITTLEENDIAN>(stream) && WriteNodeList<rwLITTLEENDIAN>(stream, writeStripVecList);
+}
+
+RwUInt32 JSP::GetNodeListWriteSize(RwBool writeStripVecList) const
+{
+    RwUInt32 size = sizeof(RwChunkHeader) + sizeof(JSPHeader) + sizeof(JSPNodeInfo) * (RwUInt32)jspNodeList.size();
+
+    if (writeStripVecList) {
+        size += sizeof(RwChunkHeader) + sizeof(RwUInt32) + sizeof(RwV3d) * (RwUInt32)stripVecList.size();
     }
 
+    return size;
+}
+
+// Writes everything after the collision tree (JSP node list and strip vec list).
+template <RwEndian E>
+RwBool JSP::WriteNodeList(RwStream* stream, RwBool writeStripVecList)
+{
+    assert(stream);
+
     RwUInt32 jspHeaderSize = sizeof(JSPHeader);
     RwUInt32 jspNodeCount = (RwUInt32)jspNodeList.size();
     RwUInt32 jspNodeListSize = sizeof(JSPNodeInfo) * jspNodeCount;
@@ -100,14 +332,14 @@ RwBool JSP::Write(RwStream* stream, RwBool writeStripVecList)
     header.jspNodeList = 0;
 
     stream->Write(header.idtag, sizeof(header.idtag));
-    stream->Write32(&header.version);
-    stream->Write32(&header.jspNodeCount);
-    stream->Write32(&header.clump);
-    stream->Write32(&header.colltree);
-    stream->Write32(&header.jspNodeList);
+    stream->Write32<E>(&header.version);
+    stream->Write32<E>(&header.jspNodeCount);
+    stream->Write32<E>(&header.clump);
+    stream->Write32<E>(&header.colltree);
+    stream->Write32<E>(&header.jspNodeList);
 
     if (!jspNodeList.empty()) {
-        if (stream->Write32(&jspNodeList[0], jspNodeListSize) != jspNodeListSize) {
+        if (stream->Write32<E>(&jspNodeList[0], jspNodeListSize) != jspNodeListSize) {
             return FALSE;
         }
     }
@@ -123,16 +355,26 @@ RwBool JSP::Write(RwStream* stream, RwBool writeStripVecList)
             return FALSE;
         }
 
-        if (stream->Write32(&stripVecCount) != sizeof(stripVecCount)) {
+        if (stream->Write32<E>(&stripVecCount) != sizeof(stripVecCount)) {
             return FALSE;
         }
 
         if (!stripVecList.empty()) {
-            if (stream->Write32(&stripVecList[0], stripVecListSize) != stripVecListSize) {
+            if (stream->Write32<E>(&stripVecList[0], stripVecListSize) != stripVecListSize) {
                 return FALSE;
             }
         }
     }
 
     return TRUE;
-}
\ No newline at end of file
+}
+
+// The builder streams its tree out through these
+template RwBool ClumpCollBSPTree::WriteHeader<rwLITTLEENDIAN>(RwStream* stream, RwUInt32 numBranchNodes, RwUInt32 numTriangles);
+template RwBool ClumpCollBSPTree::WriteHeader<rwBIGENDIAN>(RwStream* stream, RwUInt32 numBranchNodes, RwUInt32 numTriangles);
+template void ClumpCollBSPTree::WriteBranchNode<rwLITTLEENDIAN>(RwStream* stream, const ClumpCollBSPBranchNode* branchNode);
+template void ClumpCollBSPTree::WriteBranchNode<rwBIGENDIAN>(RwStream* stream, const ClumpCollBSPBranchNode* branchNode);
+template void ClumpCollBSPTree::WriteTriangle<rwLITTLEENDIAN>(RwStream* stream, const ClumpCollBSPTriangle* triangle);
+template void ClumpCollBSPTree::WriteTriangle<rwBIGENDIAN>(RwStream* stream, const ClumpCollBSPTriangle* triangle);
+template RwBool JSP::WriteNodeList<rwLITTLEENDIAN>(RwStream* stream, RwBool writeStripVecList);
+template RwBool JSP::WriteNodeList<rwBIGENDIAN>(RwStream* stream, RwBool writeStripVecList);
\ No newline at end of file
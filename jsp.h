@@ -56,7 +56,18 @@ struct ClumpCollBSPTree
     std::vector<ClumpCollBSPBranchNode> branchNodes;
     std::vector<ClumpCollBSPTriangle> triangles;
 
-    RwBool Write(RwStream* stream);
+    RwBool Read(RwStream* stream);
+    RwBool Write(RwStream* stream);     // Writes in the stream's byte order
+    template <RwEndian E> RwBool Write(RwStream* stream);
+
+    static RwUInt32 GetWriteSize(RwUInt32 numBranchNodes, RwUInt32 numTriangles);  // Bytes Write takes for a tree this big
+
+    template <RwEndian E> static RwBool WriteHeader(RwStream* stream, RwUInt32 numBranchNodes, RwUInt32 numTriangles);
+    template <RwEndian E> static void WriteBranchNode(RwStream* stream, const ClumpCollBSPBranchNode* branchNode);
+    template <RwEndian E> static void WriteTriangle(RwStream* stream, const ClumpCollBSPTriangle* triangle);
+
+private:
+    template <RwEndian E> RwBool ReadNodes(RwStream* stream, RwUInt32 numBranchNodes, RwUInt32 numTriangles);
 };
 
 enum JSPNodeFlags
@@ -78,5 +89,11 @@ struct JSP
     std::vector<JSPNodeInfo> jspNodeList;
     std::vector<RwV3d> stripVecList;
 
-    RwBool Write(RwStream* stream, RwBool writeStripVecList);
+    RwBool Read(RwStream* stream);
+    RwBool Write(RwStream* stream, RwBool writeStripVecList);   // Writes in the stream's byte order
+    template <RwEndian E> RwBool WriteNodeList(RwStream* stream, RwBool writeStripVecList);
+    RwUInt32 GetNodeListWriteSize(RwBool writeStripVecList) const;     // Bytes WriteNodeList takes
+
+private:
+    template <RwEndian E> RwBool ReadNodeList(RwStream* stream);
 };
\ No newline at end of file
@@ -1,10 +1,26 @@
 #include "jspbuilder.h"
+#include "jspstats.h"
+#include "parallel.h"
 
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include <assert.h>
 
-#define MAXBSPDEPTH 32
+#include <algorithm>
+#include <chrono>
+
 #define MAXTRIANGLES 5
+#define MAXCOLDTRIANGLES 16 // Leaf size limit in areas with no query points
+#define QUERYBINS 16
+#define SPLITBINS 16
+#define WALKABLESLOPE 0.7071f // Minimum normal Y of a walkable triangle (45 degrees)
+#define MORTONBITS 30 // 10 bits per axis
+#define MORTONRADIXBITS 10
+#define EMPTYCUTRATIO 0.3f // Cut off empty space that takes up at least this much of a node along an axis
+#define DEGTORAD (3.14159265f / 180.0f)
+#define PARALLELSPANSIZE 65536 // Spans of at least this many triangles are partitioned and bounded on several threads
+#define PRUNESEARCHSTEPS 40 // Bisection steps when searching for the node price that fits a byte limit
 
 #ifdef DEBUG
 #define dprintf printf
@@ -12,24 +28,129 @@
 #define dprintf
 #endif
 
-void JSPBuilder::Build(JSP* jsp, RpClump* clump)
+JSPTriangleRule::JSPTriangleRule()
+{
+    flags = 0;
+    minSlope = 0.0f;
+    maxSlope = 180.0f;
+    matIndex = -1;
+    atomIndex = -1;
+}
+
+JSPBuilder::JSPBuilder()
+{
+    mode = JSPBUILD_MIDPOINT;
+    optimizeTreelets = FALSE;
+    autoQueryPoints = FALSE;
+    worldSpace = FALSE;
+    twoLevel = FALSE;
+    timeBudget = 0;
+    collectStats = TRUE;
+    maxBytes = 0;
+    maxBytesStripVecList = FALSE;
+    mBinnedSplits = FALSE;
+}
+
+// Builds the JSP for the given clump.
+// If copyTree is FALSE, the collision tree is left in the builder and jsp->colltree stays empty.
+// Use Write to serialize it straight from the builder, which saves holding a second copy of the tree in memory.
+void JSPBuilder::Build(JSP* jsp, RpClump* clump, RwBool copyTree)
 {
     assert(jsp);
     assert(clump);
 
     mJSP = jsp;
     mClump = clump;
+    mNumThreads = GetNumWorkerThreads();
     mBspDepth = 0;
-    mStats.maxDepthReached = 0;
+    memset(&mStats, 0, sizeof(mStats));
     mTriangles.clear();
+    mBranchNodes.clear();
 
     BuildJSPNodeList();
     BuildStripVecList();
-    BuildBSPTree();
 
-    printf("Branch nodes: %d\n", (RwUInt32)mJSP->colltree.branchNodes.size());
-    printf("Triangles: %d\n", (RwUInt32)mJSP->colltree.triangles.size());
-    printf("Max BSP depth reached: %d\n", mStats.maxDepthReached);
+    if (timeBudget > 0) {
+        BuildWithinBudget();
+    } else {
+        BuildBSPTree();
+    }
+
+    std::vector<RwInt32>().swap(mSharedAtomics);
+    std::vector<TriangleData>().swap(mPartitionBuffer);
+
+    mStats.numBranchNodes = (RwInt32)mBranchNodes.size();
+    mStats.numTriangles = (RwInt32)mTriangles.size();
+
+    if (maxBytes > 0) {
+        mStats.numBytes = GetWriteSize(maxBytesStripVecList);
+        mStats.maxBytes = maxBytes;
+    }
+
+    if (copyTree) {
+        // Now all our triangles are neatly sorted, copy them into the BSP tree.
+        CopyTree();
+    }
+}
+
+// Calculates the stats of the built tree, whether it's still in the builder or has been copied into the JSP.
+void JSPBuilder::CalcTreeStats(JSPTreeStats* stats)
+{
+    assert(stats);
+
+    if (mBranchNodes.empty() && mTriangles.empty()) {
+        stats->Calculate(&mJSP->colltree, &mBBox);
+        return;
+    }
+
+    stats->Calculate(mBranchNodes.empty() ? NULL : &mBranchNodes[0], (RwUInt32)mBranchNodes.size(),
+                     mTriangles.empty() ? NULL : &mTriangles[0].bspTri.flags, sizeof(TriangleData), (RwUInt32)mTriangles.size(),
+                     &mBBox);
+}
+
+// Writes the JSP, taking the collision tree straight from the builder's buffers.
+// Only valid after calling Build with copyTree set to FALSE.
+RwUInt32 JSPBuilder::GetWriteSize(RwBool writeStripVecList) const
+{
+    // The tree is either still in the builder or in the JSP, and the other one is empty
+    RwUInt32 numBranchNodes = (RwUInt32)(mBranchNodes.size() + mJSP->colltree.branchNodes.size());
+    RwUInt32 numTriangles = (RwUInt32)(mTriangles.size() + mJSP->colltree.triangles.size());
+
+    return ClumpCollBSPTree::GetWriteSize(numBranchNodes, numTriangles) + mJSP->GetNodeListWriteSize(writeStripVecList);
+}
+
+// Writes the built JSP, whether the tree is still in the builder or has been copied into the JSP.
+RwBool JSPBuilder::Write(RwStream* stream, RwBool writeStripVecList)
+{
+    assert(stream);
+
+    if (mBranchNodes.empty() && mTriangles.empty()) {
+        return mJSP->Write(stream, writeStripVecList);
+    }
+
+    assert(mJSP->colltree.branchNodes.empty());
+    assert(mJSP->colltree.triangles.empty());
+
+    return (stream->endian == rwBIGENDIAN) ? Write<rwBIGENDIAN>(stream, writeStripVecList) :
+                                             Write<rwLITTLEENDIAN>(stream, writeStripVecList);
+}
+
+template <RwEndian E>
+RwBool JSPBuilder::Write(RwStream* stream, RwBool writeStripVecList)
+{
+    if (!ClumpCollBSPTree::WriteHeader<E>(stream, (RwUInt32)mBranchNodes.size(), (RwUInt32)mTriangles.size())) {
+        return FALSE;
+    }
+
+    for (ClumpCollBSPBranchNode& branchNode : mBranchNodes) {
+        ClumpCollBSPTree::WriteBranchNode<E>(stream, &branchNode);
+    }
+
+    for (TriangleData& tri : mTriangles) {
+        ClumpCollBSPTree::WriteTriangle<E>(stream, &tri.bspTri);
+    }
+
+    return mJSP->WriteNodeList<E>(stream, writeStripVecList);
 }
 
 void JSPBuilder::BuildJSPNodeList()
@@ -49,6 +170,23 @@ void JSPBuilder::BuildJSPNodeList()
     }
 }
 
+RwUInt32 JSPBuilder::CalcAtomicStripOffsets(const RpClump* clump, std::vector<RwUInt32>* offsetsOut)
+{
+    offsetsOut->resize(clump->atomics.size());
+
+    RwUInt32 offset = 0;
+
+    for (RwInt32 atomIndex = (RwInt32)clump->atomics.size(); atomIndex--;) {
+        (*offsetsOut)[atomIndex] = offset;
+
+        for (const RpMesh& mesh : clump->atomics[atomIndex].geometry->mesh.meshes) {
+            offset += (RwUInt32)mesh.indices.size();
+        }
+    }
+
+    return offset;
+}
+
 void JSPBuilder::BuildStripVecList()
 {
     // Generate a cache of every triangle's vertices.
@@ -56,321 +194,2684 @@ void JSPBuilder::BuildStripVecList()
     // This speeds up loading at the cost of increased file size.
     // I believe on other platforms this list gets generated at runtime.
 
-    RwUInt16 totalIndices = 0;
-    for (RpAtomic& atom : mClump->atomics) {
-        totalIndices += atom.geometry->mesh.totalIndicesInMesh;
-    }
+    std::vector<RwUInt32> atomicStarts;
+    RwUInt32 totalIndices = CalcAtomicStripOffsets(mClump, &atomicStarts);
     mJSP->stripVecList.reserve(totalIndices);
 
+    if (worldSpace) {
+        BuildWorldMatrices();
+    }
+
+    FindSharedAtomics();
+
     // Need to loop through atomics in reverse
-    for (auto it = mClump->atomics.rbegin(); it != mClump->atomics.rend(); it++) {
-        RpAtomic& atom = *it;
+    for (RwInt32 atomIndex = (RwInt32)mClump->atomics.size(); atomIndex--;) {
+        RpAtomic& atom = mClump->atomics[atomIndex];
         RpMorphTarget& mt = atom.geometry->morphTargets[0];
+        RwUInt32 start = atomicStarts[atomIndex];
+
+        assert(start == mJSP->stripVecList.size());
+
+        // Same vertices as an atomic we've already been through, transform and all
+        RwInt32 source = mSharedAtomics[atomIndex];
+
+        if (source >= 0) {
+            RwUInt32 count = ((atomIndex > 0) ? atomicStarts[atomIndex - 1] : totalIndices) - start;
+
+            mJSP->stripVecList.resize(start + count);
+            std::copy(mJSP->stripVecList.begin() + atomicStarts[source], mJSP->stripVecList.begin() + atomicStarts[source] + count,
+                      mJSP->stripVecList.begin() + start);
+            continue;
+        }
+
         for (RpMesh& mesh : atom.geometry->mesh.meshes) {
             for (RxVertexIndex idx : mesh.indices) {
                 mJSP->stripVecList.push_back(mt.verts[idx]);
             }
         }
+
+        // Move the atomic's vertices into world space, all in one go
+        if (worldSpace) {
+            const RwMatrix& matrix = mWorldMatrices[atom.frame - mClump->frames.data()];
+
+            if (!matrix.IsIdentity()) {
+                matrix.TransformPoints(&mJSP->stripVecList[start], (RwInt32)(mJSP->stripVecList.size() - start));
+            }
+        }
     }
+
+    std::vector<RwMatrix>().swap(mWorldMatrices);
 }
 
-void JSPBuilder::BuildBSPTree()
+// Find the atomics that use the same geometry as another atomic (and the same transform, in world space), so their
+// vertices and triangles can be copied instead of worked out again. Atomics are gone through in reverse, so the one
+// everything is copied from is the one with the highest index.
+void JSPBuilder::FindSharedAtomics()
 {
-    // Load all the triangles from the model, unsorted.
-    InitTriangles();
+    struct AtomicKey
+    {
+        const RpGeometry* geometry;
+        RwInt32 frame;      // -1 if the geometry is used as is
+        RwInt32 atomIndex;
+    };
 
-    // Create a bbox surrounding the whole model.
-    RwBBox bbox;
-    InitBBox(&bbox);
+    RwInt32 numAtomics = (RwInt32)mClump->atomics.size();
+    std::vector<AtomicKey> keys(numAtomics);
+
+    for (RwInt32 i = 0; i < numAtomics; i++) {
+        RpAtomic& atom = mClump->atomics[i];
+
+        keys[i].geometry = atom.geometry;
+        keys[i].frame = -1;
+        keys[i].atomIndex = i;
+
+        if (worldSpace) {
+            RwInt32 frame = (RwInt32)(atom.frame - mClump->frames.data());
+
+            if (!mWorldMatrices[frame].IsIdentity()) {
+                keys[i].frame = frame;
+            }
+        }
+    }
+
+    std::sort(keys.begin(), keys.end(), [](const AtomicKey& a, const AtomicKey& b) {
+        if (a.geometry != b.geometry) return std::less<const RpGeometry*>()(a.geometry, b.geometry);
+        if (a.frame != b.frame) return a.frame < b.frame;
+        return a.atomIndex > b.atomIndex;
+    });
+
+    mSharedAtomics.assign(numAtomics, -1);
 
-    // Make the tree 4Head
-    RecurseTriangles(0, mTriangles.size() - 1, &bbox);
+    RwInt32 source = 0;
 
-    // Now all our triangles are neatly sorted, copy them into the BSP tree.
-    CopyTriangles();
+    for (RwInt32 i = 1; i < numAtomics; i++) {
+        if (keys[i].geometry == keys[source].geometry && keys[i].frame == keys[source].frame) {
+            mSharedAtomics[keys[i].atomIndex] = keys[source].atomIndex;
+            mStats.numSharedAtomics++;
+        } else {
+            source = i;
+        }
+    }
 }
 
-// Initialize a bbox that surrounds the entire model
-void JSPBuilder::InitBBox(RwBBox* bbox)
+// Compose every frame's matrix with its parents' to get its world matrix.
+// Each frame is only composed once, no matter how many children or atomics it has.
+void JSPBuilder::BuildWorldMatrices()
 {
-    bbox->inf.x = bbox->inf.y = bbox->inf.z = INFINITY;
-    bbox->sup.x = bbox->sup.y = bbox->sup.z = -INFINITY;
+    RwInt32 numFrames = (RwInt32)mClump->frames.size();
+    std::vector<RwBool> done(numFrames, FALSE);
+    std::vector<RwInt32> chain;
 
-#if 0
-    for (RpAtomic& atom : mClump->atomics) {
-        for (RwV3d& v : atom.geometry->morphTargets[0].verts) {
-            bbox->AddPoint(&v);
+    mWorldMatrices.resize(numFrames);
+
+    for (RwInt32 i = 0; i < numFrames; i++) {
+        // Walk up to the first frame that's already done (or the root), then compose back down.
+        // The chain can't be longer than the number of frames, unless the hierarchy loops back on itself.
+        for (RwInt32 f = i; f >= 0 && !done[f] && (RwInt32)chain.size() < numFrames;) {
+            chain.push_back(f);
+
+            RwFrame* parent = mClump->frames[f].parent;
+            f = parent ? (RwInt32)(parent - mClump->frames.data()) : -1;
         }
-    }
-#else
-    // Loop through all the geometries. Should be faster than looping through atomics (especially if they share geometries).
-    // If there's unused geometries, though, the bbox may start bigger than intended, which will lead to a less optimal tree.
-    // Correctly exported dffs shouldn't have that issue though.
-    for (RpGeometry& geom : mClump->geometries) {
-        for (RwV3d& v : geom.morphTargets[0].verts) {
-            bbox->AddPoint(&v);
+
+        while (!chain.empty()) {
+            RwInt32 f = chain.back();
+            RwFrame& frame = mClump->frames[f];
+            RwInt32 parentIndex = frame.parent ? (RwInt32)(frame.parent - mClump->frames.data()) : -1;
+
+            if (parentIndex >= 0 && done[parentIndex]) {
+                mWorldMatrices[f].Multiply(&frame.matrix, &mWorldMatrices[parentIndex]);
+            } else {
+                mWorldMatrices[f] = frame.matrix;
+            }
+
+            done[f] = TRUE;
+            chain.pop_back();
         }
     }
-#endif
 }
 
-static RwBool IsDegenerateTriangle(RwUInt16* indices)
+void JSPBuilder::BuildBSPTree()
 {
-    return indices[0] == indices[1] ||
-           indices[0] == indices[2] ||
-           indices[1] == indices[2];
+    // Load all the triangles from the model, unsorted.
+    InitTriangles();
+
+    // Create a bbox surrounding the whole model.
+    InitBBox(&mBBox);
+
+    // Gather the query points, if any. The Morton build doesn't look at them.
+    if (mode != JSPBUILD_MORTON) {
+        InitQueryPoints();
+    }
+
+    if (twoLevel) {
+        BuildTwoLevel();
+    } else {
+        BuildTree();
+    }
+
+    for (std::vector<RwV3d>& points : mQueryPoints) {
+        std::vector<RwV3d>().swap(points);
+    }
+
+    if (maxBytes > 0 && !mBranchNodes.empty()) {
+        FitByteLimit();
+    }
+
+    if (optimizeTreelets && !mBranchNodes.empty()) {
+        OptimizeTreelets(&mBBox);
+    }
+
+    SortLeafChains();
 }
 
-void JSPBuilder::InitTriangles()
+// Anytime build. Build the tree with the normal settings first, then keep building candidates with other settings until
+// the time budget runs out, keeping whichever has the lowest expected traversal cost. Every candidate gets the treelet
+// pass. A candidate is only started if the last one says it'll finish in time, and whatever time is left after all of
+// them goes to more treelet passes over the best tree.
+void JSPBuilder::BuildWithinBudget()
 {
-    // Every triangle starts out in one big chain.
-    // They are also all solid for now.
-    // TODO need a way to support nonsolid atomics/triangles
-    TriangleData tri;
-    tri.bspTri.flags = kCLUMPCOLL_HASNEXT | kCLUMPCOLL_ISSOLID;
-    tri.bspTri.platData = 0; // TODO see what this means on PS2/Xbox. It's unused on GameCube
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&]() {
+        return std::chrono::duration<RwReal, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
 
-    RwUInt16 stripVecOffset = 0;
+    JSPBuildMode userMode = mode;
+    RwBool userTwoLevel = twoLevel;
+    RwBool userOptimizeTreelets = optimizeTreelets;
+    RwInt32 numSharedAtomics = mStats.numSharedAtomics;
 
-    for (RwUInt16 atomIndex = (RwUInt16)mClump->atomics.size(); atomIndex--;) {
-        RpAtomic& atom = mClump->atomics[atomIndex];
-        RpMorphTarget& mt = atom.geometry->morphTargets[0];
-        RwUInt16 meshVertOffset = 0;
+    BuildBSPTree();
 
-        tri.bspTri.v.i.atomIndex = atomIndex;
+    JSPBuildStats bestStats = mStats;
+    std::vector<TriangleData> bestTriangles;
+    std::vector<ClumpCollBSPBranchNode> bestNodes;
+    RwReal bestCost = CalcCost();
+    RwReal firstCost = bestCost;
+    RwReal lastTime = elapsed();
+    RwInt32 numCandidates = 1;
+
+    struct Candidate
+    {
+        RwBool binnedSplits;
+        RwBool twoLevel;
+    };
+
+    // Most likely to help first
+    Candidate candidates[] = {
+        { FALSE, userTwoLevel },
+        { TRUE, userTwoLevel },
+        { FALSE, !userTwoLevel },
+        { TRUE, !userTwoLevel }
+    };
+
+    // The first candidate is the same tree with the treelet pass, so skip it if that already ran
+    RwInt32 first = (userMode == JSPBUILD_MIDPOINT && userOptimizeTreelets) ? 1 : 0;
+
+    for (RwInt32 i = first; i < (RwInt32)(sizeof(candidates) / sizeof(candidates[0])); i++) {
+        // With a single atomic, the two-level build is the same tree as the normal one
+        if (candidates[i].twoLevel != userTwoLevel && mClump->atomics.size() < 2) {
+            continue;
+        }
 
-        // Triangles are marked as visible if their containing atomic is visible.
-        // I believe this is only used for shadow rendering.
-        if (atom.flags & rpATOMICRENDER) {
-            tri.bspTri.flags |= kCLUMPCOLL_ISVISIBLE;
-        } else {
-            tri.bspTri.flags &= ~kCLUMPCOLL_ISVISIBLE;
+        RwReal startTime = elapsed();
+
+        if (startTime + lastTime > (RwReal)timeBudget) {
+            break;
         }
 
-        // TODO need to validate mesh is tristrip (atom.geometry->mesh.flags contains primitive type)
-        // Non-tristrip is not supported
+        bestTriangles.swap(mTriangles);
+        bestNodes.swap(mBranchNodes);
+        mTriangles.clear();
+        mBranchNodes.clear();
+        memset(&mStats, 0, sizeof(mStats));
+        mStats.numSharedAtomics = numSharedAtomics;
+        mBspDepth = 0;
 
-        for (RwUInt16 meshIndex = 0; meshIndex < (RwUInt16)atom.geometry->mesh.meshes.size(); meshIndex++) {
-            RpMesh& mesh = atom.geometry->mesh.meshes[meshIndex];
+        mode = JSPBUILD_MIDPOINT;
+        mBinnedSplits = candidates[i].binnedSplits;
+        twoLevel = candidates[i].twoLevel;
+        optimizeTreelets = TRUE;
 
-            tri.bspTri.matIndex = mesh.matIndex;
+        BuildBSPTree();
 
-            for (RwUInt16 vertIndex = 0; vertIndex < (RwUInt16)mesh.indices.size() - 2; vertIndex++) {
-                // Filter out degenerate triangles (triangles with zero area)
-                if (IsDegenerateTriangle(&mesh.indices[vertIndex])) {
-                    continue;
-                }
+        RwReal cost = CalcCost();
+        numCandidates++;
 
-                tri.bspTri.v.i.meshVertIndex = meshVertOffset + vertIndex;
-                tri.p = &mJSP->stripVecList[stripVecOffset + vertIndex];
+        if (cost < bestCost) {
+            bestCost = cost;
+            bestStats = mStats;
+        } else {
+            mTriangles.swap(bestTriangles);
+            mBranchNodes.swap(bestNodes);
+        }
 
-                // Calculate the minimum and maximum coords of each triangle.
-                // These are used to speedup partitioning
-                for (RwUInt32 axis = 0; axis < sizeof(RwV3d); axis += 4) {
-                    RwReal v0 = GETCOORD(tri.p[0], axis);
-                    RwReal v1 = GETCOORD(tri.p[1], axis);
-                    RwReal v2 = GETCOORD(tri.p[2], axis);
-
-                    RwReal min = v0;
-                    RwReal max = v0;
-                    if (v1 < min) min = v1;
-                    if (v2 < min) min = v2;
-                    if (v1 > max) max = v1;
-                    if (v2 > max) max = v2;
-
-                    SETCOORD(tri.min, axis, min);
-                    SETCOORD(tri.max, axis, max);
-                }
-                
-                // Since this is a tristrip, every 2nd triangle is in reverse orientation (clockwise).
-                // This will be accounted for during collision checking at runtime.
-                if (vertIndex % 2) {
-                    tri.bspTri.flags |= kCLUMPCOLL_ISREVERSE;
-                } else {
-                    tri.bspTri.flags &= ~kCLUMPCOLL_ISREVERSE;
-                }
+        lastTime = elapsed() - startTime;
+    }
 
-                mTriangles.push_back(tri);
-            }
+    mode = userMode;
+    mBinnedSplits = FALSE;
+    twoLevel = userTwoLevel;
+    optimizeTreelets = userOptimizeTreelets;
+    mStats = bestStats;
 
-            stripVecOffset += (RwUInt16)mesh.indices.size();
-            meshVertOffset += (RwUInt16)mesh.indices.size();
+    // More treelet passes over the best tree, while they still help. Each pass only looks at its own treelets, so it can
+    // still make the whole tree worse, in which case the tree from before it is put back.
+    while (!mBranchNodes.empty()) {
+        RwReal startTime = elapsed();
+
+        if (startTime + lastTime > (RwReal)timeBudget) {
+            break;
         }
-    }
-}
 
-// Hoare partition scheme implementation.
-// This sorts a span of triangles into left and right regions, in-place.
-// It returns the index of the last triangle in the left region.
-// https://en.wikipedia.org/wiki/Quicksort#Hoare_partition_scheme
-RwInt32 JSPBuilder::PartitionTriangles(RwInt32 lo, RwInt32 hi, RwReal splitPlane, RwPlaneType axis)
-{
-    RwInt32 i = lo - 1;
-    RwInt32 j = hi + 1;
+        bestStats = mStats;
+        bestTriangles = mTriangles;
+        bestNodes = mBranchNodes;
 
-    while (true) {
-        // We check the center of the triangle against the split coordinate.
-        // If it's less than the split coordinate (if the triangle is mostly on the left side), it goes in the left region.
-        // If it's greater or equal than the split coordinate (if the triangle is mostly on the right side), it goes in the right region.
+        OptimizeTreelets(&mBBox);
+        SortLeafChains();
 
-        do { i++; } while (i <= hi && mTriangles[i].GetCenter(axis) < splitPlane);
-        do { j--; } while (j >= lo && mTriangles[j].GetCenter(axis) >= splitPlane);
+        RwReal cost = CalcCost();
+        RwBool improved = (cost < bestCost * 0.999f);
 
-        if (i >= j) return j;
+        if (cost < bestCost) {
+            bestCost = cost;
+        } else {
+            mStats = bestStats;
+            mTriangles.swap(bestTriangles);
+            mBranchNodes.swap(bestNodes);
+        }
 
-        TriangleData tmp = mTriangles[i];
-        mTriangles[i] = mTriangles[j];
-        mTriangles[j] = tmp;
+        lastTime = elapsed() - startTime;
+
+        if (!improved) {
+            break;
+        }
     }
+
+    std::vector<TriangleData>().swap(bestTriangles);
+    std::vector<ClumpCollBSPBranchNode>().swap(bestNodes);
+
+    mStats.numCandidates = numCandidates;
+    mStats.firstCost = firstCost;
+    mStats.bestCost = bestCost;
 }
 
-// Here we choose where to split the bounding box and along what axis.
-// There are many different ways of choosing this, some of which lead to more optimal trees than others.
-void JSPBuilder::ChooseSplitPlane(RwBBox* bbox, RwInt32 lo, RwInt32 hi, RwReal* splitPlaneOut, RwPlaneType* axisOut)
+// Expected traversal cost of the tree in the builder
+RwReal JSPBuilder::CalcCost()
 {
-    // Currently, we choose the longest side of the bbox and split it down the middle.
-
-    RwV3d dim;
-    dim.x = bbox->sup.x - bbox->inf.x;
-    dim.y = bbox->sup.y - bbox->inf.y;
-    dim.z = bbox->sup.z - bbox->inf.z;
+    JSPTreeStats stats;
+    CalcTreeStats(&stats);
+    return stats.cost;
+}
 
-    RwPlaneType axis = rwXPLANE;
-    if (dim.y > GETCOORD(dim, axis)) axis = rwYPLANE;
-    if (dim.z > GETCOORD(dim, axis)) axis = rwZPLANE;
+// Build the tree over all the triangles, starting at the current depth, inside mBBox.
+void JSPBuilder::BuildTree()
+{
+    if (mode == JSPBUILD_MORTON) {
+        // Sort the triangles along a Z-order curve and make the tree from the Morton code bits.
+        SortMortonCodes();
+        RecurseMorton(0, mTriangles.size() - 1, MORTONBITS - 1);
+        std::vector<RwUInt32>().swap(mMortonCodes);
+    } else {
+        // Make the tree 4Head
+        RecurseTriangles(0, mTriangles.size() - 1, &mBBox);
+    }
+}
 
-    RwReal splitPlane = (GETCOORD(bbox->inf, axis) + GETCOORD(bbox->sup, axis)) / 2.0f;
+// Split helpers for spans of triangles (TriangleData) as well as the two-level build's spans of atomics (AtomicSpan).
+// Either one only needs GetCenter, GetMin and GetMax.
 
-    *splitPlaneOut = splitPlane;
-    *axisOut = axis;
+// Bounds of the centers of a span
+template <typename T>
+static void CalcCenterBounds(const T* items, RwInt32 lo, RwInt32 hi, RwBBox* bboxOut)
+{
+    bboxOut->inf.x = bboxOut->inf.y = bboxOut->inf.z = INFINITY;
+    bboxOut->sup.x = bboxOut->sup.y = bboxOut->sup.z = -INFINITY;
+
+    for (RwInt32 i = lo; i <= hi; i++) {
+        RwV3d center;
+        center.x = items[i].GetCenter(rwXPLANE);
+        center.y = items[i].GetCenter(rwYPLANE);
+        center.z = items[i].GetCenter(rwZPLANE);
+        bboxOut->AddPoint(&center);
+    }
 }
 
-// Here we recursively partition and sort the triangles in-place, using a quicksort-like algorithm.
-// We also create the branch nodes in the process.
-void JSPBuilder::RecurseTriangles(RwInt32 lo, RwInt32 hi, RwBBox* bbox)
+// Split down the middle of the centers, trying the axis they're most spread out on first. partition(plane, axis)
+// partitions the span and returns the last index on the left. Returns lo - 1 if no axis splits the span (the centers
+// are all in the same spot), with axisOut set to the most spread out axis.
+template <typename Partition>
+static RwInt32 SplitCenters(const RwBBox* centerBBox, RwInt32 lo, RwInt32 hi, RwPlaneType* axisOut, Partition partition)
 {
-    assert(lo < hi);
+    RwPlaneType axes[3] = { rwXPLANE, rwYPLANE, rwZPLANE };
+    std::sort(axes, axes + 3, [&](RwPlaneType a, RwPlaneType b) {
+        return GETCOORD(centerBBox->sup, a) - GETCOORD(centerBBox->inf, a) > GETCOORD(centerBBox->sup, b) - GETCOORD(centerBBox->inf, b);
+    });
 
-    dprintf("BSP Depth: %d\n", mBspDepth);
+    *axisOut = axes[0];
 
-    if (mBspDepth > mStats.maxDepthReached) {
-        mStats.maxDepthReached = mBspDepth;
-    }
+    for (RwPlaneType axis : axes) {
+        RwReal inf = GETCOORD(centerBBox->inf, axis);
+        RwReal sup = GETCOORD(centerBBox->sup, axis);
 
-    // Here we choose a (hopefully) good split plane.
-    // This affects how balanced the tree is.
-    RwReal splitPlane;
-    RwPlaneType axis;
-    ChooseSplitPlane(bbox, lo, hi, &splitPlane, &axis);
+        if (sup <= inf) {
+            break;
+        }
 
-    dprintf("(%f %f %f) (%f %f %f)\n",
-           bbox->inf.x, bbox->inf.y, bbox->inf.z,
-           bbox->sup.x, bbox->sup.y, bbox->sup.z);
+        RwInt32 p = partition((inf + sup) / 2.0f, axis);
 
-    dprintf("Split plane: %f, axis: ", splitPlane);
-    switch (axis) {
-    case rwXPLANE: dprintf("X\n"); break;
-    case rwYPLANE: dprintf("Y\n"); break;
-    case rwZPLANE: dprintf("Z\n"); break;
+        if (p >= lo && p < hi) {
+            *axisOut = axis;
+            return p;
+        }
     }
 
-    // Here we partition the triangles along the split plane, sorting them into left and right regions.
-    RwInt32 p = PartitionTriangles(lo, hi, splitPlane, axis);
+    return lo - 1;
+}
 
-    // Calculate left and right overlap planes.
-    // Left plane is the maximum coordinate of the left triangles.
-    // Right plane is the minimum coordinate of the right triangles.
+// Overlap planes of the items in [begin, end) of a span partitioned at p.
+// Left plane is the maximum coordinate of the left items, right plane is the minimum coordinate of the right items.
+template <typename T>
+static void CalcSpanOverlapPlanes(const T* items, RwInt32 begin, RwInt32 end, RwInt32 p, RwPlaneType axis,
+                                  RwReal* leftPlaneOut, RwReal* rightPlaneOut)
+{
     RwReal leftPlane = -INFINITY;
     RwReal rightPlane = INFINITY;
 
-    for (RwInt32 i = lo; i <= p; i++) {
-        assert(mTriangles[i].GetCenter(axis) < splitPlane);
-        RwReal max = GETCOORD(mTriangles[i].max, axis);
-        if (max > leftPlane) leftPlane = max;
+    for (RwInt32 i = begin; i < end; i++) {
+        if (i <= p) {
+            RwReal max = items[i].GetMax(axis);
+            if (max > leftPlane) leftPlane = max;
+        } else {
+            RwReal min = items[i].GetMin(axis);
+            if (min < rightPlane) rightPlane = min;
+        }
     }
 
-    for (RwInt32 i = p + 1; i <= hi; i++) {
-        assert(mTriangles[i].GetCenter(axis) >= splitPlane);
-        RwReal min = GETCOORD(mTriangles[i].min, axis);
-        if (min < rightPlane) rightPlane = min;
-    }
+    *leftPlaneOut = leftPlane;
+    *rightPlaneOut = rightPlane;
+}
 
-    RwUInt32 numLeft = p + 1 - lo;
-    RwUInt32 numRight = hi - p;
-    RwBool doneLeft = FALSE;
-    RwBool doneRight = FALSE;
+// Two-level build. The top-level tree only splits between atomics, down to single atomics (or a few small ones
+// sharing a chain). Each atomic that needs more than a chain gets its own subtree, built by a separate builder on its
+// own copy of the triangles, so they can all be built in parallel. Then the subtrees are grafted onto the top level.
+void JSPBuilder::BuildTwoLevel()
+{
+    RwInt32 numTriangles = (RwInt32)mTriangles.size();
 
-    // We can stop branching once we only have a few triangles left, or if we've hit the BSP depth limit.
-    if (numLeft <= MAXTRIANGLES || mBspDepth >= MAXBSPDEPTH - 1) {
-        doneLeft = TRUE;
+    // InitTriangles leaves each atomic's triangles next to each other
+    mAtomicSpans.clear();
+
+    for (RwInt32 lo = 0; lo < numTriangles;) {
+        AtomicSpan span;
+        span.lo = lo;
+        span.hi = lo;
+
+        while (span.hi + 1 < numTriangles &&
+               mTriangles[span.hi + 1].bspTri.v.i.atomIndex == mTriangles[lo].bspTri.v.i.atomIndex) {
+            span.hi++;
+        }
+
+        CalcTriangleBounds(span.lo, span.hi, &span.bounds);
+        mAtomicSpans.push_back(span);
+
+        lo = span.hi + 1;
     }
 
-    if (numRight <= MAXTRIANGLES || mBspDepth >= MAXBSPDEPTH - 1) {
-        doneRight = TRUE;
+    // Nothing to put a top level over
+    if (mAtomicSpans.size() < 2) {
+        std::vector<AtomicSpan>().swap(mAtomicSpans);
+        BuildTree();
+        return;
     }
 
-    dprintf("Left %d, Right %d\n", numLeft, numRight);
-    dprintf("Left %f, Right %f\n", leftPlane, rightPlane);
+    // The top level lays the atomics' triangles out again in the order it reaches them
+    std::vector<TriangleData> sortedTriangles;
+    sortedTriangles.reserve(numTriangles);
 
-    // Here we create the branch node for the current level and add it to the tree.
-    RwUInt32 nodeIndex = (RwUInt32)mJSP->colltree.branchNodes.size();
+    mSubtreeJobs.clear();
+    RecurseAtomics(0, (RwInt32)mAtomicSpans.size() - 1, &mBBox, &sortedTriangles);
 
-    mJSP->colltree.branchNodes.emplace_back();
+    mTriangles.swap(sortedTriangles);
+    std::vector<TriangleData>().swap(sortedTriangles);
+    std::vector<AtomicSpan>().swap(mAtomicSpans);
 
-    mJSP->colltree.branchNodes[nodeIndex].leftValue = leftPlane;
-    mJSP->colltree.branchNodes[nodeIndex].rightValue = rightPlane;
+    BuildSubtrees();
 
-    if (!doneLeft) {
-        // Store a pointer to the left branch node.
-        mJSP->colltree.branchNodes[nodeIndex].leftInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_BRANCH, axis, mJSP->colltree.branchNodes.size());
+    mStats.numSubtrees = (RwInt32)mSubtreeJobs.size();
+    std::vector<SubtreeJob>().swap(mSubtreeJobs);
 
-        // Shrink the bbox to the left region.
-        RwBBox leftBBox = *bbox;
-        SETCOORD(leftBBox.sup, axis, leftPlane);
+    // Subtrees were appended after the whole top level, put everything back in depth-first order
+    ReorderBranchNodes();
+}
 
-        // Recurse down the left branch.
-        mBspDepth++;
-        RecurseTriangles(lo, p, &leftBBox);
-        mBspDepth--;
-    } else {
-        // We're done branching, so store a pointer to the list of triangles.
-        mJSP->colltree.branchNodes[nodeIndex].leftInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_TRIANGLE, axis, lo);
+// Make a top-level node over a span of atomics, splitting down the middle of their centers along the axis they're most
+// spread out on (like FallbackSplit does with triangles), or at the median atomic if they're all in the same spot.
+// Empty space around the atomics is cut off first, same as CutEmptySpace.
+void JSPBuilder::RecurseAtomics(RwInt32 lo, RwInt32 hi, RwBBox* bbox, std::vector<TriangleData>* sortedTriangles)
+{
+    assert(lo < hi);
+
+    if (mBspDepth > mStats.maxDepthReached) {
+        mStats.maxDepthReached = mBspDepth;
     }
 
-    if (!doneRight) {
-        // Store a pointer to the right branch node.
-        mJSP->colltree.branchNodes[nodeIndex].rightInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_BRANCH, axis, mJSP->colltree.branchNodes.size());
+    RwBBox tightBBox = mAtomicSpans[lo].bounds;
 
-        // Shrink the bbox to the right region.
-        RwBBox rightBBox = *bbox;
-        SETCOORD(rightBBox.inf, axis, rightPlane);
+    for (RwInt32 i = lo + 1; i <= hi; i++) {
+        tightBBox.AddPoint(&mAtomicSpans[i].bounds.inf);
+        tightBBox.AddPoint(&mAtomicSpans[i].bounds.sup);
+    }
 
-        // Recurse down the right branch.
-        mBspDepth++;
-        RecurseTriangles(p + 1, hi, &rightBBox);
+    RwUInt32 nodeIndex = (RwUInt32)mBranchNodes.size();
+    RwPlaneType axis;
+    RwBool cutLow;
+
+    if (FindEmptySpace(bbox, &tightBBox, &axis, &cutLow)) {
+        mBranchNodes.emplace_back();
+
+        RwBBox childBBox = *bbox;
+        RwReal plane = cutLow ? GETCOORD(tightBBox.inf, axis) : GETCOORD(tightBBox.sup, axis);
+
+        if (cutLow) {
+            SETCOORD(childBBox.inf, axis, plane);
+        } else {
+            SETCOORD(childBBox.sup, axis, plane);
+        }
+
+        // The empty side is never visited, but its info still has to point at some triangles
+        RwUInt32 emptyInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_TRIANGLE, axis, 0);
+        RwUInt32 childInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_BRANCH, axis, mBranchNodes.size());
+
+        mBranchNodes[nodeIndex].leftInfo = cutLow ? emptyInfo : childInfo;
+        mBranchNodes[nodeIndex].leftValue = cutLow ? -INFINITY : plane;
+        mBranchNodes[nodeIndex].rightInfo = cutLow ? childInfo : emptyInfo;
+        mBranchNodes[nodeIndex].rightValue = cutLow ? plane : INFINITY;
+
+        mBspDepth++;
+        RecurseAtomics(lo, hi, &childBBox, sortedTriangles);
+        mBspDepth--;
+
+        return;
+    }
+
+    RwBBox centerBBox;
+    CalcCenterBounds(mAtomicSpans.data(), lo, hi, &centerBBox);
+
+    RwInt32 p = SplitCenters(&centerBBox, lo, hi, &axis, [&](RwReal splitPlane, RwPlaneType a) {
+        auto mid = std::partition(mAtomicSpans.begin() + lo, mAtomicSpans.begin() + hi + 1,
+                                  [=](const AtomicSpan& span) { return span.GetCenter(a) < splitPlane; });
+
+        return (RwInt32)(mid - mAtomicSpans.begin()) - 1;
+    });
+
+    if (p < lo) {
+        p = lo + (hi - lo) / 2;
+        std::nth_element(mAtomicSpans.begin() + lo, mAtomicSpans.begin() + p, mAtomicSpans.begin() + hi + 1,
+                         [=](const AtomicSpan& a, const AtomicSpan& b) {
+                             RwReal centerA = a.GetCenter(axis);
+                             RwReal centerB = b.GetCenter(axis);
+                             return (centerA != centerB) ? (centerA < centerB) : (a.lo < b.lo);
+                         });
+    }
+
+    RwReal leftPlane, rightPlane;
+    CalcSpanOverlapPlanes(mAtomicSpans.data(), lo, hi + 1, p, axis, &leftPlane, &rightPlane);
+
+    mBranchNodes.emplace_back();
+
+    mBranchNodes[nodeIndex].leftValue = leftPlane;
+    mBranchNodes[nodeIndex].rightValue = rightPlane;
+
+    RwBBox leftBBox = *bbox;
+    SETCOORD(leftBBox.sup, axis, leftPlane);
+
+    RwUInt32 leftInfo = AddAtomicChild(lo, p, &leftBBox, axis, nodeIndex, TRUE, sortedTriangles);
+    mBranchNodes[nodeIndex].leftInfo = leftInfo;
+
+    RwBBox rightBBox = *bbox;
+    SETCOORD(rightBBox.inf, axis, rightPlane);
+
+    RwUInt32 rightInfo = AddAtomicChild(p + 1, hi, &rightBBox, axis, nodeIndex, FALSE, sortedTriangles);
+    mBranchNodes[nodeIndex].rightInfo = rightInfo;
+}
+
+// Add one side of a top-level node, returning its info. A few small atomics share a chain, a single bigger atomic gets a
+// subtree (built later, the info is filled in when it's grafted), and anything else gets another top-level node.
+RwUInt32 JSPBuilder::AddAtomicChild(RwInt32 lo, RwInt32 hi, RwBBox* bbox, RwPlaneType axis, RwUInt32 nodeIndex, RwBool isLeft,
+                                    std::vector<TriangleData>* sortedTriangles)
+{
+    RwInt32 numTriangles = 0;
+
+    for (RwInt32 i = lo; i <= hi; i++) {
+        numTriangles += mAtomicSpans[i].hi + 1 - mAtomicSpans[i].lo;
+    }
+
+    RwBool done = (numTriangles <= MAXTRIANGLES || mBspDepth >= MAXBSPDEPTH - 1);
+
+    if (!done && lo < hi) {
+        RwUInt32 childIndex = (RwUInt32)mBranchNodes.size();
+
+        mBspDepth++;
+        RecurseAtomics(lo, hi, bbox, sortedTriangles);
+        mBspDepth--;
+
+        return CLUMPCOLL_MAKEINFO(kCLUMPCOLL_BRANCH, axis, childIndex);
+    }
+
+    RwUInt32 first = (RwUInt32)sortedTriangles->size();
+
+    for (RwInt32 i = lo; i <= hi; i++) {
+        sortedTriangles->insert(sortedTriangles->end(),
+                                mTriangles.begin() + mAtomicSpans[i].lo, mTriangles.begin() + mAtomicSpans[i].hi + 1);
+    }
+
+    if (done) {
+        // Every triangle still has HASNEXT from InitTriangles, so just end the chain
+        sortedTriangles->back().bspTri.flags &= ~kCLUMPCOLL_HASNEXT;
+        return CLUMPCOLL_MAKEINFO(kCLUMPCOLL_TRIANGLE, axis, first);
+    }
+
+    SubtreeJob job;
+    job.nodeIndex = nodeIndex;
+    job.isLeft = isLeft;
+    job.lo = (RwInt32)first;
+    job.hi = (RwInt32)sortedTriangles->size() - 1;
+    job.depth = mBspDepth + 1;
+    job.region = *bbox;
+    memset(&job.stats, 0, sizeof(job.stats));
+
+    mSubtreeJobs.push_back(std::move(job));
+
+    return CLUMPCOLL_MAKEINFO(kCLUMPCOLL_BRANCH, axis, 0);
+}
+
+// Build every atomic's subtree with its own builder, in parallel, and graft them onto the top-level nodes.
+void JSPBuilder::BuildSubtrees()
+{
+    RwInt32 numJobs = (RwInt32)mSubtreeJobs.size();
+
+    // Every top-level leaf was small enough to stay a chain
+    if (numJobs == 0) {
+        return;
+    }
+
+    // If there's fewer subtrees than threads, the leftover threads go to partitioning within them
+    RwInt32 subtreeThreads = (numJobs < mNumThreads) ? mNumThreads / numJobs : 1;
+
+    ParallelForBlocks(numJobs, mNumThreads, [&](RwInt32, RwInt32 begin, RwInt32 end) {
+        for (RwInt32 i = begin; i < end; i++) {
+            SubtreeJob& job = mSubtreeJobs[i];
+
+            JSPBuilder subtree;
+            subtree.mode = mode;
+            subtree.mJSP = mJSP;
+            subtree.mClump = mClump;
+            subtree.mNumThreads = subtreeThreads;
+            subtree.mBinnedSplits = mBinnedSplits;
+            subtree.collectStats = collectStats;
+            subtree.mBspDepth = job.depth;
+            subtree.mBBox = job.region;
+            memset(&subtree.mStats, 0, sizeof(subtree.mStats));
+
+            subtree.mTriangles.assign(mTriangles.begin() + job.lo, mTriangles.begin() + job.hi + 1);
+
+            // Query points inside the subtree's region. The count still says whether the model has any at all,
+            // since atomics without any get bigger leaves.
+            if (mStats.numQueryPoints > 0) {
+                for (RwV3d& point : mQueryPoints[0]) {
+                    if (point.x >= job.region.inf.x && point.x <= job.region.sup.x &&
+                        point.y >= job.region.inf.y && point.y <= job.region.sup.y &&
+                        point.z >= job.region.inf.z && point.z <= job.region.sup.z) {
+                        subtree.mQueryPoints[job.depth].push_back(point);
+                    }
+                }
+
+                subtree.mStats.numQueryPoints = mStats.numQueryPoints;
+            }
+
+            subtree.BuildTree();
+
+            // Each job has its own span, so the triangles can go straight back
+            std::copy(subtree.mTriangles.begin(), subtree.mTriangles.end(), mTriangles.begin() + job.lo);
+
+            job.nodes.swap(subtree.mBranchNodes);
+            job.stats = subtree.mStats;
+        }
+    });
+
+    for (SubtreeJob& job : mSubtreeJobs) {
+        RwUInt32 base = (RwUInt32)mBranchNodes.size();
+
+        for (ClumpCollBSPBranchNode node : job.nodes) {
+            RwUInt32* infos[2] = { &node.leftInfo, &node.rightInfo };
+
+            for (RwUInt32* info : infos) {
+                RwUInt32 offset = (CLUMPCOLL_GETNODETYPE(*info) == kCLUMPCOLL_BRANCH) ? base : (RwUInt32)job.lo;
+                *info = CLUMPCOLL_MAKEINFO(CLUMPCOLL_GETNODETYPE(*info), CLUMPCOLL_GETAXIS(*info), CLUMPCOLL_GETINDEX(*info) + offset);
+            }
+
+            mBranchNodes.push_back(node);
+        }
+
+        RwUInt32& parentInfo = job.isLeft ? mBranchNodes[job.nodeIndex].leftInfo : mBranchNodes[job.nodeIndex].rightInfo;
+        parentInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_BRANCH, CLUMPCOLL_GETAXIS(parentInfo), base);
+
+        if (job.stats.maxDepthReached > mStats.maxDepthReached) {
+            mStats.maxDepthReached = job.stats.maxDepthReached;
+        }
+
+        mStats.numAxisRetries += job.stats.numAxisRetries;
+        mStats.numMedianSplits += job.stats.numMedianSplits;
+        mStats.numBalancedSplits += job.stats.numBalancedSplits;
+
+        std::vector<ClumpCollBSPBranchNode>().swap(job.nodes);
+    }
+}
+
+// Initialize a bbox that surrounds the entire model
+void JSPBuilder::InitBBox(RwBBox* bbox)
+{
+    bbox->inf.x = bbox->inf.y = bbox->inf.z = INFINITY;
+    bbox->sup.x = bbox->sup.y = bbox->sup.z = -INFINITY;
+
+    if (worldSpace) {
+        // Geometries are in local space, so go by the transformed vertices instead
+        for (RwV3d& v : mJSP->stripVecList) {
+            bbox->AddPoint(&v);
+        }
+
+        return;
+    }
+
+#if 0
+    for (RpAtomic& atom : mClump->atomics) {
+        for (RwV3d& v : atom.geometry->morphTargets[0].verts) {
+            bbox->AddPoint(&v);
+        }
+    }
+#else
+    // Loop through all the geometries. Should be faster than looping through atomics (especially if they share geometries).
+    // If there's unused geometries, though, the bbox may start bigger than intended, which will lead to a less optimal tree.
+    // Correctly exported dffs shouldn't have that issue though.
+    for (RpGeometry& geom : mClump->geometries) {
+        for (RwV3d& v : geom.morphTargets[0].verts) {
+            bbox->AddPoint(&v);
+        }
+    }
+#endif
+}
+
+void JSPBuilder::CalcStripNormal(const RwV3d* p, RwBool reverse, RwV3d* normalOut)
+{
+    RwReal e1x = p[1].x - p[0].x, e1y = p[1].y - p[0].y, e1z = p[1].z - p[0].z;
+    RwReal e2x = p[2].x - p[0].x, e2y = p[2].y - p[0].y, e2z = p[2].z - p[0].z;
+    RwReal sign = reverse ? -1.0f : 1.0f;
+
+    normalOut->x = (e1y * e2z - e1z * e2y) * sign;
+    normalOut->y = (e1z * e2x - e1x * e2z) * sign;
+    normalOut->z = (e1x * e2y - e1y * e2x) * sign;
+}
+
+void JSPBuilder::InitTriangles()
+{
+    // Every triangle starts out in one big chain.
+    // They are also all solid for now.
+    // TODO need a way to support nonsolid atomics/triangles
+    TriangleData tri;
+    tri.bspTri.flags = kCLUMPCOLL_HASNEXT | kCLUMPCOLL_ISSOLID;
+    tri.bspTri.platData = 0; // TODO see what this means on PS2/Xbox. It's unused on GameCube
+
+    RwUInt32 stripVecOffset = 0;
+
+    // Where each atomic's triangles and vertices start, for the atomics that copy them
+    std::vector<RwUInt32> firstTriangles(mClump->atomics.size());
+    std::vector<RwUInt32> stripVecOffsets;
+    CalcAtomicStripOffsets(mClump, &stripVecOffsets);
+
+    // At most one triangle per strip index, minus the two that start each strip
+    RwUInt32 maxTriangles = 0;
+    for (RpAtomic& atom : mClump->atomics) {
+        for (RpMesh& mesh : atom.geometry->mesh.meshes) {
+            maxTriangles += (mesh.indices.size() > 2) ? (RwUInt32)mesh.indices.size() - 2 : 0;
+        }
+    }
+    mTriangles.reserve(maxTriangles);
+
+    // Scratch space for the strip bounds, reused for every mesh
+    std::vector<RwV3d> pairMins;
+    std::vector<RwV3d> pairMaxs;
+    std::vector<RwUInt8> degenerate;
+
+    for (RwUInt16 atomIndex = (RwUInt16)mClump->atomics.size(); atomIndex--;) {
+        RpAtomic& atom = mClump->atomics[atomIndex];
+        RpMorphTarget& mt = atom.geometry->morphTargets[0];
+        RwUInt16 meshVertOffset = 0;
+
+        tri.bspTri.v.i.atomIndex = atomIndex;
+
+        // Triangles are marked as visible if their containing atomic is visible.
+        // I believe this is only used for shadow rendering.
+        if (atom.flags & rpATOMICRENDER) {
+            tri.bspTri.flags |= kCLUMPCOLL_ISVISIBLE;
+        } else {
+            tri.bspTri.flags &= ~kCLUMPCOLL_ISVISIBLE;
+        }
+
+        firstTriangles[atomIndex] = (RwUInt32)mTriangles.size();
+        assert(stripVecOffsets[atomIndex] == stripVecOffset);
+
+        // Same geometry as an atomic we've already been through. Its triangles only differ by which atomic they're in
+        // and where their vertices are, so copy them instead of going through the strips again.
+        RwInt32 source = mSharedAtomics[atomIndex];
+
+        if (source >= 0) {
+            // The source was gone through right before atomic source - 1, which is at the latest this one
+            RwUInt32 end = firstTriangles[source - 1];
+
+            for (RwUInt32 i = firstTriangles[source]; i < end; i++) {
+                TriangleData copy = mTriangles[i];
+                copy.bspTri.v.i.atomIndex = atomIndex;
+                copy.bspTri.flags = (copy.bspTri.flags & ~kCLUMPCOLL_ISVISIBLE) | (tri.bspTri.flags & kCLUMPCOLL_ISVISIBLE);
+                copy.p += stripVecOffset - stripVecOffsets[source];
+
+                mTriangles.push_back(copy);
+            }
+
+            for (RpMesh& mesh : atom.geometry->mesh.meshes) {
+                stripVecOffset += (RwUInt32)mesh.indices.size();
+            }
+
+            continue;
+        }
+
+        // TODO need to validate mesh is tristrip (atom.geometry->mesh.flags contains primitive type)
+        // Non-tristrip is not supported
+
+        for (RwUInt16 meshIndex = 0; meshIndex < (RwUInt16)atom.geometry->mesh.meshes.size(); meshIndex++) {
+            RpMesh& mesh = atom.geometry->mesh.meshes[meshIndex];
+            RwInt32 numIndices = (RwInt32)mesh.indices.size();
+            RwInt32 numStripTriangles = numIndices - 2;
+
+            tri.bspTri.matIndex = mesh.matIndex;
+
+            if (numStripTriangles > 0) {
+                const RwV3d* verts = &mJSP->stripVecList[stripVecOffset];
+                const RxVertexIndex* indices = mesh.indices.data();
+
+                // Neighbouring triangles in a strip share two vertices, so take the bounds of each pair of neighbouring
+                // vertices first. Each triangle's bounds are then just the bounds of its two pairs.
+                pairMins.resize(numIndices - 1);
+                pairMaxs.resize(numIndices - 1);
+
+                for (RwInt32 i = 0; i < numIndices - 1; i++) {
+                    pairMins[i].x = std::min(verts[i].x, verts[i + 1].x);
+                    pairMins[i].y = std::min(verts[i].y, verts[i + 1].y);
+                    pairMins[i].z = std::min(verts[i].z, verts[i + 1].z);
+                    pairMaxs[i].x = std::max(verts[i].x, verts[i + 1].x);
+                    pairMaxs[i].y = std::max(verts[i].y, verts[i + 1].y);
+                    pairMaxs[i].z = std::max(verts[i].z, verts[i + 1].z);
+                }
+
+                // Filter out degenerate triangles (triangles with zero area)
+                degenerate.resize(numStripTriangles);
+
+                for (RwInt32 i = 0; i < numStripTriangles; i++) {
+                    degenerate[i] = (indices[i] == indices[i + 1]) | (indices[i] == indices[i + 2]) | (indices[i + 1] == indices[i + 2]);
+                }
+
+                for (RwInt32 i = 0; i < numStripTriangles; i++) {
+                    if (degenerate[i]) {
+                        continue;
+                    }
+
+                    tri.bspTri.v.i.meshVertIndex = meshVertOffset + (RwUInt16)i;
+                    tri.p = &mJSP->stripVecList[stripVecOffset + i];
+
+                    // Calculate the minimum and maximum coords of each triangle.
+                    // These are used to speedup partitioning
+                    tri.min.x = std::min(pairMins[i].x, pairMins[i + 1].x);
+                    tri.min.y = std::min(pairMins[i].y, pairMins[i + 1].y);
+                    tri.min.z = std::min(pairMins[i].z, pairMins[i + 1].z);
+                    tri.max.x = std::max(pairMaxs[i].x, pairMaxs[i + 1].x);
+                    tri.max.y = std::max(pairMaxs[i].y, pairMaxs[i + 1].y);
+                    tri.max.z = std::max(pairMaxs[i].z, pairMaxs[i + 1].z);
+
+                    // Since this is a tristrip, every 2nd triangle is in reverse orientation (clockwise).
+                    // This will be accounted for during collision checking at runtime.
+                    if (i % 2) {
+                        tri.bspTri.flags |= kCLUMPCOLL_ISREVERSE;
+                    } else {
+                        tri.bspTri.flags &= ~kCLUMPCOLL_ISREVERSE;
+                    }
+
+                    mTriangles.push_back(tri);
+                }
+            }
+
+            stripVecOffset += (RwUInt32)mesh.indices.size();
+            meshVertOffset += (RwUInt16)mesh.indices.size();
+        }
+    }
+
+    if (!triangleRules.empty()) {
+        ApplyTriangleRules();
+    }
+}
+
+// Flag the triangles the rules match, in one pass over all of them.
+// The slope limits are turned into limits on the normal's Y up front, so each triangle only needs its normal and a
+// few compares per rule, without any branches.
+void JSPBuilder::ApplyTriangleRules()
+{
+    struct RuleLimits
+    {
+        RwReal minNormalY;
+        RwReal maxNormalY;
+        RwInt32 matIndex;
+        RwInt32 atomIndex;
+        RwUInt8 flags;
+    };
+
+    std::vector<RuleLimits> limits;
+
+    for (const JSPTriangleRule& rule : triangleRules) {
+        RuleLimits l;
+        l.minNormalY = (rule.maxSlope >= 180.0f) ? -2.0f : cosf(rule.maxSlope * DEGTORAD);
+        l.maxNormalY = (rule.minSlope <= 0.0f) ? 2.0f : cosf(rule.minSlope * DEGTORAD);
+        l.matIndex = rule.matIndex;
+        l.atomIndex = rule.atomIndex;
+        l.flags = rule.flags;
+        limits.push_back(l);
+    }
+
+    RwInt32 numRules = (RwInt32)limits.size();
+    RwInt32 numTagged = 0;
+
+    for (TriangleData& tri : mTriangles) {
+        RwV3d normal;
+        tri.GetNormal(&normal);
+
+        RwReal lengthSq = normal.x * normal.x + normal.y * normal.y + normal.z * normal.z;
+        RwReal normalY = (lengthSq > 0.0f) ? normal.y / sqrtf(lengthSq) : 0.0f;
+
+        RwInt32 matIndex = tri.bspTri.matIndex;
+        RwInt32 atomIndex = tri.bspTri.v.i.atomIndex;
+        RwUInt8 flags = 0;
+
+        for (RwInt32 r = 0; r < numRules; r++) {
+            const RuleLimits& l = limits[r];
+            RwBool match = (normalY >= l.minNormalY) & (normalY <= l.maxNormalY) &
+                           ((l.matIndex < 0) | (l.matIndex == matIndex)) &
+                           ((l.atomIndex < 0) | (l.atomIndex == atomIndex));
+
+            flags |= (RwUInt8)(-match & l.flags);
+        }
+
+        tri.bspTri.flags |= flags;
+        numTagged += (flags != 0);
+    }
+
+    mStats.numTaggedTriangles = numTagged;
+}
+
+void JSPBuilder::InitQueryPoints()
+{
+    std::vector<RwV3d>& points = mQueryPoints[0];
+
+    points = queryPoints;
+
+    if (autoQueryPoints) {
+        // The player can only stand on upward facing triangles, so that's where most queries happen
+        for (TriangleData& tri : mTriangles) {
+            RwV3d normal;
+            tri.GetNormal(&normal);
+
+            RwReal length = sqrtf(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
+
+            if (length > 0.0f && normal.y / length >= WALKABLESLOPE) {
+                RwV3d center;
+                center.x = tri.GetCenter(rwXPLANE);
+                center.y = tri.GetCenter(rwYPLANE);
+                center.z = tri.GetCenter(rwZPLANE);
+                points.push_back(center);
+            }
+        }
+    }
+
+    mStats.numQueryPoints = (RwInt32)points.size();
+}
+
+// Copy the current node's query points that are on one side of a child's plane into the next depth's list.
+// Points in the overlap region go to both children, since queries there visit both.
+// Returns the number of points copied.
+RwInt32 JSPBuilder::GatherQueryPoints(RwPlaneType axis, RwReal value, RwBool isLeft)
+{
+    std::vector<RwV3d>& points = mQueryPoints[mBspDepth];
+    std::vector<RwV3d>& childPoints = mQueryPoints[mBspDepth + 1];
+
+    childPoints.clear();
+
+    for (RwV3d& point : points) {
+        RwReal coord = GETCOORD(point, axis);
+        if (isLeft ? (coord <= value) : (coord >= value)) {
+            childPoints.push_back(point);
+        }
+    }
+
+    return (RwInt32)childPoints.size();
+}
+
+// Hoare partition scheme implementation.
+// This sorts a span of triangles into left and right regions, in-place.
+// It returns the index of the last triangle in the left region.
+// https://en.wikipedia.org/wiki/Quicksort#Hoare_partition_scheme
+RwInt32 JSPBuilder::PartitionTriangles(RwInt32 lo, RwInt32 hi, RwReal splitPlane, RwPlaneType axis)
+{
+    if (mNumThreads > 1 && hi + 1 - lo >= PARALLELSPANSIZE) {
+        return ParallelPartitionTriangles(lo, hi, splitPlane, axis);
+    }
+
+    RwInt32 i = lo - 1;
+    RwInt32 j = hi + 1;
+
+    while (true) {
+        // We check the center of the triangle against the split coordinate.
+        // If it's less than the split coordinate (if the triangle is mostly on the left side), it goes in the left region.
+        // If it's greater or equal than the split coordinate (if the triangle is mostly on the right side), it goes in the right region.
+
+        do { i++; } while (i <= hi && mTriangles[i].GetCenter(axis) < splitPlane);
+        do { j--; } while (j >= lo && mTriangles[j].GetCenter(axis) >= splitPlane);
+
+        if (i >= j) return j;
+
+        TriangleData tmp = mTriangles[i];
+        mTriangles[i] = mTriangles[j];
+        mTriangles[j] = tmp;
+    }
+}
+
+// Partition for big spans (the top few levels of the tree), where the Hoare partition would leave every other thread
+// waiting. Each thread counts the left triangles in its block, a prefix sum over the counts gives every block where its
+// left and right triangles go, then each thread scatters its block into the partition buffer, which is copied back.
+// Same result as PartitionTriangles except for the order within each side, which nothing after it depends on
+// (SplitAtMedian breaks ties by vertex, and SortLeafChains sorts the leaves).
+RwInt32 JSPBuilder::ParallelPartitionTriangles(RwInt32 lo, RwInt32 hi, RwReal splitPlane, RwPlaneType axis)
+{
+    RwInt32 numTriangles = hi + 1 - lo;
+    RwInt32 numBlocks = mNumThreads;
+
+    std::vector<RwInt32> blockStarts(numBlocks, 0);
+    std::vector<RwInt32> blockLefts(numBlocks, 0);
+
+    ParallelForBlocks(numTriangles, numBlocks, [&](RwInt32 block, RwInt32 begin, RwInt32 end) {
+        RwInt32 numLeft = 0;
+
+        for (RwInt32 i = lo + begin; i < lo + end; i++) {
+            numLeft += (mTriangles[i].GetCenter(axis) < splitPlane);
+        }
+
+        blockStarts[block] = begin;
+        blockLefts[block] = numLeft;
+    });
+
+    // Left triangles go in block order from the start, right triangles in block order after all the left ones
+    RwInt32 totalLeft = 0;
+    for (RwInt32 block = 0; block < numBlocks; block++) {
+        totalLeft += blockLefts[block];
+    }
+
+    std::vector<RwInt32> leftOffsets(numBlocks);
+    std::vector<RwInt32> rightOffsets(numBlocks);
+    RwInt32 leftOffset = 0;
+
+    for (RwInt32 block = 0; block < numBlocks; block++) {
+        leftOffsets[block] = leftOffset;
+        rightOffsets[block] = totalLeft + (blockStarts[block] - leftOffset);
+        leftOffset += blockLefts[block];
+    }
+
+    if ((RwInt32)mPartitionBuffer.size() < numTriangles) {
+        mPartitionBuffer.resize(numTriangles);
+    }
+
+    ParallelForBlocks(numTriangles, numBlocks, [&](RwInt32 block, RwInt32 begin, RwInt32 end) {
+        RwInt32 left = leftOffsets[block];
+        RwInt32 right = rightOffsets[block];
+
+        for (RwInt32 i = lo + begin; i < lo + end; i++) {
+            if (mTriangles[i].GetCenter(axis) < splitPlane) {
+                mPartitionBuffer[left++] = mTriangles[i];
+            } else {
+                mPartitionBuffer[right++] = mTriangles[i];
+            }
+        }
+    });
+
+    ParallelForBlocks(numTriangles, numBlocks, [&](RwInt32, RwInt32 begin, RwInt32 end) {
+        std::copy(mPartitionBuffer.begin() + begin, mPartitionBuffer.begin() + end, mTriangles.begin() + lo + begin);
+    });
+
+    return lo + totalLeft - 1;
+}
+
+// Here we choose where to split the bounding box and along what axis.
+// There are many different ways of choosing this, some of which lead to more optimal trees than others.
+// Build policies. RecurseTriangles is instantiated for every combination of a split selector, a leaf criterion and a
+// stats collector, with all of them inlined into it, and RecurseTriangles(lo, hi, bbox) picks the one for the settings.
+// A new heuristic is a new policy, and doesn't add any checks to the builds that don't use it.
+
+// Split selectors choose the plane to split a node at.
+// This one chooses the longest side of the region and splits it down the middle.
+struct JSPBuilder::MidpointSplit
+{
+    static void Choose(JSPBuilder*, RwBBox* bbox, RwInt32, RwInt32, RwReal* splitPlaneOut, RwPlaneType* axisOut)
+    {
+        RwV3d dim;
+        dim.x = bbox->sup.x - bbox->inf.x;
+        dim.y = bbox->sup.y - bbox->inf.y;
+        dim.z = bbox->sup.z - bbox->inf.z;
+
+        RwPlaneType axis = rwXPLANE;
+        if (dim.y > GETCOORD(dim, axis)) axis = rwYPLANE;
+        if (dim.z > GETCOORD(dim, axis)) axis = rwZPLANE;
+
+        *splitPlaneOut = (GETCOORD(bbox->inf, axis) + GETCOORD(bbox->sup, axis)) / 2.0f;
+        *axisOut = axis;
+    }
+};
+
+// Lowest cost over the binned candidate planes, or down the middle if none of them split the triangles
+struct JSPBuilder::BinnedSplit
+{
+    static void Choose(JSPBuilder* builder, RwBBox* bbox, RwInt32 lo, RwInt32 hi, RwReal* splitPlaneOut, RwPlaneType* axisOut)
+    {
+        if (!builder->ChooseBinnedSplitPlane(bbox, lo, hi, splitPlaneOut, axisOut)) {
+            MidpointSplit::Choose(builder, bbox, lo, hi, splitPlaneOut, axisOut);
+        }
+    }
+};
+
+// Leaf criteria decide when a side of a split stops branching.
+// This one stops at a few triangles, or at the depth limit.
+struct JSPBuilder::SizeLeaf
+{
+    static const RwBool usesQueryPoints = FALSE;
+
+    static RwBool IsLeaf(JSPBuilder* builder, RwUInt32 numTriangles, RwPlaneType, RwReal, RwBool)
+    {
+        return numTriangles <= MAXTRIANGLES || builder->mBspDepth >= MAXBSPDEPTH - 1;
+    }
+};
+
+// With query points, areas without any can get away with bigger leaves. The query points also steer the splits in
+// nodes that have any (ChooseQuerySplitPlane), ahead of the split selector.
+struct JSPBuilder::QueryLeaf
+{
+    static const RwBool usesQueryPoints = TRUE;
+
+    static RwBool IsLeaf(JSPBuilder* builder, RwUInt32 numTriangles, RwPlaneType axis, RwReal plane, RwBool isLeft)
+    {
+        return SizeLeaf::IsLeaf(builder, numTriangles, axis, plane, isLeft) ||
+               (numTriangles <= MAXCOLDTRIANGLES && builder->GatherQueryPoints(axis, plane, isLeft) == 0);
+    }
+};
+
+// Stats collectors count what the build did, for JSPBuildStats
+struct JSPBuilder::BuildStatsCollector
+{
+    static void AddNode(JSPBuildStats* stats, RwInt32 depth) { if (depth > stats->maxDepthReached) stats->maxDepthReached = depth; }
+    static void AddBalancedSplit(JSPBuildStats* stats) { stats->numBalancedSplits++; }
+    static void AddAxisRetry(JSPBuildStats* stats) { stats->numAxisRetries++; }
+    static void AddMedianSplit(JSPBuildStats* stats) { stats->numMedianSplits++; }
+};
+
+struct JSPBuilder::NoStatsCollector
+{
+    static void AddNode(JSPBuildStats*, RwInt32) {}
+    static void AddBalancedSplit(JSPBuildStats*) {}
+    static void AddAxisRetry(JSPBuildStats*) {}
+    static void AddMedianSplit(JSPBuildStats*) {}
+};
+
+// Choose the split plane with the lowest expected cost, by the same cost model as JSPTreeStats.
+// Candidate planes are the boundaries of SPLITBINS bins along each axis. Each side costs its number of triangles times
+// the area of its region, which is the node's region cut off at the side's overlap plane.
+// Returns FALSE if no candidate plane splits the triangles.
+RwBool JSPBuilder::ChooseBinnedSplitPlane(RwBBox* bbox, RwInt32 lo, RwInt32 hi, RwReal* splitPlaneOut, RwPlaneType* axisOut)
+{
+    RwInt32 numTriangles = hi + 1 - lo;
+    RwReal bestCost = INFINITY;
+    RwBool found = FALSE;
+
+    for (RwUInt32 axis = 0; axis < sizeof(RwV3d); axis += 4) {
+        RwReal inf = GETCOORD(bbox->inf, axis);
+        RwReal size = GETCOORD(bbox->sup, axis) - inf;
+
+        if (size <= 0.0f) {
+            continue;
+        }
+
+        RwReal scale = SPLITBINS / size;
+        RwInt32 binCounts[SPLITBINS] = {};
+        RwReal binMins[SPLITBINS];
+        RwReal binMaxs[SPLITBINS];
+        RwReal binCenters[SPLITBINS];   // Lowest triangle center in each bin
+
+        for (RwInt32 bin = 0; bin < SPLITBINS; bin++) {
+            binMins[bin] = INFINITY;
+            binMaxs[bin] = -INFINITY;
+            binCenters[bin] = INFINITY;
+        }
+
+        for (RwInt32 i = lo; i <= hi; i++) {
+            TriangleData& tri = mTriangles[i];
+            RwReal center = tri.GetCenter((RwPlaneType)axis);
+            RwInt32 bin = (RwInt32)((center - inf) * scale);
+            if (bin < 0) bin = 0;
+            if (bin >= SPLITBINS) bin = SPLITBINS - 1;
+
+            binCounts[bin]++;
+            if (center < binCenters[bin]) binCenters[bin] = center;
+            if (GETCOORD(tri.min, axis) < binMins[bin]) binMins[bin] = GETCOORD(tri.min, axis);
+            if (GETCOORD(tri.max, axis) > binMaxs[bin]) binMaxs[bin] = GETCOORD(tri.max, axis);
+        }
+
+        // Right planes for each candidate, from the right, and the lowest triangle center on the right to split at
+        // (so the partition matches the bins exactly, like in ChooseQuerySplitPlane)
+        RwReal rightPlanes[SPLITBINS];
+        RwReal rightCenters[SPLITBINS];
+        RwReal rightPlane = INFINITY;
+        RwReal rightCenter = INFINITY;
+        for (RwInt32 bin = SPLITBINS - 1; bin > 0; bin--) {
+            if (binMins[bin] < rightPlane) rightPlane = binMins[bin];
+            if (binCenters[bin] < rightCenter) rightCenter = binCenters[bin];
+            rightPlanes[bin] = rightPlane;
+            rightCenters[bin] = rightCenter;
+        }
+
+        RwInt32 numLeft = 0;
+        RwReal leftPlane = -INFINITY;
+
+        for (RwInt32 bin = 1; bin < SPLITBINS; bin++) {
+            numLeft += binCounts[bin - 1];
+            if (binMaxs[bin - 1] > leftPlane) leftPlane = binMaxs[bin - 1];
+
+            RwInt32 numRight = numTriangles - numLeft;
+
+            if (numLeft == 0 || numRight == 0) {
+                continue;
+            }
+
+            RwBBox leftBBox = *bbox;
+            RwBBox rightBBox = *bbox;
+            SETCOORD(leftBBox.sup, axis, std::min(leftPlane, GETCOORD(bbox->sup, axis)));
+            SETCOORD(rightBBox.inf, axis, std::max(rightPlanes[bin], GETCOORD(bbox->inf, axis)));
+
+            RwReal cost = JSPBBoxArea(&leftBBox) * numLeft + JSPBBoxArea(&rightBBox) * numRight;
+
+            if (cost < bestCost) {
+                bestCost = cost;
+                *splitPlaneOut = rightCenters[bin];
+                *axisOut = (RwPlaneType)axis;
+                found = TRUE;
+            }
+        }
+    }
+
+    return found;
+}
+
+// Choose a split plane weighted by the query points.
+// Candidate planes are the boundaries of QUERYBINS bins along each axis. Each side costs its number of triangles times
+// the number of query points that would visit it (plus one, so the triangle counts still matter in empty areas).
+// Queries visit a side if they're within its overlap plane, so this also accounts for the overlap region.
+// This puts splits where the queries are, at the expense of areas nobody queries.
+// Returns FALSE if no candidate plane splits the triangles.
+RwBool JSPBuilder::ChooseQuerySplitPlane(RwBBox* bbox, RwInt32 lo, RwInt32 hi, RwReal* splitPlaneOut, RwPlaneType* axisOut)
+{
+    std::vector<RwV3d>& points = mQueryPoints[mBspDepth];
+    std::vector<RwReal> coords(points.size());
+
+    RwInt32 numTriangles = hi + 1 - lo;
+    RwReal bestCost = INFINITY;
+    RwBool found = FALSE;
+
+    for (RwUInt32 axis = 0; axis < sizeof(RwV3d); axis += 4) {
+        RwReal inf = GETCOORD(bbox->inf, axis);
+        RwReal size = GETCOORD(bbox->sup, axis) - inf;
+
+        if (size <= 0.0f) {
+            continue;
+        }
+
+        RwReal scale = QUERYBINS / size;
+        RwInt32 binCounts[QUERYBINS] = {};
+        RwReal binMins[QUERYBINS];
+        RwReal binMaxs[QUERYBINS];
+        RwReal binCenters[QUERYBINS];   // Lowest triangle center in each bin
+
+        for (RwInt32 bin = 0; bin < QUERYBINS; bin++) {
+            binMins[bin] = INFINITY;
+            binMaxs[bin] = -INFINITY;
+            binCenters[bin] = INFINITY;
+        }
+
+        for (RwInt32 i = lo; i <= hi; i++) {
+            TriangleData& tri = mTriangles[i];
+            RwReal center = tri.GetCenter((RwPlaneType)axis);
+            RwInt32 bin = (RwInt32)((center - inf) * scale);
+            if (bin < 0) bin = 0;
+            if (bin >= QUERYBINS) bin = QUERYBINS - 1;
+
+            binCounts[bin]++;
+            if (center < binCenters[bin]) binCenters[bin] = center;
+            if (GETCOORD(tri.min, axis) < binMins[bin]) binMins[bin] = GETCOORD(tri.min, axis);
+            if (GETCOORD(tri.max, axis) > binMaxs[bin]) binMaxs[bin] = GETCOORD(tri.max, axis);
+        }
+
+        // Sort the query points along the axis so we can count how many are on each side of a plane
+        for (RwUInt32 i = 0; i < points.size(); i++) {
+            coords[i] = GETCOORD(points[i], axis);
+        }
+        std::sort(coords.begin(), coords.end());
+
+        // Right planes for each candidate, from the right, and the lowest triangle center on the right.
+        // The bins only go up with the centers, so splitting at that center (instead of at the bin boundary, which
+        // can round either way) puts every triangle on the side it was counted on here.
+        RwReal rightPlanes[QUERYBINS];
+        RwReal rightCenters[QUERYBINS];
+        RwReal rightPlane = INFINITY;
+        RwReal rightCenter = INFINITY;
+        for (RwInt32 bin = QUERYBINS - 1; bin > 0; bin--) {
+            if (binMins[bin] < rightPlane) rightPlane = binMins[bin];
+            if (binCenters[bin] < rightCenter) rightCenter = binCenters[bin];
+            rightPlanes[bin] = rightPlane;
+            rightCenters[bin] = rightCenter;
+        }
+
+        RwInt32 numLeft = 0;
+        RwReal leftPlane = -INFINITY;
+
+        for (RwInt32 bin = 1; bin < QUERYBINS; bin++) {
+            numLeft += binCounts[bin - 1];
+            if (binMaxs[bin - 1] > leftPlane) leftPlane = binMaxs[bin - 1];
+
+            RwInt32 numRight = numTriangles - numLeft;
+
+            if (numLeft == 0 || numRight == 0) {
+                continue;
+            }
+
+            RwInt32 numLeftQueries = (RwInt32)(std::upper_bound(coords.begin(), coords.end(), leftPlane) - coords.begin());
+            RwInt32 numRightQueries = (RwInt32)(coords.end() - std::lower_bound(coords.begin(), coords.end(), rightPlanes[bin]));
+
+            RwReal cost = (RwReal)(numLeftQueries + 1) * numLeft + (RwReal)(numRightQueries + 1) * numRight;
+
+            if (cost < bestCost) {
+                bestCost = cost;
+                *splitPlaneOut = rightCenters[bin];
+                *axisOut = (RwPlaneType)axis;
+                found = TRUE;
+            }
+        }
+    }
+
+    return found;
+}
+
+// Build the tree over a span of triangles with the policies for the settings.
+void JSPBuilder::RecurseTriangles(RwInt32 lo, RwInt32 hi, RwBBox* bbox)
+{
+    typedef void (JSPBuilder::*RecurseFunc)(RwInt32 lo, RwInt32 hi, RwBBox* bbox);
+
+    // [binned splits][query points][collect stats]
+    static const RecurseFunc funcs[2][2][2] = {
+        {
+            { &JSPBuilder::RecurseTriangles<MidpointSplit, SizeLeaf, NoStatsCollector>,
+              &JSPBuilder::RecurseTriangles<MidpointSplit, SizeLeaf, BuildStatsCollector> },
+            { &JSPBuilder::RecurseTriangles<MidpointSplit, QueryLeaf, NoStatsCollector>,
+              &JSPBuilder::RecurseTriangles<MidpointSplit, QueryLeaf, BuildStatsCollector> }
+        },
+        {
+            { &JSPBuilder::RecurseTriangles<BinnedSplit, SizeLeaf, NoStatsCollector>,
+              &JSPBuilder::RecurseTriangles<BinnedSplit, SizeLeaf, BuildStatsCollector> },
+            { &JSPBuilder::RecurseTriangles<BinnedSplit, QueryLeaf, NoStatsCollector>,
+              &JSPBuilder::RecurseTriangles<BinnedSplit, QueryLeaf, BuildStatsCollector> }
+        }
+    };
+
+    RecurseFunc func = funcs[mBinnedSplits ? 1 : 0][(mStats.numQueryPoints > 0) ? 1 : 0][collectStats ? 1 : 0];
+    (this->*func)(lo, hi, bbox);
+}
+
+// Here we recursively partition and sort the triangles in-place, using a quicksort-like algorithm.
+// We also create the branch nodes in the process.
+template <typename Split, typename Leaf, typename Stats>
+void JSPBuilder::RecurseTriangles(RwInt32 lo, RwInt32 hi, RwBBox* bbox)
+{
+    assert(lo < hi);
+
+    dprintf("BSP Depth: %d\n", mBspDepth);
+
+    Stats::AddNode(&mStats, mBspDepth);
+
+    // If there are too many triangles to get down to leaf size by halving them until the depth limit,
+    // midpoint splits won't make it either. Split them evenly from here on, so the leaves at the limit stay balanced.
+    RwInt32 levelsLeft = MAXBSPDEPTH - mBspDepth;
+    RwBool balance = (levelsLeft < 24 && hi + 1 - lo > (MAXTRIANGLES << levelsLeft));
+
+    // The triangles can take up much less than the node's region, since it's only shrunk along the split axes.
+    // If they leave a big part of it empty, cut that off first, which also tightens the region for the split below.
+    RwBBox tightBBox;
+    CalcTriangleBounds(lo, hi, &tightBBox);
+
+    if (!balance && CutEmptySpace<Split, Leaf, Stats>(lo, hi, bbox, &tightBBox)) {
+        return;
+    }
+
+    RwPlaneType axis;
+    RwInt32 p;
+
+    if (balance) {
+        p = SplitAtMedian(lo, hi, &tightBBox, &axis);
+        Stats::AddBalancedSplit(&mStats);
+    } else {
+        // Here we choose a (hopefully) good split plane.
+        // This affects how balanced the tree is.
+        // If there are query points in this node, split where they say the queries are.
+        RwReal splitPlane;
+
+        if (!Leaf::usesQueryPoints || mQueryPoints[mBspDepth].empty() ||
+            !ChooseQuerySplitPlane(bbox, lo, hi, &splitPlane, &axis)) {
+            Split::Choose(this, bbox, lo, hi, &splitPlane, &axis);
+        }
+
+        dprintf("(%f %f %f) (%f %f %f)\n",
+               bbox->inf.x, bbox->inf.y, bbox->inf.z,
+               bbox->sup.x, bbox->sup.y, bbox->sup.z);
+
+        dprintf("Split plane: %f, axis: ", splitPlane);
+        switch (axis) {
+        case rwXPLANE: dprintf("X\n"); break;
+        case rwYPLANE: dprintf("Y\n"); break;
+        case rwZPLANE: dprintf("Z\n"); break;
+        }
+
+        // Here we partition the triangles along the split plane, sorting them into left and right regions.
+        p = PartitionTriangles(lo, hi, splitPlane, axis);
+
+#ifndef NDEBUG
+        for (RwInt32 i = lo; i <= p; i++) {
+            assert(mTriangles[i].GetCenter(axis) < splitPlane);
+        }
+
+        for (RwInt32 i = p + 1; i <= hi; i++) {
+            assert(mTriangles[i].GetCenter(axis) >= splitPlane);
+        }
+#endif
+
+        // If everything went to one side, that side is just the same triangles again. That's only useful if it at
+        // least shrinks the region (like an empty space cut), otherwise it would keep going until the depth limit.
+        if ((p < lo && GETCOORD(tightBBox.inf, axis) <= GETCOORD(bbox->inf, axis)) ||
+            (p >= hi && GETCOORD(tightBBox.sup, axis) >= GETCOORD(bbox->sup, axis))) {
+            p = FallbackSplit<Stats>(lo, hi, &tightBBox, &axis);
+        }
+    }
+
+    // Calculate left and right overlap planes.
+    RwReal leftPlane, rightPlane;
+    CalcOverlapPlanes(lo, p, hi, axis, &leftPlane, &rightPlane);
+
+    RwUInt32 numLeft = p + 1 - lo;
+    RwUInt32 numRight = hi - p;
+
+    // We can stop branching once we only have a few triangles left, or if we've hit the BSP depth limit.
+    RwBool doneLeft = Leaf::IsLeaf(this, numLeft, axis, leftPlane, TRUE);
+    RwBool doneRight = Leaf::IsLeaf(this, numRight, axis, rightPlane, FALSE);
+
+    dprintf("Left %d, Right %d\n", numLeft, numRight);
+    dprintf("Left %f, Right %f\n", leftPlane, rightPlane);
+
+    // Here we create the branch node for the current level and add it to the tree.
+    RwUInt32 nodeIndex = (RwUInt32)mBranchNodes.size();
+
+    mBranchNodes.emplace_back();
+
+    mBranchNodes[nodeIndex].leftValue = leftPlane;
+    mBranchNodes[nodeIndex].rightValue = rightPlane;
+
+    if (!doneLeft) {
+        // Store a pointer to the left branch node.
+        mBranchNodes[nodeIndex].leftInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_BRANCH, axis, mBranchNodes.size());
+
+        // Shrink the bbox to the left region.
+        RwBBox leftBBox = *bbox;
+        SETCOORD(leftBBox.sup, axis, leftPlane);
+
+        // Recurse down the left branch.
+        if (Leaf::usesQueryPoints) {
+            GatherQueryPoints(axis, leftPlane, TRUE);
+        }
+
+        mBspDepth++;
+        RecurseTriangles<Split, Leaf, Stats>(lo, p, &leftBBox);
+        mBspDepth--;
+    } else {
+        // We're done branching, so store a pointer to the list of triangles.
+        mBranchNodes[nodeIndex].leftInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_TRIANGLE, axis, lo);
+    }
+
+    if (!doneRight) {
+        // Store a pointer to the right branch node.
+        mBranchNodes[nodeIndex].rightInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_BRANCH, axis, mBranchNodes.size());
+
+        // Shrink the bbox to the right region.
+        RwBBox rightBBox = *bbox;
+        SETCOORD(rightBBox.inf, axis, rightPlane);
+
+        // Recurse down the right branch.
+        if (Leaf::usesQueryPoints) {
+            GatherQueryPoints(axis, rightPlane, FALSE);
+        }
+
+        mBspDepth++;
+        RecurseTriangles<Split, Leaf, Stats>(p + 1, hi, &rightBBox);
+        mBspDepth--;
+    } else {
+        // We're done branching, so save a pointer to the list of triangles.
+        mBranchNodes[nodeIndex].rightInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_TRIANGLE, axis, p + 1);
+    }
+
+    TerminateChains(lo, p, hi);
+}
+
+// Used when a split plane leaves every triangle on one side.
+// Split down the middle of the triangle centers instead, trying the axis they're most spread out on first. That always
+// splits them unless the centers are all in the same spot, in which case split at the median triangle.
+template <typename Stats>
+RwInt32 JSPBuilder::FallbackSplit(RwInt32 lo, RwInt32 hi, const RwBBox* tightBBox, RwPlaneType* axisOut)
+{
+    RwBBox centerBBox;
+    CalcCenterBounds(mTriangles.data(), lo, hi, &centerBBox);
+
+    RwInt32 p = SplitCenters(&centerBBox, lo, hi, axisOut, [&](RwReal splitPlane, RwPlaneType axis) {
+        return PartitionTriangles(lo, hi, splitPlane, axis);
+    });
+
+    if (p >= lo) {
+        Stats::AddAxisRetry(&mStats);
+        return p;
+    }
+
+    Stats::AddMedianSplit(&mStats);
+    return SplitAtMedian(lo, hi, tightBBox, axisOut);
+}
+
+// Split a span in half at its median triangle along the longest side of its bounds.
+// Both halves always get triangles, no matter how bunched up they are.
+RwInt32 JSPBuilder::SplitAtMedian(RwInt32 lo, RwInt32 hi, const RwBBox* tightBBox, RwPlaneType* axisOut)
+{
+    RwPlaneType axis = rwXPLANE;
+    if (tightBBox->sup.y - tightBBox->inf.y > GETCOORD(tightBBox->sup, axis) - GETCOORD(tightBBox->inf, axis)) axis = rwYPLANE;
+    if (tightBBox->sup.z - tightBBox->inf.z > GETCOORD(tightBBox->sup, axis) - GETCOORD(tightBBox->inf, axis)) axis = rwZPLANE;
+
+    RwInt32 mid = lo + (hi - lo) / 2;
+
+    // Triangles with the same center are ordered by their vertices, so which side they end up on doesn't depend on the
+    // order the partitions left them in (ParallelPartitionTriangles orders them differently than PartitionTriangles)
+    std::nth_element(mTriangles.begin() + lo, mTriangles.begin() + mid, mTriangles.begin() + hi + 1,
+                     [=](const TriangleData& a, const TriangleData& b) {
+                         RwReal centerA = a.GetCenter(axis);
+                         RwReal centerB = b.GetCenter(axis);
+                         return (centerA != centerB) ? (centerA < centerB) : (a.p < b.p);
+                     });
+
+    *axisOut = axis;
+    return mid;
+}
+
+// Calculate the bounds of a span of triangles.
+void JSPBuilder::CalcTriangleBounds(RwInt32 lo, RwInt32 hi, RwBBox* bboxOut)
+{
+    if (mNumThreads == 1 || hi + 1 - lo < PARALLELSPANSIZE) {
+        bboxOut->inf = mTriangles[lo].min;
+        bboxOut->sup = mTriangles[lo].max;
+
+        for (RwInt32 i = lo + 1; i <= hi; i++) {
+            bboxOut->AddPoint(&mTriangles[i].min);
+            bboxOut->AddPoint(&mTriangles[i].max);
+        }
+
+        return;
+    }
+
+    RwInt32 numBlocks = mNumThreads;
+    std::vector<RwBBox> blockBounds(numBlocks);
+
+    // Each block bounds its own triangles, then the blocks' bounds are merged
+    ParallelForBlocks(hi + 1 - lo, numBlocks, [&](RwInt32 block, RwInt32 begin, RwInt32 end) {
+        RwBBox& bounds = blockBounds[block];
+        bounds.inf = mTriangles[lo + begin].min;
+        bounds.sup = mTriangles[lo + begin].max;
+
+        for (RwInt32 i = lo + begin + 1; i < lo + end; i++) {
+            bounds.AddPoint(&mTriangles[i].min);
+            bounds.AddPoint(&mTriangles[i].max);
+        }
+    });
+
+    *bboxOut = blockBounds[0];
+
+    for (RwInt32 block = 1; block < numBlocks; block++) {
+        bboxOut->AddPoint(&blockBounds[block].inf);
+        bboxOut->AddPoint(&blockBounds[block].sup);
+    }
+}
+
+// Find the biggest empty gap between a node's region and the tight bounds of what's in it, relative to the size of the
+// region. Returns FALSE if there's none worth cutting off.
+RwBool JSPBuilder::FindEmptySpace(const RwBBox* bbox, const RwBBox* tightBBox, RwPlaneType* axisOut, RwBool* cutLowOut)
+{
+    // Leave most of the depth for actual splits
+    if (mBspDepth >= MAXBSPDEPTH / 2) {
+        return FALSE;
+    }
+
+    RwReal bestGap = EMPTYCUTRATIO;
+    RwBool found = FALSE;
+
+    for (RwUInt32 a = 0; a < sizeof(RwV3d); a += 4) {
+        RwReal size = GETCOORD(bbox->sup, a) - GETCOORD(bbox->inf, a);
+
+        if (size <= 0.0f) {
+            continue;
+        }
+
+        RwReal lowGap = (GETCOORD(tightBBox->inf, a) - GETCOORD(bbox->inf, a)) / size;
+        RwReal highGap = (GETCOORD(bbox->sup, a) - GETCOORD(tightBBox->sup, a)) / size;
+
+        if (lowGap >= bestGap) {
+            bestGap = lowGap;
+            *axisOut = (RwPlaneType)a;
+            *cutLowOut = TRUE;
+            found = TRUE;
+        }
+
+        if (highGap >= bestGap) {
+            bestGap = highGap;
+            *axisOut = (RwPlaneType)a;
+            *cutLowOut = FALSE;
+            found = TRUE;
+        }
+    }
+
+    return found;
+}
+
+// Empty space cutting, like in a BIH.
+// If the triangles leave a big part of the node's region empty on one side, add a node that keeps all the triangles on
+// one side, bounded by the triangles themselves, and has nothing on the other side. Queries that only touch the empty
+// part stop right there. Returns TRUE if a node was added (and the triangles recursed into).
+template <typename Split, typename Leaf, typename Stats>
+RwBool JSPBuilder::CutEmptySpace(RwInt32 lo, RwInt32 hi, RwBBox* bbox, const RwBBox* tightBBox)
+{
+    RwPlaneType axis;
+    RwBool cutLow;
+
+    if (!FindEmptySpace(bbox, tightBBox, &axis, &cutLow)) {
+        return FALSE;
+    }
+
+    RwUInt32 nodeIndex = (RwUInt32)mBranchNodes.size();
+
+    mBranchNodes.emplace_back();
+
+    // The empty side has an infinite plane so it's never visited, its info just points at the triangles
+    RwBBox childBBox = *bbox;
+    RwReal plane;
+
+    if (cutLow) {
+        plane = GETCOORD(tightBBox->inf, axis);
+        SETCOORD(childBBox.inf, axis, plane);
+
+        mBranchNodes[nodeIndex].leftInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_TRIANGLE, axis, lo);
+        mBranchNodes[nodeIndex].leftValue = -INFINITY;
+        mBranchNodes[nodeIndex].rightInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_BRANCH, axis, mBranchNodes.size());
+        mBranchNodes[nodeIndex].rightValue = plane;
+    } else {
+        plane = GETCOORD(tightBBox->sup, axis);
+        SETCOORD(childBBox.sup, axis, plane);
+
+        mBranchNodes[nodeIndex].leftInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_BRANCH, axis, mBranchNodes.size());
+        mBranchNodes[nodeIndex].leftValue = plane;
+        mBranchNodes[nodeIndex].rightInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_TRIANGLE, axis, lo);
+        mBranchNodes[nodeIndex].rightValue = INFINITY;
+    }
+
+    if (Leaf::usesQueryPoints) {
+        GatherQueryPoints(axis, plane, !cutLow);
+    }
+
+    mBspDepth++;
+    RecurseTriangles<Split, Leaf, Stats>(lo, hi, &childBBox);
+    mBspDepth--;
+
+    return TRUE;
+}
+
+// Calculate left and right overlap planes of a partitioned span.
+// Left plane is the maximum coordinate of the left triangles.
+// Right plane is the minimum coordinate of the right triangles.
+void JSPBuilder::CalcOverlapPlanes(RwInt32 lo, RwInt32 p, RwInt32 hi, RwPlaneType axis, RwReal* leftPlaneOut, RwReal* rightPlaneOut)
+{
+    if (mNumThreads == 1 || hi + 1 - lo < PARALLELSPANSIZE) {
+        CalcSpanOverlapPlanes(mTriangles.data(), lo, hi + 1, p, axis, leftPlaneOut, rightPlaneOut);
+        return;
+    }
+
+    RwInt32 numBlocks = mNumThreads;
+    std::vector<RwReal> leftPlanes(numBlocks, -INFINITY);
+    std::vector<RwReal> rightPlanes(numBlocks, INFINITY);
+
+    // Each block takes the max of its left triangles and the min of its right triangles, then the blocks are combined
+    ParallelForBlocks(hi + 1 - lo, numBlocks, [&](RwInt32 block, RwInt32 begin, RwInt32 end) {
+        CalcSpanOverlapPlanes(mTriangles.data(), lo + begin, lo + end, p, axis, &leftPlanes[block], &rightPlanes[block]);
+    });
+
+    *leftPlaneOut = *std::max_element(leftPlanes.begin(), leftPlanes.end());
+    *rightPlaneOut = *std::min_element(rightPlanes.begin(), rightPlanes.end());
+}
+
+// Delimit the left and right regions of a partitioned span by marking their last triangles as not having a sibling.
+void JSPBuilder::TerminateChains(RwInt32 lo, RwInt32 p, RwInt32 hi)
+{
+    // If p < lo, that means there are no triangles in the left region.
+    if (p >= lo) {
+        mTriangles[p].bspTri.flags &= ~kCLUMPCOLL_HASNEXT;
+    }
+
+    // If p + 1 > hi, that means there are no triangles in the right region.
+    if (p + 1 <= hi) {
+        mTriangles[hi].bspTri.flags &= ~kCLUMPCOLL_HASNEXT;
+    }
+}
+
+// Order the triangles in each leaf chain by where their vertices are in the strip vec list,
+// which is the same as by atomic and then by mesh vertex. Consecutive triangle tests then touch neighbouring memory
+// instead of jumping around wherever partitioning left them.
+void JSPBuilder::SortLeafChains()
+{
+    RwInt32 numTriangles = (RwInt32)mTriangles.size();
+    RwInt32 start = 0;
+
+    while (start < numTriangles) {
+        // Every chain is a contiguous span ending in a triangle without HASNEXT
+        RwInt32 end = start;
+        while (end < numTriangles - 1 && (mTriangles[end].bspTri.flags & kCLUMPCOLL_HASNEXT)) {
+            end++;
+        }
+
+        if (end > start) {
+            RwBool terminated = !(mTriangles[end].bspTri.flags & kCLUMPCOLL_HASNEXT);
+
+            std::sort(mTriangles.begin() + start, mTriangles.begin() + end + 1,
+                      [](const TriangleData& a, const TriangleData& b) { return a.p < b.p; });
+
+            for (RwInt32 i = start; i <= end; i++) {
+                mTriangles[i].bspTri.flags |= kCLUMPCOLL_HASNEXT;
+            }
+
+            if (terminated) {
+                mTriangles[end].bspTri.flags &= ~kCLUMPCOLL_HASNEXT;
+            }
+        }
+
+        start = end + 1;
+    }
+}
+
+// Spread the lower 10 bits of v out so there are two zero bits between each of them.
+static RwUInt32 ExpandMortonBits(RwUInt32 v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// Bits are interleaved as ...xyzxyz, so bit 0 is Z, bit 1 is Y and bit 2 is X.
+static RwPlaneType GetMortonBitAxis(RwInt32 bit)
+{
+    switch (bit % 3) {
+    case 0: return rwZPLANE;
+    case 1: return rwYPLANE;
+    default: return rwXPLANE;
+    }
+}
+
+// Calculate a 30-bit Morton code for every triangle center and sort the triangles by it.
+// The sort is a parallel LSD radix sort (per-block histograms, prefix sum, scatter), which is stable,
+// so the result doesn't depend on the number of threads.
+void JSPBuilder::SortMortonCodes()
+{
+    RwInt32 numTriangles = (RwInt32)mTriangles.size();
+
+    // ParallelForBlocks never runs more blocks than triangles, and the prefix sum has to go over the same blocks
+    RwInt32 numBlocks = std::max(1, std::min(mNumThreads, numTriangles));
+
+    // Quantize relative to the bbox of the triangle centers, not the whole model,
+    // so we don't waste any bits on space that only has triangle edges in it.
+    RwBBox centerBBox;
+    centerBBox.inf.x = centerBBox.inf.y = centerBBox.inf.z = INFINITY;
+    centerBBox.sup.x = centerBBox.sup.y = centerBBox.sup.z = -INFINITY;
+
+    for (TriangleData& tri : mTriangles) {
+        RwV3d center;
+        center.x = tri.GetCenter(rwXPLANE);
+        center.y = tri.GetCenter(rwYPLANE);
+        center.z = tri.GetCenter(rwZPLANE);
+        centerBBox.AddPoint(&center);
+    }
+
+    RwV3d scale;
+    for (RwUInt32 axis = 0; axis < sizeof(RwV3d); axis += 4) {
+        RwReal size = GETCOORD(centerBBox.sup, axis) - GETCOORD(centerBBox.inf, axis);
+        SETCOORD(scale, axis, (size > 0.0f) ? 1023.0f / size : 0.0f);
+    }
+
+    std::vector<RwUInt32> codes(numTriangles);
+    std::vector<RwUInt32> order(numTriangles);
+
+    ParallelForBlocks(numTriangles, numBlocks, [&](RwInt32, RwInt32 begin, RwInt32 end) {
+        for (RwInt32 i = begin; i < end; i++) {
+            RwUInt32 code = 0;
+            for (RwUInt32 axis = 0; axis < sizeof(RwV3d); axis += 4) {
+                RwReal q = (mTriangles[i].GetCenter((RwPlaneType)axis) - GETCOORD(centerBBox.inf, axis)) * GETCOORD(scale, axis);
+                RwUInt32 cell = (q > 0.0f) ? (RwUInt32)q : 0;
+                if (cell > 1023) cell = 1023;
+
+                // X goes in the highest bit of each triplet, Z in the lowest
+                code |= ExpandMortonBits(cell) << (2 - axis / 4);
+            }
+            codes[i] = code;
+            order[i] = (RwUInt32)i;
+        }
+    });
+
+    std::vector<RwUInt32> tmpCodes(numTriangles);
+    std::vector<RwUInt32> tmpOrder(numTriangles);
+    std::vector<RwUInt32> counts((size_t)numBlocks << MORTONRADIXBITS);
+
+    const RwUInt32 numBuckets = 1 << MORTONRADIXBITS;
+
+    for (RwInt32 shift = 0; shift < MORTONBITS; shift += MORTONRADIXBITS) {
+        // Count each block's digits
+        ParallelForBlocks(numTriangles, numBlocks, [&](RwInt32 block, RwInt32 begin, RwInt32 end) {
+            RwUInt32* blockCounts = &counts[(size_t)block * numBuckets];
+            memset(blockCounts, 0, numBuckets * sizeof(RwUInt32));
+            for (RwInt32 i = begin; i < end; i++) {
+                blockCounts[(codes[i] >> shift) & (numBuckets - 1)]++;
+            }
+        });
+
+        // Turn the counts into each block's starting offset for each digit
+        RwUInt32 offset = 0;
+        for (RwUInt32 bucket = 0; bucket < numBuckets; bucket++) {
+            for (RwInt32 block = 0; block < numBlocks; block++) {
+                RwUInt32& count = counts[(size_t)block * numBuckets + bucket];
+                RwUInt32 n = count;
+                count = offset;
+                offset += n;
+            }
+        }
+
+        // Scatter
+        ParallelForBlocks(numTriangles, numBlocks, [&](RwInt32 block, RwInt32 begin, RwInt32 end) {
+            RwUInt32* blockOffsets = &counts[(size_t)block * numBuckets];
+            for (RwInt32 i = begin; i < end; i++) {
+                RwUInt32 dest = blockOffsets[(codes[i] >> shift) & (numBuckets - 1)]++;
+                tmpCodes[dest] = codes[i];
+                tmpOrder[dest] = order[i];
+            }
+        });
+
+        codes.swap(tmpCodes);
+        order.swap(tmpOrder);
+    }
+
+    std::vector<TriangleData> sorted(numTriangles);
+
+    ParallelForBlocks(numTriangles, numBlocks, [&](RwInt32, RwInt32 begin, RwInt32 end) {
+        for (RwInt32 i = begin; i < end; i++) {
+            sorted[i] = mTriangles[order[i]];
+        }
+    });
+
+    mTriangles.swap(sorted);
+    mMortonCodes.swap(codes);
+}
+
+// Make the tree from the sorted Morton codes.
+// Every span shares all the code bits above the given bit, so the first bit that differs between the first and last
+// triangle splits it into two, like a radix tree. Each bit belongs to an axis, which becomes the node's split axis.
+// The nodes come out in the same order and format as RecurseTriangles.
+void JSPBuilder::RecurseMorton(RwInt32 lo, RwInt32 hi, RwInt32 bit)
+{
+    assert(lo < hi);
+
+    if (mBspDepth > mStats.maxDepthReached) {
+        mStats.maxDepthReached = mBspDepth;
+    }
+
+    // Find the highest differing bit. The codes are sorted, so comparing the ends of the span is enough.
+    RwUInt32 diff = mMortonCodes[lo] ^ mMortonCodes[hi];
+    while (bit >= 0 && !(diff & (1u << bit))) {
+        bit--;
+    }
+
+    RwInt32 p;
+    RwPlaneType axis;
+
+    if (bit >= 0) {
+        // Binary search for the last triangle with the bit cleared
+        RwInt32 first = lo;
+        RwInt32 last = hi;
+        while (first < last) {
+            RwInt32 mid = (first + last) / 2;
+            if (mMortonCodes[mid] & (1u << bit)) {
+                last = mid;
+            } else {
+                first = mid + 1;
+            }
+        }
+
+        p = first - 1;
+        axis = GetMortonBitAxis(bit);
+    } else {
+        // All the triangles fall in the same cell, just split the span in half
+        p = (lo + hi) / 2;
+        axis = rwXPLANE;
+    }
+
+    RwReal leftPlane, rightPlane;
+    CalcOverlapPlanes(lo, p, hi, axis, &leftPlane, &rightPlane);
+
+    RwUInt32 numLeft = p + 1 - lo;
+    RwUInt32 numRight = hi - p;
+    RwBool doneLeft = (numLeft <= MAXTRIANGLES || mBspDepth >= MAXBSPDEPTH - 1);
+    RwBool doneRight = (numRight <= MAXTRIANGLES || mBspDepth >= MAXBSPDEPTH - 1);
+
+    RwUInt32 nodeIndex = (RwUInt32)mBranchNodes.size();
+
+    mBranchNodes.emplace_back();
+
+    mBranchNodes[nodeIndex].leftValue = leftPlane;
+    mBranchNodes[nodeIndex].rightValue = rightPlane;
+
+    if (!doneLeft) {
+        mBranchNodes[nodeIndex].leftInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_BRANCH, axis, mBranchNodes.size());
+
+        mBspDepth++;
+        RecurseMorton(lo, p, bit - 1);
+        mBspDepth--;
+    } else {
+        mBranchNodes[nodeIndex].leftInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_TRIANGLE, axis, lo);
+    }
+
+    if (!doneRight) {
+        mBranchNodes[nodeIndex].rightInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_BRANCH, axis, mBranchNodes.size());
+
+        mBspDepth++;
+        RecurseMorton(p + 1, hi, bit - 1);
         mBspDepth--;
     } else {
-        // We're done branching, so save a pointer to the list of triangles.
-        mJSP->colltree.branchNodes[nodeIndex].rightInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_TRIANGLE, axis, p + 1);
+        mBranchNodes[nodeIndex].rightInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_TRIANGLE, axis, p + 1);
     }
 
-    // Now we delimit the left and right regions by marking their last triangles as not having a sibling.
+    TerminateChains(lo, p, hi);
+}
 
-    // If p < lo, that means there are no triangles in the left region.
-    if (p >= lo) {
-        mTriangles[p].bspTri.flags &= ~kCLUMPCOLL_HASNEXT;
+// Treelet restructuring pass.
+// The tree is cut into small disjoint treelets of up to TREELETLEAVES leaves (each leaf being a triangle chain or another
+// treelet). For each one, we search for the cheapest way of arranging its leaves under its internal nodes and replace
+// it if that beats the current arrangement. Each treelet keeps its node slots and its leaves keep their triangles,
+// so treelets can be processed in parallel, bottom-up, one level of treelets at a time.
+void JSPBuilder::OptimizeTreelets(RwBBox* bbox)
+{
+    JSPTreeStats statsBefore;
+    statsBefore.Calculate(&mBranchNodes[0], (RwUInt32)mBranchNodes.size(),
+                          &mTriangles[0].bspTri.flags, sizeof(TriangleData), (RwUInt32)mTriangles.size(), bbox);
+
+    mNodeInfo.resize(mBranchNodes.size());
+    CalcNodeInfo(0, bbox, 0);
+
+    std::vector<Treelet> treelets;
+    std::vector<RwInt32> heights;
+    FormTreelets(&treelets, &heights);
+
+    // Group the treelets by height so each group only depends on the ones before it
+    RwInt32 maxHeight = 0;
+    for (RwInt32 height : heights) {
+        if (height > maxHeight) maxHeight = height;
     }
 
-    // If p + 1 > hi, that means there are no triangles in the right region.
-    if (p + 1 <= hi) {
-        mTriangles[hi].bspTri.flags &= ~kCLUMPCOLL_HASNEXT;
+    std::vector<std::vector<RwInt32>> groups(maxHeight + 1);
+    for (RwInt32 i = 0; i < (RwInt32)treelets.size(); i++) {
+        groups[heights[i]].push_back(i);
+    }
+
+    RwInt32 numRestructured = 0;
+    std::vector<RwInt32> restructured(treelets.size(), 0);
+
+    for (std::vector<RwInt32>& group : groups) {
+        ParallelForBlocks((RwInt32)group.size(), GetNumWorkerThreads(), [&](RwInt32, RwInt32 begin, RwInt32 end) {
+            for (RwInt32 i = begin; i < end; i++) {
+                restructured[group[i]] = OptimizeTreelet(&treelets[group[i]], group[i]);
+            }
+        });
+    }
+
+    for (RwInt32 r : restructured) {
+        numRestructured += r;
+    }
+
+    // Put the nodes back in depth-first order, and drop any that are no longer used
+    ReorderBranchNodes();
+
+    mStats.maxDepthReached = mNodeInfo[0].height - 1;
+    std::vector<NodeInfo>().swap(mNodeInfo);
+
+    JSPTreeStats statsAfter;
+    statsAfter.Calculate(&mBranchNodes[0], (RwUInt32)mBranchNodes.size(),
+                         &mTriangles[0].bspTri.flags, sizeof(TriangleData), (RwUInt32)mTriangles.size(), bbox);
+
+    mStats.numTreelets = (RwInt32)treelets.size();
+    mStats.numRestructuredTreelets = numRestructured;
+    mStats.costBefore = statsBefore.cost;
+    mStats.costAfter = statsAfter.cost;
+}
+
+static void MergeBBox(RwBBox* bbox, const RwBBox* other)
+{
+    bbox->AddPoint(&other->inf);
+    bbox->AddPoint(&other->sup);
+}
+
+// Clip a node's region to one side of a split plane.
+static void ClipRegion(RwBBox* region, RwPlaneType axis, RwReal value, RwBool isLeft)
+{
+    if (isLeft) {
+        if (value < GETCOORD(region->sup, axis)) SETCOORD(region->sup, axis, value);
+    } else {
+        if (value > GETCOORD(region->inf, axis)) SETCOORD(region->inf, axis, value);
+    }
+}
+
+static RwBool IsSingleBit(RwUInt32 set)
+{
+    return set == (set & (0u - set));
+}
+
+static RwInt32 GetLowestBitIndex(RwUInt32 set)
+{
+    RwInt32 index = 0;
+    while (!(set & 1)) {
+        set >>= 1;
+        index++;
+    }
+    return index;
+}
+
+// Get the bounds, costs and height of a node's child. Returns FALSE if the child is empty.
+RwBool JSPBuilder::GetChildLeaf(RwUInt32 info, RwReal value, TreeletLeaf* leafOut)
+{
+    // Children with an infinite plane have no triangles (their info still points at the other side's triangles)
+    if (isinf(value)) {
+        return FALSE;
+    }
+
+    RwUInt32 index = CLUMPCOLL_GETINDEX(info);
+
+    leafOut->info = info & ~0xC;
+
+    if (CLUMPCOLL_GETNODETYPE(info) == kCLUMPCOLL_BRANCH) {
+        leafOut->bounds = mNodeInfo[index].bounds;
+        leafOut->cost = mNodeInfo[index].cost;
+        leafOut->regionCost = mNodeInfo[index].regionCost;
+        leafOut->height = mNodeInfo[index].height;
+        return TRUE;
+    }
+
+    leafOut->bounds.inf = mTriangles[index].min;
+    leafOut->bounds.sup = mTriangles[index].max;
+
+    RwInt32 numTriangles = 1;
+    while (mTriangles[index].bspTri.flags & kCLUMPCOLL_HASNEXT) {
+        index++;
+        leafOut->bounds.AddPoint(&mTriangles[index].min);
+        leafOut->bounds.AddPoint(&mTriangles[index].max);
+        numTriangles++;
+    }
+
+    leafOut->cost = JSPCOST_TRIANGLE * numTriangles;
+    leafOut->regionCost = leafOut->cost;
+    leafOut->height = 0;
+
+    return TRUE;
+}
+
+// Calculate the region, bounds, costs, height and depth of every node.
+void JSPBuilder::CalcNodeInfo(RwUInt32 nodeIndex, const RwBBox* region, RwInt32 depth)
+{
+    ClumpCollBSPBranchNode& node = mBranchNodes[nodeIndex];
+    NodeInfo& nodeInfo = mNodeInfo[nodeIndex];
+
+    if (CLUMPCOLL_GETNODETYPE(node.leftInfo) == kCLUMPCOLL_BRANCH) {
+        RwBBox leftRegion = *region;
+        ClipRegion(&leftRegion, (RwPlaneType)CLUMPCOLL_GETAXIS(node.leftInfo), node.leftValue, TRUE);
+        CalcNodeInfo(CLUMPCOLL_GETINDEX(node.leftInfo), &leftRegion, depth + 1);
+    }
+
+    if (CLUMPCOLL_GETNODETYPE(node.rightInfo) == kCLUMPCOLL_BRANCH) {
+        RwBBox rightRegion = *region;
+        ClipRegion(&rightRegion, (RwPlaneType)CLUMPCOLL_GETAXIS(node.rightInfo), node.rightValue, FALSE);
+        CalcNodeInfo(CLUMPCOLL_GETINDEX(node.rightInfo), &rightRegion, depth + 1);
+    }
+
+    nodeInfo.region = *region;
+    nodeInfo.depth = depth;
+    nodeInfo.treelet = -1;
+
+    RefreshTreeletNode(nodeIndex, -1);
+
+    // Each node is its own treelet here, so this is the node's cost given its region is visited
+    RwReal area = JSPBBoxArea(region);
+    RwReal regionCost = CalcTreeletRegionCost(nodeIndex, -1, region);
+    nodeInfo.regionCost = (area > 0.0f) ? regionCost / area : regionCost;
+}
+
+// Expected cost of a node with the given bounds and children, using the tight bounds of each side.
+// Unlike the actual tree, this ignores the regions inherited from the node's parents, so it doesn't depend on the
+// rest of the treelet. That makes it cheap enough to search every arrangement with, and the winner gets checked
+// against the actual regions with CalcTreeletRegionCost.
+static RwReal CalcTightNodeCost(const RwBBox* bounds, RwPlaneType axis, RwReal leftValue, RwReal rightValue, RwReal leftCost, RwReal rightCost)
+{
+    RwReal area = JSPBBoxArea(bounds);
+    if (area <= 0.0f) {
+        return JSPCOST_BRANCH + leftCost + rightCost;
+    }
+
+    RwBBox leftRegion = *bounds;
+    RwBBox rightRegion = *bounds;
+    SETCOORD(leftRegion.sup, axis, leftValue);
+    SETCOORD(rightRegion.inf, axis, rightValue);
+
+    return JSPCOST_BRANCH + (JSPBBoxArea(&leftRegion) * leftCost + JSPBBoxArea(&rightRegion) * rightCost) / area;
+}
+
+// Recalculate the bounds, tight cost and height of a node from its children, recursing into the children that are
+// part of the given treelet.
+void JSPBuilder::RefreshTreeletNode(RwUInt32 nodeIndex, RwInt32 treeletIndex)
+{
+    ClumpCollBSPBranchNode& node = mBranchNodes[nodeIndex];
+    NodeInfo& nodeInfo = mNodeInfo[nodeIndex];
+
+    if (treeletIndex >= 0 && CLUMPCOLL_GETNODETYPE(node.leftInfo) == kCLUMPCOLL_BRANCH &&
+        mNodeInfo[CLUMPCOLL_GETINDEX(node.leftInfo)].treelet == treeletIndex) {
+        RefreshTreeletNode(CLUMPCOLL_GETINDEX(node.leftInfo), treeletIndex);
+    }
+
+    if (treeletIndex >= 0 && CLUMPCOLL_GETNODETYPE(node.rightInfo) == kCLUMPCOLL_BRANCH &&
+        mNodeInfo[CLUMPCOLL_GETINDEX(node.rightInfo)].treelet == treeletIndex) {
+        RefreshTreeletNode(CLUMPCOLL_GETINDEX(node.rightInfo), treeletIndex);
+    }
+
+    TreeletLeaf left, right;
+    RwBool hasLeft = GetChildLeaf(node.leftInfo, node.leftValue, &left);
+    RwBool hasRight = GetChildLeaf(node.rightInfo, node.rightValue, &right);
+
+    if (hasLeft && hasRight) {
+        nodeInfo.bounds = left.bounds;
+        MergeBBox(&nodeInfo.bounds, &right.bounds);
+        nodeInfo.cost = CalcTightNodeCost(&nodeInfo.bounds, (RwPlaneType)CLUMPCOLL_GETAXIS(node.leftInfo),
+                                          node.leftValue, node.rightValue, left.cost, right.cost);
+        nodeInfo.height = 1 + ((left.height > right.height) ? left.height : right.height);
+    } else {
+        TreeletLeaf& child = hasLeft ? left : right;
+        assert(hasLeft || hasRight);
+
+        nodeInfo.bounds = child.bounds;
+        nodeInfo.cost = JSPCOST_BRANCH + child.cost;
+        nodeInfo.height = 1 + child.height;
+    }
+}
+
+// Area-weighted cost of a treelet node, using the actual regions each node covers (same as JSPTreeStats).
+// The leaves' costs are assumed to scale with the area of their new regions.
+RwReal JSPBuilder::CalcTreeletRegionCost(RwUInt32 nodeIndex, RwInt32 treeletIndex, const RwBBox* region)
+{
+    ClumpCollBSPBranchNode& node = mBranchNodes[nodeIndex];
+    RwReal cost = JSPCOST_BRANCH * JSPBBoxArea(region);
+
+    for (RwInt32 i = 0; i < 2; i++) {
+        RwUInt32 info = i ? node.rightInfo : node.leftInfo;
+        RwReal value = i ? node.rightValue : node.leftValue;
+
+        RwBBox childRegion = *region;
+        ClipRegion(&childRegion, (RwPlaneType)CLUMPCOLL_GETAXIS(info), value, !i);
+
+        if (treeletIndex >= 0 && CLUMPCOLL_GETNODETYPE(info) == kCLUMPCOLL_BRANCH &&
+            mNodeInfo[CLUMPCOLL_GETINDEX(info)].treelet == treeletIndex) {
+            cost += CalcTreeletRegionCost(CLUMPCOLL_GETINDEX(info), treeletIndex, &childRegion);
+        } else {
+            TreeletLeaf leaf;
+            if (GetChildLeaf(info, value, &leaf)) {
+                cost += leaf.regionCost * JSPBBoxArea(&childRegion);
+            }
+        }
+    }
+
+    return cost;
+}
+
+// Same as CalcTreeletRegionCost, but for an arrangement that hasn't been written to the tree yet.
+RwReal JSPBuilder::CalcSplitRegionCost(const TreeletSplit* splits, const Treelet* treelet, RwUInt32 set, const RwBBox* region)
+{
+    if (IsSingleBit(set)) {
+        return treelet->leaves[GetLowestBitIndex(set)].regionCost * JSPBBoxArea(region);
+    }
+
+    const TreeletSplit& split = splits[set];
+
+    RwBBox leftRegion = *region;
+    RwBBox rightRegion = *region;
+    ClipRegion(&leftRegion, split.axis, GETCOORD(splits[split.left].bounds.sup, split.axis), TRUE);
+    ClipRegion(&rightRegion, split.axis, GETCOORD(splits[split.right].bounds.inf, split.axis), FALSE);
+
+    return JSPCOST_BRANCH * JSPBBoxArea(region) +
+           CalcSplitRegionCost(splits, treelet, split.left, &leftRegion) +
+           CalcSplitRegionCost(splits, treelet, split.right, &rightRegion);
+}
+
+// Check that every leaf of the given subset of a treelet stays within MAXBSPDEPTH.
+RwBool JSPBuilder::CheckTreeletDepth(const TreeletSplit* splits, const Treelet* treelet, RwUInt32 set, RwInt32 level, RwInt32 depth)
+{
+    if (IsSingleBit(set)) {
+        // A leaf at this level has its first branch node (if any) at depth + level
+        return depth + level + treelet->leaves[GetLowestBitIndex(set)].height <= MAXBSPDEPTH;
+    }
+
+    return CheckTreeletDepth(splits, treelet, splits[set].left, level + 1, depth) &&
+           CheckTreeletDepth(splits, treelet, splits[set].right, level + 1, depth);
+}
+
+// Cut the tree into treelets, top-down.
+// Each treelet starts at a node and keeps growing by expanding its largest branch leaf, until it has enough leaves.
+// Also calculates each treelet's height (0 for treelets with no treelets below them).
+void JSPBuilder::FormTreelets(std::vector<Treelet>* treelets, std::vector<RwInt32>* heights)
+{
+    std::vector<RwInt32> parents;
+    std::vector<RwUInt32> stack;
+    std::vector<RwInt32> parentStack;
+
+    stack.push_back(0);
+    parentStack.push_back(-1);
+
+    while (!stack.empty()) {
+        RwUInt32 root = stack.back();
+        RwInt32 parent = parentStack.back();
+        stack.pop_back();
+        parentStack.pop_back();
+
+        RwInt32 treeletIndex = (RwInt32)treelets->size();
+        treelets->emplace_back();
+        parents.push_back(parent);
+
+        Treelet& treelet = treelets->back();
+        treelet.root = root;
+        treelet.numInternal = 0;
+        treelet.numLeaves = 0;
+
+        RwUInt32 expand = root;
+
+        while (true) {
+            // Replace the expanded leaf with its children
+            ClumpCollBSPBranchNode& node = mBranchNodes[expand];
+
+            treelet.internal[treelet.numInternal++] = expand;
+            mNodeInfo[expand].treelet = treeletIndex;
+
+            if (GetChildLeaf(node.leftInfo, node.leftValue, &treelet.leaves[treelet.numLeaves])) {
+                treelet.numLeaves++;
+            }
+
+            if (GetChildLeaf(node.rightInfo, node.rightValue, &treelet.leaves[treelet.numLeaves])) {
+                treelet.numLeaves++;
+            }
+
+            if (treelet.numLeaves >= TREELETLEAVES || treelet.numInternal >= TREELETLEAVES) {
+                break;
+            }
+
+            // Pick the branch leaf with the largest area
+            RwInt32 best = -1;
+            RwReal bestArea = -1.0f;
+
+            for (RwInt32 i = 0; i < treelet.numLeaves; i++) {
+                if (CLUMPCOLL_GETNODETYPE(treelet.leaves[i].info) == kCLUMPCOLL_BRANCH) {
+                    RwReal area = JSPBBoxArea(&treelet.leaves[i].bounds);
+                    if (area > bestArea) {
+                        best = i;
+                        bestArea = area;
+                    }
+                }
+            }
+
+            if (best < 0) {
+                break;
+            }
+
+            expand = CLUMPCOLL_GETINDEX(treelet.leaves[best].info);
+            treelet.leaves[best] = treelet.leaves[--treelet.numLeaves];
+        }
+
+        for (RwInt32 i = 0; i < treelet.numLeaves; i++) {
+            if (CLUMPCOLL_GETNODETYPE(treelet.leaves[i].info) == kCLUMPCOLL_BRANCH) {
+                stack.push_back(CLUMPCOLL_GETINDEX(treelet.leaves[i].info));
+                parentStack.push_back(treeletIndex);
+            }
+        }
+    }
+
+    // Children always come after their parents, so going backwards gets the heights bottom-up
+    heights->assign(treelets->size(), 0);
+
+    for (RwInt32 i = (RwInt32)treelets->size() - 1; i > 0; i--) {
+        RwInt32& parentHeight = (*heights)[parents[i]];
+        if ((*heights)[i] + 1 > parentHeight) {
+            parentHeight = (*heights)[i] + 1;
+        }
+    }
+}
+
+// Returns TRUE if the treelet was restructured.
+RwBool JSPBuilder::OptimizeTreelet(Treelet* treelet, RwInt32 treeletIndex)
+{
+    NodeInfo& rootInfo = mNodeInfo[treelet->root];
+    RwReal rootArea = JSPBBoxArea(&rootInfo.region);
+
+    // The treelets below may have changed, so refresh the leaves and the current cost first
+    for (RwInt32 i = 0; i < treelet->numLeaves; i++) {
+        TreeletLeaf& leaf = treelet->leaves[i];
+        if (CLUMPCOLL_GETNODETYPE(leaf.info) == kCLUMPCOLL_BRANCH) {
+            NodeInfo& leafInfo = mNodeInfo[CLUMPCOLL_GETINDEX(leaf.info)];
+            leaf.cost = leafInfo.cost;
+            leaf.regionCost = leafInfo.regionCost;
+            leaf.height = leafInfo.height;
+        }
+    }
+
+    RefreshTreeletNode(treelet->root, treeletIndex);
+    RwReal currentCost = CalcTreeletRegionCost(treelet->root, treeletIndex, &rootInfo.region);
+    RwReal newCost = currentCost;
+
+    RwInt32 numLeaves = treelet->numLeaves;
+
+    if (numLeaves >= 3) {
+        // Find the cheapest arrangement of every subset of leaves, smallest subsets first.
+        // Every proper subset of a set is numerically smaller than it, so going in numeric order works.
+        TreeletSplit splits[1 << TREELETLEAVES];
+        RwUInt32 fullSet = (1u << numLeaves) - 1;
+
+        for (RwUInt32 set = 1; set <= fullSet; set++) {
+            TreeletSplit& split = splits[set];
+            RwUInt32 lowBit = set & (0u - set);
+
+            if (set == lowBit) {
+                TreeletLeaf& leaf = treelet->leaves[GetLowestBitIndex(set)];
+                split.bounds = leaf.bounds;
+                split.cost = leaf.cost;
+                split.left = split.right = 0;
+                continue;
+            }
+
+            split.bounds = splits[lowBit].bounds;
+            MergeBBox(&split.bounds, &splits[set & ~lowBit].bounds);
+            split.cost = INFINITY;
+
+            // Only look at partitions that have the lowest leaf on the first side, so each partition is visited once.
+            // The rest of the first side is iterated over as a submask of the remaining leaves.
+            RwUInt32 rest = set & ~lowBit;
+            for (RwUInt32 sub = (rest - 1) & rest; ; sub = (sub - 1) & rest) {
+                RwUInt32 a = lowBit | sub;
+                RwUInt32 b = set & ~a;
+
+                for (RwUInt32 axis = 0; axis < sizeof(RwV3d); axis += 4) {
+                    for (RwInt32 swap = 0; swap < 2; swap++) {
+                        RwUInt32 left = swap ? b : a;
+                        RwUInt32 right = swap ? a : b;
+                        RwReal cost = CalcTightNodeCost(&split.bounds, (RwPlaneType)axis,
+                                                        GETCOORD(splits[left].bounds.sup, axis),
+                                                        GETCOORD(splits[right].bounds.inf, axis),
+                                                        splits[left].cost, splits[right].cost);
+
+                        if (cost < split.cost) {
+                            split.cost = cost;
+                            split.left = left;
+                            split.right = right;
+                            split.axis = (RwPlaneType)axis;
+                        }
+                    }
+                }
+
+                if (sub == 0) break;
+            }
+        }
+
+        // Keep the current arrangement unless the new one is actually better in the real tree,
+        // and doesn't go over the depth limit
+        RwReal splitCost = CalcSplitRegionCost(splits, treelet, fullSet, &rootInfo.region);
+
+        if (splitCost < currentCost * 0.999f &&
+            CheckTreeletDepth(splits, treelet, fullSet, 0, rootInfo.depth)) {
+            WriteTreelet(splits, treelet, fullSet);
+            newCost = splitCost;
+        }
+    }
+
+    rootInfo.regionCost = (rootArea > 0.0f) ? newCost / rootArea : newCost;
+
+    return newCost != currentCost;
+}
+
+// Write out a treelet's new nodes, reusing its node slots. The root has to stay in the same slot.
+void JSPBuilder::WriteTreelet(const TreeletSplit* splits, Treelet* treelet, RwUInt32 fullSet)
+{
+    RwInt32 nextSlot = 0;
+    RwUInt32 stack[TREELETLEAVES];
+    RwUInt32 stackNodes[TREELETLEAVES];
+    RwInt32 stackSize = 0;
+
+    stack[stackSize] = fullSet;
+    stackNodes[stackSize] = treelet->internal[nextSlot++];
+    stackSize++;
+
+    while (stackSize) {
+        stackSize--;
+        RwUInt32 set = stack[stackSize];
+        RwUInt32 nodeIndex = stackNodes[stackSize];
+        const TreeletSplit& split = splits[set];
+
+        ClumpCollBSPBranchNode& node = mBranchNodes[nodeIndex];
+        RwUInt32 children[2] = { split.left, split.right };
+        RwUInt32 infos[2];
+
+        for (RwInt32 i = 0; i < 2; i++) {
+            RwUInt32 child = children[i];
+            if (IsSingleBit(child)) {
+                infos[i] = treelet->leaves[GetLowestBitIndex(child)].info;
+            } else {
+                RwUInt32 childNode = treelet->internal[nextSlot++];
+                infos[i] = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_BRANCH, 0, childNode);
+
+                stack[stackSize] = child;
+                stackNodes[stackSize] = childNode;
+                stackSize++;
+            }
+        }
+
+        node.leftInfo = infos[0] | split.axis;
+        node.rightInfo = infos[1] | split.axis;
+        node.leftValue = GETCOORD(splits[split.left].bounds.sup, split.axis);
+        node.rightValue = GETCOORD(splits[split.right].bounds.inf, split.axis);
+    }
+
+    // Any slots left over are no longer part of the tree
+    for (RwInt32 i = nextSlot; i < treelet->numInternal; i++) {
+        mNodeInfo[treelet->internal[i]].treelet = -1;
+    }
+
+    RefreshTreeletNode(treelet->root, mNodeInfo[treelet->root].treelet);
+}
+
+// Give up the branch nodes that help the least, until the written JSP fits in maxBytes.
+// Collapsing a subtree into one leaf saves all of its nodes, and costs the difference between the leaf's and the
+// subtree's expected traversal cost. Given a price for each node, the cheapest tree is found bottom-up, keeping a
+// subtree only if it's worth the nodes it takes. A higher price keeps fewer nodes, so search for the lowest price
+// that fits. This runs before the treelet pass, while the triangles under every node are still one span.
+void JSPBuilder::FitByteLimit()
+{
+    RwUInt32 nodeSize = sizeof(ClumpCollBSPBranchNode);
+    RwInt32 numNodes = (RwInt32)mBranchNodes.size();
+    RwUInt32 size = GetWriteSize(maxBytesStripVecList);
+
+    if (size <= maxBytes) {
+        return;
+    }
+
+    // The root always stays, so this can come out as fewer nodes than can be kept
+    RwUInt32 fixedSize = size - nodeSize * numNodes;
+    RwInt32 maxNodes = (maxBytes > fixedSize) ? (RwInt32)((maxBytes - fixedSize) / nodeSize) : 0;
+
+    mPruneNodes.resize(numNodes);
+    CalcPruneNode(0, &mBBox);
+
+    // No subtree costs more as a leaf than the whole model does, so at this price everything that can be collapsed is
+    RwReal lo = 0.0f;
+    RwReal hi = JSPCOST_TRIANGLE * mTriangles.size() * JSPBBoxArea(&mBBox) + 1.0f;
+    RwInt32 numKept;
+
+    // If even that doesn't fit, pruning would only make the tree slower without making it fit, so leave it alone
+    PruneNodes(0, hi, &numKept);
+
+    if (numKept > maxNodes) {
+        std::vector<PruneNode>().swap(mPruneNodes);
+        mStats.minBytes = fixedSize + nodeSize * numKept;
+        return;
+    }
+
+    RwReal unprunedCost = CalcCost();
+
+    for (RwInt32 i = 0; i < PRUNESEARCHSTEPS; i++) {
+        RwReal price = (lo + hi) / 2.0f;
+        PruneNodes(0, price, &numKept);
+
+        if (numKept <= maxNodes) {
+            hi = price;
+        } else {
+            lo = price;
+        }
+    }
+
+    PruneNodes(0, hi, &numKept);
+    CollapseNodes(0);
+
+    std::vector<PruneNode>().swap(mPruneNodes);
+
+    // Drop the collapsed subtrees' nodes
+    ReorderBranchNodes();
+
+    JSPTreeStats stats;
+    CalcTreeStats(&stats);
+
+    mStats.maxDepthReached = stats.maxDepth;
+    mStats.numPrunedNodes = numNodes - (RwInt32)mBranchNodes.size();
+    mStats.unprunedCost = unprunedCost;
+    mStats.prunedCost = stats.cost;
+}
+
+// Find the span of triangles under a node and its costs, for FitByteLimit.
+// Returns FALSE if the triangles under it aren't one span, so it can't be collapsed.
+RwBool JSPBuilder::CalcPruneNode(RwUInt32 nodeIndex, const RwBBox* region)
+{
+    ClumpCollBSPBranchNode& node = mBranchNodes[nodeIndex];
+    PruneNode& pruneNode = mPruneNodes[nodeIndex];
+
+    RwInt32 lo = (RwInt32)mTriangles.size();
+    RwInt32 hi = -1;
+    RwInt32 numTriangles = 0;
+    RwBool contiguous = TRUE;
+
+    pruneNode.fixedCost = JSPCOST_BRANCH * JSPBBoxArea(region);
+
+    for (RwInt32 side = 0; side < 2; side++) {
+        RwBool isLeft = (side == 0);
+        RwUInt32 info = isLeft ? node.leftInfo : node.rightInfo;
+        RwReal value = isLeft ? node.leftValue : node.rightValue;
+
+        // Never visited (see CutEmptySpace)
+        if (isinf(value)) {
+            continue;
+        }
+
+        RwBBox childRegion = *region;
+        ClipRegion(&childRegion, (RwPlaneType)CLUMPCOLL_GETAXIS(info), value, isLeft);
+
+        RwInt32 childLo = CLUMPCOLL_GETINDEX(info);
+        RwInt32 childCount = 0;
+
+        if (CLUMPCOLL_GETNODETYPE(info) == kCLUMPCOLL_BRANCH) {
+            contiguous &= CalcPruneNode(childLo, &childRegion);
+            childCount = mPruneNodes[childLo].numTriangles;
+            childLo = mPruneNodes[childLo].lo;
+        } else {
+            for (RwInt32 i = childLo; i < (RwInt32)mTriangles.size(); i++) {
+                childCount++;
+                if (!(mTriangles[i].bspTri.flags & kCLUMPCOLL_HASNEXT)) {
+                    break;
+                }
+            }
+
+            pruneNode.fixedCost += JSPCOST_TRIANGLE * childCount * JSPBBoxArea(&childRegion);
+        }
+
+        lo = std::min(lo, childLo);
+        hi = std::max(hi, childLo + childCount - 1);
+        numTriangles += childCount;
+    }
+
+    // Leaves that share triangles or leave gaps between them can't be made into one chain
+    contiguous &= (numTriangles == hi + 1 - lo);
+
+    pruneNode.lo = lo;
+    pruneNode.numTriangles = numTriangles;
+    pruneNode.collapseCost = contiguous ? JSPCOST_TRIANGLE * numTriangles * JSPBBoxArea(region) : INFINITY;
+
+    return contiguous;
+}
+
+// Area-weighted cost of the cheapest version of a node's subtree when every node kept costs nodeCost on top,
+// marking which of its children to collapse to get it.
+RwReal JSPBuilder::PruneNodes(RwUInt32 nodeIndex, RwReal nodeCost, RwInt32* numNodesOut)
+{
+    ClumpCollBSPBranchNode& node = mBranchNodes[nodeIndex];
+    RwUInt32 infos[2] = { node.leftInfo, node.rightInfo };
+    RwReal values[2] = { node.leftValue, node.rightValue };
+
+    RwReal cost = mPruneNodes[nodeIndex].fixedCost + nodeCost;
+    RwInt32 numNodes = 1;
+
+    for (RwInt32 side = 0; side < 2; side++) {
+        if (CLUMPCOLL_GETNODETYPE(infos[side]) != kCLUMPCOLL_BRANCH || isinf(values[side])) {
+            continue;
+        }
+
+        RwUInt32 childIndex = CLUMPCOLL_GETINDEX(infos[side]);
+        RwInt32 childNodes;
+        RwReal childCost = PruneNodes(childIndex, nodeCost, &childNodes);
+
+        PruneNode& child = mPruneNodes[childIndex];
+        child.collapse = (child.collapseCost <= childCost);
+
+        if (child.collapse) {
+            cost += child.collapseCost;
+        } else {
+            cost += childCost;
+            numNodes += childNodes;
+        }
+    }
+
+    *numNodesOut = numNodes;
+    return cost;
+}
+
+// Turn the children PruneNodes marked into leaves, chaining all of their triangles together.
+void JSPBuilder::CollapseNodes(RwUInt32 nodeIndex)
+{
+    ClumpCollBSPBranchNode& node = mBranchNodes[nodeIndex];
+    RwUInt32* infos[2] = { &node.leftInfo, &node.rightInfo };
+    RwReal values[2] = { node.leftValue, node.rightValue };
+
+    for (RwInt32 side = 0; side < 2; side++) {
+        RwUInt32* info = infos[side];
+
+        if (CLUMPCOLL_GETNODETYPE(*info) != kCLUMPCOLL_BRANCH || isinf(values[side])) {
+            continue;
+        }
+
+        PruneNode& child = mPruneNodes[CLUMPCOLL_GETINDEX(*info)];
+
+        if (!child.collapse) {
+            CollapseNodes(CLUMPCOLL_GETINDEX(*info));
+            continue;
+        }
+
+        *info = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_TRIANGLE, CLUMPCOLL_GETAXIS(*info), child.lo);
+
+        RwInt32 last = child.lo + child.numTriangles - 1;
+
+        for (RwInt32 i = child.lo; i < last; i++) {
+            mTriangles[i].bspTri.flags |= kCLUMPCOLL_HASNEXT;
+        }
+
+        mTriangles[last].bspTri.flags &= ~kCLUMPCOLL_HASNEXT;
     }
 }
 
-void JSPBuilder::CopyTriangles()
+// Renumber the branch nodes in depth-first order (the same order RecurseTriangles makes them in),
+// dropping any that aren't reachable from the root.
+void JSPBuilder::ReorderBranchNodes()
 {
+    std::vector<ClumpCollBSPBranchNode> newNodes;
+
+    newNodes.reserve(mBranchNodes.size());
+    ReorderBranchNode(0, &newNodes);
+
+    mBranchNodes.swap(newNodes);
+}
+
+RwUInt32 JSPBuilder::ReorderBranchNode(RwUInt32 nodeIndex, std::vector<ClumpCollBSPBranchNode>* newNodes)
+{
+    RwUInt32 newIndex = (RwUInt32)newNodes->size();
+    newNodes->push_back(mBranchNodes[nodeIndex]);
+
+    ClumpCollBSPBranchNode node = mBranchNodes[nodeIndex];
+
+    if (CLUMPCOLL_GETNODETYPE(node.leftInfo) == kCLUMPCOLL_BRANCH) {
+        RwUInt32 child = ReorderBranchNode(CLUMPCOLL_GETINDEX(node.leftInfo), newNodes);
+        (*newNodes)[newIndex].leftInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_BRANCH, CLUMPCOLL_GETAXIS(node.leftInfo), child);
+    }
+
+    if (CLUMPCOLL_GETNODETYPE(node.rightInfo) == kCLUMPCOLL_BRANCH) {
+        RwUInt32 child = ReorderBranchNode(CLUMPCOLL_GETINDEX(node.rightInfo), newNodes);
+        (*newNodes)[newIndex].rightInfo = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_BRANCH, CLUMPCOLL_GETAXIS(node.rightInfo), child);
+    }
+
+    return newIndex;
+}
+
+void JSPBuilder::CopyTree()
+{
+    mJSP->colltree.branchNodes = std::move(mBranchNodes);
+    mBranchNodes.clear();
+
     mJSP->colltree.triangles.reserve(mTriangles.size());
     for (TriangleData& tri : mTriangles) {
         mJSP->colltree.triangles.push_back(tri.bspTri);
     }
+
+    std::vector<TriangleData>().swap(mTriangles);
 }
\ No newline at end of file
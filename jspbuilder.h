@@ -2,12 +2,114 @@
 
 #include "rw.h"
 #include "jsp.h"
+#include "jspstats.h"
 
+#define MAXBSPDEPTH 32
+#define TREELETLEAVES 7 // Number of leaves in each treelet of the restructuring pass (one less internal nodes)
+
+enum JSPBuildMode
+{
+    JSPBUILD_MIDPOINT,  // Top-down build, splitting the longest side of each node down the middle (default)
+    JSPBUILD_MORTON     // Fast linear build from sorted Morton codes of the triangle centers, lower quality tree
+};
+
+// Sets extra flags (kCLUMPCOLL_NOSTAND, kCLUMPCOLL_SHADOW) on every triangle that matches all of its conditions
+struct JSPTriangleRule
+{
+    RwUInt8 flags;
+    RwReal minSlope;    // Degrees between the triangle's normal and straight up (0 is flat ground, 90 a wall, 180 a ceiling)
+    RwReal maxSlope;
+    RwInt32 matIndex;   // -1 for any material
+    RwInt32 atomIndex;  // -1 for any atomic
+
+    JSPTriangleRule();  // Matches every triangle, sets no flags
+};
+
+// Stats about the last build, for the caller to report
+struct JSPBuildStats
+{
+    RwInt32 numBranchNodes;
+    RwInt32 numTriangles;
+    RwInt32 maxDepthReached;
+    RwInt32 numQueryPoints;
+    RwInt32 numAxisRetries;         // Splits that left one side empty and were redone across the triangle centers
+    RwInt32 numMedianSplits;        // ...and those that still had to split at the median triangle
+    RwInt32 numBalancedSplits;      // Median splits near the depth limit, to keep the last leaves balanced
+    RwInt32 numTaggedTriangles;     // Triangles that got flags from the triangle rules
+    RwInt32 numSubtrees;            // Only set when building two-level
+    RwInt32 numSharedAtomics;       // Atomics whose vertices and triangles were copied from another with the same geometry
+    RwInt32 numTreelets;            // Only set when optimizing treelets
+    RwInt32 numRestructuredTreelets;
+    RwReal costBefore;              // Traversal cost before and after optimizing treelets
+    RwReal costAfter;
+    RwInt32 numCandidates;          // Only set with a time budget. Trees built, including the first one
+    RwReal firstCost;               // Traversal cost of the first tree and the one that was kept
+    RwReal bestCost;
+    RwUInt32 numBytes;              // Only set with a byte limit. Written size of the JSP, and the limit it was built for
+    RwUInt32 maxBytes;
+    RwInt32 numPrunedNodes;         // Branch nodes given up to fit the limit
+    RwReal unprunedCost;            // Traversal cost before and after giving them up
+    RwReal prunedCost;
+    RwUInt32 minBytes;              // Only set if the limit can't be met. Smallest the JSP could be pruned to
+};
+
+// Builds a JSP from a clump. Doesn't print anything or touch any global state,
+// so separate builders can be used on separate threads at the same time.
 struct JSPBuilder
 {
-    void Build(JSP* jsp, RpClump* clump);
+    JSPBuildMode mode;
+    RwBool optimizeTreelets;    // Run the treelet restructuring pass over the finished tree
+
+    // Query density hint. Points where collision is expected to be queried (where the player walks, camera paths, etc).
+    // Splits are weighted towards these areas, and areas without any get bigger leaves.
+    std::vector<RwV3d> queryPoints;
+    RwBool autoQueryPoints;     // Add a query point on every walkable (upward facing) triangle
+
+    // Apply each atomic's frame hierarchy to its vertices, so the tree is built in world space.
+    // Otherwise every geometry is used as is, which is only right if all the frames are identity.
+    RwBool worldSpace;
+
+    std::vector<JSPTriangleRule> triangleRules;
+
+    // Build a subtree for each atomic on its own (in parallel), under a top-level tree over the atomics' bounds.
+    // Changing one atomic only changes its own subtree, and levels made of separate props don't get split through them.
+    RwBool twoLevel;
+
+    // Keep building other trees (different split searches, two-level or not, restructured) for up to this many
+    // milliseconds after the first one, and keep the one with the lowest expected traversal cost. 0 to build just once.
+    RwInt32 timeBudget;
+
+    // Keep the written JSP within this many bytes, if it can be, by giving up the branch nodes that help the least
+    // and making their leaves longer. Everything but the branch nodes has a fixed size. 0 for no limit.
+    RwUInt32 maxBytes;
+    RwBool maxBytesStripVecList;    // Count the strip vec list against maxBytes (GameCube JSPs have one)
+
+    // Count fallback splits and the depth reached in the build stats. Builds nobody reports on can turn it off.
+    RwBool collectStats;
+
+    JSPBuilder();
+
+    void Build(JSP* jsp, RpClump* clump, RwBool copyTree = TRUE);
+    RwBool Write(RwStream* stream, RwBool writeStripVecList);
+    void CalcTreeStats(JSPTreeStats* stats);
+    RwUInt32 GetWriteSize(RwBool writeStripVecList) const;     // Bytes Write takes for the built JSP
+
+    // Bounds of the whole model, which the tree covers
+    const RwBBox* GetBBox() const { return &mBBox; }
+
+    const JSPBuildStats* GetStats() const { return &mStats; }
+
+    // Normal of the strip triangle whose vertices start at p, not normalized (its length is twice the triangle's area).
+    // Every other triangle in a strip is wound the other way, so reverse ones are flipped to face the right way.
+    static void CalcStripNormal(const RwV3d* p, RwBool reverse, RwV3d* normalOut);
+
+    // Where each atomic's vertices start in the strip vec list. Atomics are stored in reverse, with every mesh's strip
+    // one after another. Returns the size of the whole list.
+    static RwUInt32 CalcAtomicStripOffsets(const RpClump* clump, std::vector<RwUInt32>* offsetsOut);
 
 private:
+    template <RwEndian E> RwBool Write(RwStream* stream, RwBool writeStripVecList);
+
     struct TriangleData
     {
         ClumpCollBSPTriangle bspTri;
@@ -19,27 +121,167 @@ private:
         {
             return (GETCOORD(min, axis) + GETCOORD(max, axis)) / 2.0f;
         }
+
+        RwReal GetMin(RwPlaneType axis) const { return GETCOORD(min, axis); }
+        RwReal GetMax(RwPlaneType axis) const { return GETCOORD(max, axis); }
+
+        void GetNormal(RwV3d* normalOut) const
+        {
+            CalcStripNormal(p, bspTri.flags & kCLUMPCOLL_ISREVERSE, normalOut);
+        }
+    };
+
+    struct NodeInfo
+    {
+        RwBBox region;      // Region of space the node covers, after being clipped by its parents
+        RwBBox bounds;      // Tight bounds of every triangle under the node
+        RwReal cost;        // Expected traversal cost given the node is visited, based on tight bounds
+        RwReal regionCost;  // Expected traversal cost given the node is visited, based on the actual regions
+        RwInt32 height;     // Number of branch levels from this node down to its deepest leaf
+        RwInt32 depth;
+        RwInt32 treelet;
+    };
+
+    struct TreeletLeaf
+    {
+        RwUInt32 info;      // Child info without the axis
+        RwBBox bounds;
+        RwReal cost;
+        RwReal regionCost;
+        RwInt32 height;
+    };
+
+    struct Treelet
+    {
+        RwUInt32 root;
+        RwInt32 numInternal;
+        RwInt32 numLeaves;
+        RwUInt32 internal[TREELETLEAVES];
+        TreeletLeaf leaves[TREELETLEAVES];
+    };
+
+    struct TreeletSplit
+    {
+        RwBBox bounds;
+        RwReal cost;
+        RwUInt32 left;      // Subset of leaves on the left side
+        RwUInt32 right;     // Subset of leaves on the right side
+        RwPlaneType axis;
     };
 
-    struct Stats
+    struct AtomicSpan
+    {
+        RwInt32 lo;         // Span of the atomic's triangles
+        RwInt32 hi;
+        RwBBox bounds;
+
+        RwReal GetCenter(RwPlaneType axis) const
+        {
+            return (GETCOORD(bounds.inf, axis) + GETCOORD(bounds.sup, axis)) / 2.0f;
+        }
+
+        RwReal GetMin(RwPlaneType axis) const { return GETCOORD(bounds.inf, axis); }
+        RwReal GetMax(RwPlaneType axis) const { return GETCOORD(bounds.sup, axis); }
+    };
+
+    struct SubtreeJob
+    {
+        RwUInt32 nodeIndex; // Top-level node the subtree hangs off
+        RwBool isLeft;
+        RwInt32 lo;         // Span of the atomic's triangles
+        RwInt32 hi;
+        RwInt32 depth;
+        RwBBox region;      // Region of space the subtree covers, after being clipped by the top level
+        std::vector<ClumpCollBSPBranchNode> nodes;  // Built subtree, indexed from 0 and from lo
+        JSPBuildStats stats;
+    };
+
+    // Build policies, see RecurseTriangles
+    struct MidpointSplit;
+    struct BinnedSplit;
+    struct SizeLeaf;
+    struct QueryLeaf;
+    struct BuildStatsCollector;
+    struct NoStatsCollector;
+
+    struct PruneNode
     {
-        RwInt32 maxDepthReached;
+        RwInt32 lo;             // Span of the triangles under the node
+        RwInt32 numTriangles;
+        RwReal fixedCost;       // Area-weighted cost of the node itself and its leaf children
+        RwReal collapseCost;    // Area-weighted cost of the node as one leaf, INFINITY if its triangles aren't contiguous
+        RwBool collapse;
     };
 
     JSP* mJSP;
     RpClump* mClump;
+    RwInt32 mNumThreads;
+    RwBool mBinnedSplits;   // Choose splits by cost over binned candidate planes, instead of down the middle
     RwInt32 mBspDepth;
-    Stats mStats;
+    RwBBox mBBox;
+    JSPBuildStats mStats;
     std::vector<TriangleData> mTriangles;
+    std::vector<TriangleData> mPartitionBuffer;
+    std::vector<ClumpCollBSPBranchNode> mBranchNodes;
+    std::vector<RwUInt32> mMortonCodes;
+    std::vector<RwMatrix> mWorldMatrices;   // World matrix of each frame, when building in world space
+    std::vector<RwInt32> mSharedAtomics;    // Atomic each atomic can copy its vertices and triangles from, or -1
+    std::vector<RwV3d> mQueryPoints[MAXBSPDEPTH + 1]; // Query points inside the current node at each depth
+    std::vector<AtomicSpan> mAtomicSpans;
+    std::vector<SubtreeJob> mSubtreeJobs;
+    std::vector<NodeInfo> mNodeInfo;
+    std::vector<PruneNode> mPruneNodes;
 
     void BuildJSPNodeList();
     void BuildStripVecList();
+    void BuildWorldMatrices();
+    void FindSharedAtomics();
     void BuildBSPTree();
+    void BuildWithinBudget();
+    RwReal CalcCost();
+    void BuildTree();
+    void BuildTwoLevel();
+    void RecurseAtomics(RwInt32 lo, RwInt32 hi, RwBBox* bbox, std::vector<TriangleData>* sortedTriangles);
+    RwUInt32 AddAtomicChild(RwInt32 lo, RwInt32 hi, RwBBox* bbox, RwPlaneType axis, RwUInt32 nodeIndex, RwBool isLeft,
+                            std::vector<TriangleData>* sortedTriangles);
+    void BuildSubtrees();
+    void FitByteLimit();
+    RwBool CalcPruneNode(RwUInt32 nodeIndex, const RwBBox* region);
+    RwReal PruneNodes(RwUInt32 nodeIndex, RwReal nodeCost, RwInt32* numNodesOut);
+    void CollapseNodes(RwUInt32 nodeIndex);
 
     void InitBBox(RwBBox* bbox);
     void InitTriangles();
+    void ApplyTriangleRules();
+    void InitQueryPoints();
+    RwInt32 GatherQueryPoints(RwPlaneType axis, RwReal value, RwBool isLeft);
     RwInt32 PartitionTriangles(RwInt32 lo, RwInt32 hi, RwReal splitPlane, RwPlaneType axis);
-    void ChooseSplitPlane(RwBBox* bbox, RwInt32 lo, RwInt32 hi, RwReal* splitPlaneOut, RwPlaneType* axisOut);
+    RwInt32 ParallelPartitionTriangles(RwInt32 lo, RwInt32 hi, RwReal splitPlane, RwPlaneType axis);
+    RwBool ChooseBinnedSplitPlane(RwBBox* bbox, RwInt32 lo, RwInt32 hi, RwReal* splitPlaneOut, RwPlaneType* axisOut);
+    RwBool ChooseQuerySplitPlane(RwBBox* bbox, RwInt32 lo, RwInt32 hi, RwReal* splitPlaneOut, RwPlaneType* axisOut);
     void RecurseTriangles(RwInt32 lo, RwInt32 hi, RwBBox* bbox);
-    void CopyTriangles();
+    template <typename Split, typename Leaf, typename Stats> void RecurseTriangles(RwInt32 lo, RwInt32 hi, RwBBox* bbox);
+    void CalcTriangleBounds(RwInt32 lo, RwInt32 hi, RwBBox* bboxOut);
+    RwBool FindEmptySpace(const RwBBox* bbox, const RwBBox* tightBBox, RwPlaneType* axisOut, RwBool* cutLowOut);
+    template <typename Split, typename Leaf, typename Stats> RwBool CutEmptySpace(RwInt32 lo, RwInt32 hi, RwBBox* bbox, const RwBBox* tightBBox);
+    template <typename Stats> RwInt32 FallbackSplit(RwInt32 lo, RwInt32 hi, const RwBBox* tightBBox, RwPlaneType* axisOut);
+    RwInt32 SplitAtMedian(RwInt32 lo, RwInt32 hi, const RwBBox* tightBBox, RwPlaneType* axisOut);
+    void CalcOverlapPlanes(RwInt32 lo, RwInt32 p, RwInt32 hi, RwPlaneType axis, RwReal* leftPlaneOut, RwReal* rightPlaneOut);
+    void TerminateChains(RwInt32 lo, RwInt32 p, RwInt32 hi);
+    void SortLeafChains();
+    void SortMortonCodes();
+    void RecurseMorton(RwInt32 lo, RwInt32 hi, RwInt32 bit);
+    void OptimizeTreelets(RwBBox* bbox);
+    void CalcNodeInfo(RwUInt32 nodeIndex, const RwBBox* region, RwInt32 depth);
+    RwBool GetChildLeaf(RwUInt32 info, RwReal value, TreeletLeaf* leafOut);
+    void RefreshTreeletNode(RwUInt32 nodeIndex, RwInt32 treeletIndex);
+    RwReal CalcTreeletRegionCost(RwUInt32 nodeIndex, RwInt32 treeletIndex, const RwBBox* region);
+    RwReal CalcSplitRegionCost(const TreeletSplit* splits, const Treelet* treelet, RwUInt32 set, const RwBBox* region);
+    RwBool CheckTreeletDepth(const TreeletSplit* splits, const Treelet* treelet, RwUInt32 set, RwInt32 level, RwInt32 depth);
+    void FormTreelets(std::vector<Treelet>* treelets, std::vector<RwInt32>* heights);
+    RwBool OptimizeTreelet(Treelet* treelet, RwInt32 treeletIndex);
+    void WriteTreelet(const TreeletSplit* splits, Treelet* treelet, RwUInt32 fullSet);
+    void ReorderBranchNodes();
+    RwUInt32 ReorderBranchNode(RwUInt32 nodeIndex, std::vector<ClumpCollBSPBranchNode>* newNodes);
+    void CopyTree();
 };
\ No newline at end of file
@@ -0,0 +1,122 @@
+#include "jspstats.h"
+
+#include <math.h>
+#include <assert.h>
+
+// Half the surface area of the bbox (the constant factor cancels out in the cost model)
+RwReal JSPBBoxArea(const RwBBox* bbox)
+{
+    RwReal dx = bbox->sup.x - bbox->inf.x;
+    RwReal dy = bbox->sup.y - bbox->inf.y;
+    RwReal dz = bbox->sup.z - bbox->inf.z;
+
+    if (dx < 0.0f || dy < 0.0f || dz < 0.0f) {
+        return 0.0f;
+    }
+
+    return dx * dy + dy * dz + dz * dx;
+}
+
+void JSPTreeStats::Calculate(const ClumpCollBSPBranchNode* branchNodes, RwUInt32 numBranchNodes,
+                             const RwUInt8* triFlags, RwUInt32 triStride, RwUInt32 numTriangles,
+                             const RwBBox* bbox)
+{
+    assert(bbox);
+
+    mBranchNodes = branchNodes;
+    mTriFlags = triFlags;
+    mTriStride = triStride;
+    mTotalLeafSize = 0;
+
+    this->numBranchNodes = numBranchNodes;
+    this->numTriangles = numTriangles;
+    numLeaves = 0;
+    maxLeafSize = 0;
+    maxDepth = 0;
+    avgLeafSize = 0.0f;
+
+    if (numBranchNodes == 0) {
+        // No tree, every query tests every triangle
+        numLeaves = (numTriangles > 0) ? 1 : 0;
+        maxLeafSize = numTriangles;
+        avgLeafSize = (RwReal)numTriangles;
+        cost = JSPCOST_TRIANGLE * numTriangles;
+        return;
+    }
+
+    RwReal area = JSPBBoxArea(bbox);
+    RwReal totalCost = CalcNodeCost(0, bbox, 0);
+
+    cost = (area > 0.0f) ? totalCost / area : totalCost;
+
+    if (numLeaves > 0) {
+        avgLeafSize = (RwReal)mTotalLeafSize / numLeaves;
+    }
+}
+
+void JSPTreeStats::Calculate(const ClumpCollBSPTree* tree, const RwBBox* bbox)
+{
+    assert(tree);
+
+    const RwUInt8* triFlags = tree->triangles.empty() ? NULL : &tree->triangles[0].flags;
+
+    Calculate(tree->branchNodes.empty() ? NULL : &tree->branchNodes[0], (RwUInt32)tree->branchNodes.size(),
+              triFlags, sizeof(ClumpCollBSPTriangle), (RwUInt32)tree->triangles.size(), bbox);
+}
+
+// Returns the cost of the node multiplied by the area of its region.
+// Working with area-weighted costs means nothing has to be divided until the very end.
+RwReal JSPTreeStats::CalcNodeCost(RwUInt32 nodeIndex, const RwBBox* region, RwInt32 depth)
+{
+    assert(nodeIndex < numBranchNodes);
+
+    if (depth > maxDepth) {
+        maxDepth = depth;
+    }
+
+    const ClumpCollBSPBranchNode& node = mBranchNodes[nodeIndex];
+
+    RwReal cost = JSPCOST_BRANCH * JSPBBoxArea(region);
+    cost += CalcChildCost(node.leftInfo, node.leftValue, TRUE, region, depth);
+    cost += CalcChildCost(node.rightInfo, node.rightValue, FALSE, region, depth);
+
+    return cost;
+}
+
+RwReal JSPTreeStats::CalcChildCost(RwUInt32 info, RwReal value, RwBool isLeft, const RwBBox* region, RwInt32 depth)
+{
+    // A child with an infinite plane has no triangles, and can never be reached
+    if (isinf(value)) {
+        return 0.0f;
+    }
+
+    RwPlaneType axis = (RwPlaneType)CLUMPCOLL_GETAXIS(info);
+
+    // The child covers the parent's region, clipped to its side of the plane
+    RwBBox childRegion = *region;
+    if (isLeft) {
+        if (value < GETCOORD(childRegion.sup, axis)) SETCOORD(childRegion.sup, axis, value);
+    } else {
+        if (value > GETCOORD(childRegion.inf, axis)) SETCOORD(childRegion.inf, axis, value);
+    }
+
+    if (CLUMPCOLL_GETNODETYPE(info) == kCLUMPCOLL_BRANCH) {
+        return CalcNodeCost(CLUMPCOLL_GETINDEX(info), &childRegion, depth + 1);
+    }
+
+    RwUInt32 leafSize = 0;
+    for (RwUInt32 i = CLUMPCOLL_GETINDEX(info); i < numTriangles; i++) {
+        leafSize++;
+        if (!(mTriFlags[i * mTriStride] & kCLUMPCOLL_HASNEXT)) {
+            break;
+        }
+    }
+
+    numLeaves++;
+    mTotalLeafSize += leafSize;
+    if (leafSize > maxLeafSize) {
+        maxLeafSize = leafSize;
+    }
+
+    return JSPCOST_TRIANGLE * leafSize * JSPBBoxArea(&childRegion);
+}
\ No newline at end of file
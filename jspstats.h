@@ -0,0 +1,40 @@
+#pragma once
+
+#include "rw.h"
+#include "jsp.h"
+
+// Traversal cost model.
+// The expected cost of a query is the cost of every branch node and triangle it has to visit,
+// weighted by the chance of visiting it. That chance is estimated as the surface area of the region
+// the node covers divided by the surface area of the region its parent covers.
+#define JSPCOST_BRANCH 1.0f     // Cost of visiting a branch node
+#define JSPCOST_TRIANGLE 3.0f   // Cost of testing a triangle
+
+RwReal JSPBBoxArea(const RwBBox* bbox);
+
+struct JSPTreeStats
+{
+    RwUInt32 numBranchNodes;
+    RwUInt32 numTriangles;
+    RwUInt32 numLeaves;
+    RwUInt32 maxLeafSize;
+    RwInt32 maxDepth;
+    RwReal avgLeafSize;
+    RwReal cost;            // Expected traversal cost of a query inside the model's bbox
+
+    // triFlags points to the first triangle's flags, with triStride bytes between each triangle's flags.
+    // This way the stats can be calculated straight from the builder's triangles as well as a ClumpCollBSPTree.
+    void Calculate(const ClumpCollBSPBranchNode* branchNodes, RwUInt32 numBranchNodes,
+                   const RwUInt8* triFlags, RwUInt32 triStride, RwUInt32 numTriangles,
+                   const RwBBox* bbox);
+    void Calculate(const ClumpCollBSPTree* tree, const RwBBox* bbox);
+
+private:
+    const ClumpCollBSPBranchNode* mBranchNodes;
+    const RwUInt8* mTriFlags;
+    RwUInt32 mTriStride;
+    RwUInt32 mTotalLeafSize;
+
+    RwReal CalcNodeCost(RwUInt32 nodeIndex, const RwBBox* region, RwInt32 depth);
+    RwReal CalcChildCost(RwUInt32 info, RwReal value, RwBool isLeft, const RwBBox* region, RwInt32 depth);
+};
\ No newline at end of file
@@ -0,0 +1,421 @@
+#include "libjspgen.h"
+#include "parallel.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <assert.h>
+
+JSPGenSettings::JSPGenSettings()
+{
+    platform = PLAT_GC;
+    mode = JSPBUILD_MIDPOINT;
+    optimizeTreelets = FALSE;
+    autoQueryPoints = FALSE;
+    worldSpace = FALSE;
+    twoLevel = FALSE;
+    timeBudget = 0;
+    maxBytes = 0;
+}
+
+void JSPGenSettings::Apply(JSPBuilder* builder) const
+{
+    assert(builder);
+
+    builder->mode = mode;
+    builder->optimizeTreelets = optimizeTreelets;
+    builder->queryPoints = queryPoints;
+    builder->autoQueryPoints = autoQueryPoints;
+    builder->worldSpace = worldSpace;
+    builder->twoLevel = twoLevel;
+    builder->timeBudget = timeBudget;
+    builder->maxBytes = maxBytes;
+    builder->maxBytesStripVecList = (platform == PLAT_GC);
+    builder->triangleRules = triangleRules;
+}
+
+JSPBakeSettings::JSPBakeSettings()
+{
+    numRays = 64;
+    maxDistance = 10.0f;
+    strength = 0.75f;
+    bias = 0.01f;
+}
+
+// Hands the error message to the caller, if they want it, and returns FALSE so failures can just return this
+static RwBool Fail(std::string* errorOut, const RwChar* format, ...)
+{
+    if (errorOut) {
+        RwChar message[256];
+
+        va_list args;
+        va_start(args, format);
+        vsnprintf(message, sizeof(message), format, args);
+        va_end(args);
+
+        *errorOut = message;
+    }
+
+    return FALSE;
+}
+
+RwBool JSPGenReadClump(RpClump* clump, RwStream* stream, std::string* errorOut)
+{
+    assert(clump);
+    assert(stream);
+
+    if (!stream->FindChunk(rwID_CLUMP)) {
+        return Fail(errorOut, "No clump found");
+    }
+
+    if (!clump->StreamRead(stream)) {
+        return Fail(errorOut, "Failed to read clump");
+    }
+
+    for (RpGeometry& geom : clump->geometries) {
+        if (geom.format & rpGEOMETRYNATIVE) {
+            return Fail(errorOut, "Geometry has native data, this is currently unsupported");
+        }
+    }
+
+    return TRUE;
+}
+
+RwBool JSPGenWrite(JSPBuilder* builder, RwStream* stream, Platform platform)
+{
+    assert(builder);
+    assert(stream);
+
+    // GameCube JSPs are big endian and have the strip vertex list, the others have to generate it at runtime
+    RwBool writeStripVecList;
+
+    if (platform == PLAT_GC) {
+        stream->endian = rwBIGENDIAN;
+        writeStripVecList = TRUE;
+    } else {
+        stream->endian = rwLITTLEENDIAN;
+        writeStripVecList = FALSE;
+    }
+
+    return builder->Write(stream, writeStripVecList);
+}
+
+RwBool JSPGenBuild(const void* dffData, RwUInt32 dffLength, const JSPGenSettings* settings,
+                   std::vector<RwUInt8>* jspOut, JSPBuildStats* statsOut, std::string* errorOut)
+{
+    assert(settings);
+    assert(jspOut);
+
+    RwStream dffStream;
+    RpClump clump;
+
+    dffStream.Open(dffData, dffLength);
+
+    if (!JSPGenReadClump(&clump, &dffStream, errorOut)) {
+        return FALSE;
+    }
+
+    JSPBuilder builder;
+    JSP jsp;
+
+    settings->Apply(&builder);
+    builder.collectStats = (statsOut != NULL);
+
+    // The tree is written straight from the builder, so don't bother copying it into the JSP.
+    builder.Build(&jsp, &clump, FALSE);
+
+    RwStream jspStream;
+    jspStream.Open(jspOut);
+
+    if (!JSPGenWrite(&builder, &jspStream, settings->platform)) {
+        return Fail(errorOut, "Failed to write JSP");
+    }
+
+    if (statsOut) {
+        *statsOut = *builder.GetStats();
+    }
+
+    return TRUE;
+}
+
+RwBool JSPGenBuildArchive(HipArchive* archive, const JSPGenSettings* settings, RwInt32 numThreads,
+                          JSPBuildStats* statsOut, std::string* errorOut)
+{
+    assert(archive);
+    assert(settings);
+
+    std::vector<HipAsset*> modelAssets, infoAssets;
+    archive->FindLayerAssets(HIPLAYER_BSP, HIPASSET_JSP, &modelAssets);
+    archive->FindLayerAssets(HIPLAYER_JSPINFO, HIPASSET_JSP, &infoAssets);
+
+    if (modelAssets.empty()) {
+        return Fail(errorOut, "Archive has no JSP assets in its BSP layers");
+    }
+
+    if (infoAssets.size() != 1) {
+        return Fail(errorOut, "Archive must have exactly one JSP asset in its JSPINFO layers (found %d)",
+                    (RwInt32)infoAssets.size());
+    }
+
+    // Read every model, each from its own spot in the archive
+    RwInt32 numModels = (RwInt32)modelAssets.size();
+    std::vector<RpClump> clumps(numModels);
+    std::vector<RwBool> results(numModels);
+
+    ParallelForBlocks(numModels, numThreads, [&](RwInt32, RwInt32 begin, RwInt32 end) {
+        for (RwInt32 i = begin; i < end; i++) {
+            RwStream stream;
+            stream.Open(archive->data.data() + modelAssets[i]->offset, modelAssets[i]->size);
+
+            // Already one model per thread
+            clumps[i].numReadThreads = 1;
+
+            results[i] = JSPGenReadClump(&clumps[i], &stream);
+        }
+    });
+
+    // The game adds each BSP layer's model in order, as if they were one big clump
+    RpClump clump;
+
+    for (RwInt32 i = 0; i < numModels; i++) {
+        if (!results[i]) {
+            return Fail(errorOut, "Failed to read JSP asset %08X", modelAssets[i]->id);
+        }
+
+        clump.Append(&clumps[i]);
+    }
+
+    JSPBuilder builder;
+    JSP jsp;
+
+    settings->Apply(&builder);
+    builder.collectStats = (statsOut != NULL);
+    builder.Build(&jsp, &clump, FALSE);
+
+    std::vector<RwUInt8> jspData;
+    RwStream jspStream;
+    jspStream.Open(&jspData);
+
+    if (!JSPGenWrite(&builder, &jspStream, settings->platform)) {
+        return Fail(errorOut, "Failed to write JSP");
+    }
+
+    archive->ReplaceAssetData(infoAssets[0], &jspData);
+
+    if (statsOut) {
+        *statsOut = *builder.GetStats();
+    }
+
+    return TRUE;
+}
+
+struct BakeVertex
+{
+    RwV3d pos;
+    RwV3d normal;
+    RwRGBA* color;
+};
+
+static void Cross(RwV3d* out, const RwV3d* a, const RwV3d* b)
+{
+    out->x = a->y * b->z - a->z * b->y;
+    out->y = a->z * b->x - a->x * b->z;
+    out->z = a->x * b->y - a->y * b->x;
+}
+
+static RwBool Normalize(RwV3d* v)
+{
+    RwReal length = sqrtf(v->x * v->x + v->y * v->y + v->z * v->z);
+
+    if (length <= 0.0f) {
+        return FALSE;
+    }
+
+    v->x /= length;
+    v->y /= length;
+    v->z /= length;
+
+    return TRUE;
+}
+
+// Positions and normals of a geometry's vertices, in the tree's space.
+// The normals are averaged from the strips' triangles, weighted by area.
+static void GatherBakeVertices(const RpGeometry* geom, const RwV3d* verts, RwUInt8* dffData, std::vector<BakeVertex>* vertsOut)
+{
+    std::vector<RwV3d> positions(geom->numVertices);
+    std::vector<RwV3d> normals(geom->numVertices);
+    std::vector<RwBool> used(geom->numVertices, FALSE);
+    RwUInt32 meshOffset = 0;
+
+    for (const RpMesh& mesh : geom->mesh.meshes) {
+        RwUInt32 numIndices = (RwUInt32)mesh.indices.size();
+
+        for (RwUInt32 k = 0; k < numIndices; k++) {
+            positions[mesh.indices[k]] = verts[meshOffset + k];
+            used[mesh.indices[k]] = TRUE;
+        }
+
+        for (RwUInt32 k = 0; k + 2 < numIndices; k++) {
+            const RxVertexIndex* idx = &mesh.indices[k];
+            const RwV3d* p = &verts[meshOffset + k];
+
+            if (idx[0] == idx[1] || idx[0] == idx[2] || idx[1] == idx[2]) {
+                continue;
+            }
+
+            RwV3d n;
+            JSPBuilder::CalcStripNormal(p, k % 2, &n);
+
+            for (RwInt32 j = 0; j < 3; j++) {
+                normals[idx[j]].x += n.x;
+                normals[idx[j]].y += n.y;
+                normals[idx[j]].z += n.z;
+            }
+        }
+
+        meshOffset += numIndices;
+    }
+
+    for (RwInt32 v = 0; v < geom->numVertices; v++) {
+        BakeVertex bv;
+        bv.pos = positions[v];
+        bv.normal = normals[v];
+        bv.color = (RwRGBA*)&dffData[geom->preLitLumOffset + v * sizeof(RwRGBA)];
+
+        if (used[v] && Normalize(&bv.normal)) {
+            vertsOut->push_back(bv);
+        }
+    }
+}
+
+// Casts a vertex's occlusion rays over the hemisphere above it (cosine weighted, in a fixed spiral so every bake
+// comes out the same) and returns the fraction that hit something.
+static RwReal CalcOcclusion(const JSPRayCaster* caster, const BakeVertex* vertex, const JSPBakeSettings* bakeSettings)
+{
+    const RwV3d& n = vertex->normal;
+
+    RwV3d axis, tangent, bitangent;
+    axis.x = (fabsf(n.x) < 0.9f) ? 1.0f : 0.0f;
+    axis.y = (fabsf(n.x) < 0.9f) ? 0.0f : 1.0f;
+    axis.z = 0.0f;
+    Cross(&tangent, &n, &axis);
+    Normalize(&tangent);
+    Cross(&bitangent, &n, &tangent);
+
+    RwV3d origin;
+    origin.x = vertex->pos.x + n.x * bakeSettings->bias;
+    origin.y = vertex->pos.y + n.y * bakeSettings->bias;
+    origin.z = vertex->pos.z + n.z * bakeSettings->bias;
+
+    RwInt32 numOccluded = 0;
+
+    for (RwInt32 first = 0; first < bakeSettings->numRays; first += RAYPACKETSIZE) {
+        JSPRayPacket packet;
+        packet.numRays = 0;
+
+        for (RwInt32 r = first; r < bakeSettings->numRays && packet.numRays < RAYPACKETSIZE; r++) {
+            RwReal u = (r + 0.5f) / bakeSettings->numRays;
+            RwReal angle = r * 2.39996323f; // Golden angle
+            RwReal radius = sqrtf(u);
+            RwReal x = radius * cosf(angle);
+            RwReal y = radius * sinf(angle);
+            RwReal z = sqrtf(1.0f - u);
+
+            RwV3d dir;
+            dir.x = tangent.x * x + bitangent.x * y + n.x * z;
+            dir.y = tangent.y * x + bitangent.y * y + n.y * z;
+            dir.z = tangent.z * x + bitangent.z * y + n.z * z;
+
+            packet.SetRay(packet.numRays++, &origin, &dir, bakeSettings->maxDistance);
+        }
+
+        caster->Occluded(&packet);
+
+        for (RwInt32 i = 0; i < packet.numRays; i++) {
+            if (packet.hit[i] >= 0) {
+                numOccluded++;
+            }
+        }
+    }
+
+    return (RwReal)numOccluded / bakeSettings->numRays;
+}
+
+RwBool JSPGenBakeAO(std::vector<RwUInt8>* dffData, const JSPGenSettings* settings, const JSPBakeSettings* bakeSettings,
+                    RwInt32 numThreads, std::string* errorOut)
+{
+    assert(dffData);
+    assert(settings);
+    assert(bakeSettings);
+
+    if (bakeSettings->numRays < 1) {
+        return Fail(errorOut, "Bake needs at least 1 ray per vertex (got %d)", bakeSettings->numRays);
+    }
+
+    if (!(bakeSettings->maxDistance > 0.0f)) {
+        return Fail(errorOut, "Bake distance must be greater than 0 (got %g)", bakeSettings->maxDistance);
+    }
+
+    if (!(bakeSettings->strength >= 0.0f && bakeSettings->strength <= 1.0f)) {
+        return Fail(errorOut, "Bake strength must be from 0 to 1 (got %g)", bakeSettings->strength);
+    }
+
+    if (!(bakeSettings->bias >= 0.0f)) {
+        return Fail(errorOut, "Bake bias can't be negative (got %g)", bakeSettings->bias);
+    }
+
+    RwStream dffStream;
+    RpClump clump;
+
+    dffStream.Open(dffData->data(), (RwUInt32)dffData->size());
+
+    if (!JSPGenReadClump(&clump, &dffStream, errorOut)) {
+        return FALSE;
+    }
+
+    for (RpAtomic& atom : clump.atomics) {
+        if (atom.geometry->preLitLum.empty()) {
+            return Fail(errorOut, "Geometry %d has no prelit colors to bake into",
+                        (RwInt32)(atom.geometry - clump.geometries.data()));
+        }
+    }
+
+    JSPBuilder builder;
+    JSP jsp;
+
+    settings->Apply(&builder);
+    builder.collectStats = FALSE;
+    builder.Build(&jsp, &clump);
+
+    // Only visible triangles cast shadows
+    JSPRayCaster caster;
+    caster.requiredFlags = kCLUMPCOLL_ISVISIBLE;
+    caster.Init(&jsp, &clump);
+
+    // Geometries used by more than one atomic are baked where the first one puts them
+    std::vector<BakeVertex> verts;
+    std::vector<RwBool> baked(clump.geometries.size(), FALSE);
+
+    for (RwInt32 atomIndex = 0; atomIndex < (RwInt32)clump.atomics.size(); atomIndex++) {
+        RpGeometry* geom = clump.atomics[atomIndex].geometry;
+        RwInt32 geomIndex = (RwInt32)(geom - clump.geometries.data());
+
+        if (!baked[geomIndex]) {
+            GatherBakeVertices(geom, caster.GetAtomicVerts(atomIndex), dffData->data(), &verts);
+            baked[geomIndex] = TRUE;
+        }
+    }
+
+    ParallelForBlocks((RwInt32)verts.size(), numThreads, [&](RwInt32, RwInt32 begin, RwInt32 end) {
+        for (RwInt32 i = begin; i < end; i++) {
+            RwReal light = 1.0f - bakeSettings->strength * CalcOcclusion(&caster, &verts[i], bakeSettings);
+            RwRGBA* color = verts[i].color;
+
+            color->red = (RwUInt8)(color->red * light + 0.5f);
+            color->green = (RwUInt8)(color->green * light + 0.5f);
+            color->blue = (RwUInt8)(color->blue * light + 0.5f);
+        }
+    });
+
+    return TRUE;
+}
\ No newline at end of file
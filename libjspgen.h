@@ -0,0 +1,75 @@
+#pragma once
+
+#include "rw.h"
+#include "jsp.h"
+#include "jspbuilder.h"
+#include "hip.h"
+#include "raycast.h"
+#include "heatmap.h"
+
+#include <string>
+
+// jspgen as a library, for tools that want to generate JSPs in-process.
+// Nothing here prints anything (other than the readers' error messages) or keeps any global state,
+// so separate calls can run on separate threads at the same time. When a call fails, it says why in errorOut
+// (which is optional).
+
+enum Platform
+{
+    PLAT_GC,
+    PLAT_PS2,
+    PLAT_XBOX,
+
+    PLAT_COUNT
+};
+
+struct JSPGenSettings
+{
+    Platform platform;
+    JSPBuildMode mode;
+    RwBool optimizeTreelets;
+    std::vector<RwV3d> queryPoints;
+    RwBool autoQueryPoints;
+    RwBool worldSpace;
+    RwBool twoLevel;
+    RwInt32 timeBudget;
+    RwUInt32 maxBytes;      // Counted for the platform's format
+    std::vector<JSPTriangleRule> triangleRules;
+
+    JSPGenSettings();
+
+    // Copies the build settings into a builder
+    void Apply(JSPBuilder* builder) const;
+};
+
+struct JSPBakeSettings
+{
+    RwInt32 numRays;        // Occlusion rays per vertex
+    RwReal maxDistance;     // How far away geometry still occludes a vertex
+    RwReal strength;        // How much a fully occluded vertex is darkened, from 0 to 1
+    RwReal bias;            // Rays start this far off the surface, so they don't hit the vertex's own triangles
+
+    JSPBakeSettings();
+};
+
+// Reads a clump from a stream positioned at (or before) its chunk
+RwBool JSPGenReadClump(RpClump* clump, RwStream* stream, std::string* errorOut = NULL);
+
+// Writes a built JSP in the platform's format
+RwBool JSPGenWrite(JSPBuilder* builder, RwStream* stream, Platform platform);
+
+// Builds a JSP from a DFF in memory, appending the JSP to jspOut.
+// statsOut is optional.
+RwBool JSPGenBuild(const void* dffData, RwUInt32 dffLength, const JSPGenSettings* settings,
+                   std::vector<RwUInt8>* jspOut, JSPBuildStats* statsOut = NULL, std::string* errorOut = NULL);
+
+// Rebuilds the JSP in a HIP/HOP archive from the JSP (model) assets in its BSP layers, replacing the JSP asset in its
+// JSPINFO layer. The models are read on up to numThreads threads. statsOut is optional.
+RwBool JSPGenBuildArchive(HipArchive* archive, const JSPGenSettings* settings, RwInt32 numThreads,
+                          JSPBuildStats* statsOut = NULL, std::string* errorOut = NULL);
+
+// Bakes ambient occlusion into the prelit colors of a DFF in memory, in place.
+// The occlusion rays are cast against the same tree a JSP build with these settings makes, so it matches the collision.
+// Every geometry used by an atomic needs to have prelit colors already. Runs on up to numThreads threads.
+RwBool JSPGenBakeAO(std::vector<RwUInt8>* dffData, const JSPGenSettings* settings, const JSPBakeSettings* bakeSettings,
+                    RwInt32 numThreads, std::string* errorOut = NULL);
\ No newline at end of file
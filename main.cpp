@@ -1,17 +1,36 @@
 #include "rw.h"
 #include "jsp.h"
 #include "jspbuilder.h"
+#include "libjspgen.h"
+#include "filewatch.h"
+#include "parallel.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
 
-enum Platform
+static RwBool ReadClump(RpClump* clump, const RwChar* path)
 {
-    PLAT_GC,
-    PLAT_PS2,
-    PLAT_XBOX
-};
+    RwStream stream;
 
-static RwBool ReadClump(RpClump* clump, const RwChar* path)
+    if (!stream.Open(path, rwSTREAMREAD)) {
+        return FALSE;
+    }
+
+    std::string error;
+
+    if (!JSPGenReadClump(clump, &stream, &error)) {
+        printf("Error: %s\n", error.c_str());
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static RwBool ReadJSP(JSP* jsp, const RwChar* path)
 {
     RwStream stream;
 
@@ -19,81 +38,661 @@ static RwBool ReadClump(RpClump* clump, const RwChar* path)
         return FALSE;
     }
 
-    if (!stream.FindChunk(rwID_CLUMP)) {
+    if (!jsp->Read(&stream)) {
+        printf("Error: Failed to read JSP %s\n", path);
         return FALSE;
     }
 
-    if (!clump->StreamRead(&stream)) {
+    return TRUE;
+}
+
+// Reads a query point file. This is a text file with one point per line ("x y z"), lines starting with # are ignored.
+static RwBool ReadQueryPoints(std::vector<RwV3d>* points, const RwChar* path)
+{
+    FILE* file = fopen(path, "r");
+
+    if (!file) {
+        printf("Error: Failed to open query point file %s\n", path);
         return FALSE;
     }
 
-    for (RpGeometry& geom : clump->geometries) {
-        if (geom.format & rpGEOMETRYNATIVE) {
-            printf("Error: Geometry has native data, this is currently unsupported\n");
+    char line[256];
+    RwInt32 lineNumber = 0;
+
+    while (fgets(line, sizeof(line), file)) {
+        lineNumber++;
+
+        char* c = line;
+        while (*c == ' ' || *c == '\t') c++;
+
+        if (*c == '#' || *c == '\n' || *c == '\r' || *c == '\0') {
+            continue;
+        }
+
+        RwV3d point;
+        if (sscanf(c, "%f %f %f", &point.x, &point.y, &point.z) != 3) {
+            printf("Error: Invalid query point on line %d of %s\n", lineNumber, path);
+            fclose(file);
             return FALSE;
         }
+
+        points->push_back(point);
     }
 
+    fclose(file);
+
     return TRUE;
 }
 
-static RwBool WriteJSP(JSP* jsp, const RwChar* path, Platform platform)
+// Reads a triangle rule file. One rule per line, flags first and then any conditions, all of which have to match:
+//     nostand|shadow [nostand|shadow] [minslope=<degrees>] [maxslope=<degrees>] [mat=<index>] [atom=<index>]
+// Lines starting with # are ignored.
+static RwBool ReadTriangleRules(std::vector<JSPTriangleRule>* rules, const RwChar* path)
+{
+    FILE* file = fopen(path, "r");
+
+    if (!file) {
+        printf("Error: Failed to open triangle rule file %s\n", path);
+        return FALSE;
+    }
+
+    char line[256];
+    RwInt32 lineNumber = 0;
+
+    while (fgets(line, sizeof(line), file)) {
+        lineNumber++;
+
+        char* c = line;
+        while (*c == ' ' || *c == '\t') c++;
+
+        if (*c == '#' || *c == '\n' || *c == '\r' || *c == '\0') {
+            continue;
+        }
+
+        JSPTriangleRule rule;
+        RwBool valid = TRUE;
+
+        for (char* token = strtok(c, " \t\r\n"); token && valid; token = strtok(NULL, " \t\r\n")) {
+            char* value = strchr(token, '=');
+            char* end = NULL;
+
+            if (value) {
+                *value++ = '\0';
+            }
+
+            if (!value && strcmp(token, "nostand") == 0) {
+                rule.flags |= kCLUMPCOLL_NOSTAND;
+            } else if (!value && strcmp(token, "shadow") == 0) {
+                rule.flags |= kCLUMPCOLL_SHADOW;
+            } else if (value && strcmp(token, "minslope") == 0) {
+                rule.minSlope = strtof(value, &end);
+            } else if (value && strcmp(token, "maxslope") == 0) {
+                rule.maxSlope = strtof(value, &end);
+            } else if (value && strcmp(token, "mat") == 0) {
+                rule.matIndex = (RwInt32)strtol(value, &end, 10);
+            } else if (value && strcmp(token, "atom") == 0) {
+                rule.atomIndex = (RwInt32)strtol(value, &end, 10);
+            } else {
+                valid = FALSE;
+            }
+
+            if (end && (end == value || *end != '\0')) {
+                valid = FALSE;
+            }
+        }
+
+        if (!valid || !rule.flags || rule.minSlope > rule.maxSlope) {
+            printf("Error: Invalid triangle rule on line %d of %s\n", lineNumber, path);
+            fclose(file);
+            return FALSE;
+        }
+
+        rules->push_back(rule);
+    }
+
+    fclose(file);
+
+    return TRUE;
+}
+
+// Prints two trees' stats side by side, e.g. a vanilla JSP and the one we generated for the same model.
+static void PrintComparison(const JSPTreeStats* a, const RwChar* nameA, const JSPTreeStats* b, const RwChar* nameB)
+{
+    printf("%-24s %12s %12s\n", "", nameA, nameB);
+    printf("%-24s %12u %12u\n", "Branch nodes", a->numBranchNodes, b->numBranchNodes);
+    printf("%-24s %12u %12u\n", "Triangles", a->numTriangles, b->numTriangles);
+    printf("%-24s %12u %12u\n", "Leaves", a->numLeaves, b->numLeaves);
+    printf("%-24s %12.2f %12.2f\n", "Average leaf size", a->avgLeafSize, b->avgLeafSize);
+    printf("%-24s %12u %12u\n", "Max leaf size", a->maxLeafSize, b->maxLeafSize);
+    printf("%-24s %12d %12d\n", "Max BSP depth", a->maxDepth, b->maxDepth);
+    printf("%-24s %12.2f %12.2f\n", "Traversal cost", a->cost, b->cost);
+
+    if (a->numTriangles != b->numTriangles) {
+        printf("Warning: Triangle counts don't match, the trees may not be for the same model\n");
+    }
+
+    if (a->cost > 0.0f) {
+        RwReal change = (b->cost - a->cost) / a->cost * 100.0f;
+        printf("%s is %.1f%% %s than %s\n", nameB, fabsf(change), (change <= 0.0f) ? "cheaper" : "more expensive", nameA);
+    }
+}
+
+static void PrintBuildStats(const JSPBuildStats* stats)
+{
+    printf("Branch nodes: %d\n", stats->numBranchNodes);
+    printf("Triangles: %d\n", stats->numTriangles);
+    printf("Max BSP depth reached: %d\n", stats->maxDepthReached);
+
+    if (stats->numQueryPoints) {
+        printf("Query points: %d\n", stats->numQueryPoints);
+    }
+
+    if (stats->numSharedAtomics) {
+        printf("Shared atomics: %d\n", stats->numSharedAtomics);
+    }
+
+    if (stats->numTaggedTriangles) {
+        printf("Triangles tagged by rules: %d\n", stats->numTaggedTriangles);
+    }
+
+    if (stats->numSubtrees) {
+        printf("Atomic subtrees: %d\n", stats->numSubtrees);
+    }
+
+    if (stats->numAxisRetries || stats->numMedianSplits || stats->numBalancedSplits) {
+        printf("Fallback splits: %d center, %d median, %d balanced\n",
+               stats->numAxisRetries, stats->numMedianSplits, stats->numBalancedSplits);
+    }
+
+    if (stats->numCandidates) {
+        printf("Time budget: %d trees built, traversal cost %.2f -> %.2f\n", stats->numCandidates, stats->firstCost, stats->bestCost);
+    }
+
+    if (stats->maxBytes) {
+        printf("Size: %u bytes, %.1f%% of the %u byte limit\n", stats->numBytes, 100.0f * stats->numBytes / stats->maxBytes, stats->maxBytes);
+
+        if (stats->numPrunedNodes) {
+            printf("Pruned branch nodes: %d, traversal cost %.2f -> %.2f\n", stats->numPrunedNodes, stats->unprunedCost, stats->prunedCost);
+        }
+
+        if (stats->numBytes > stats->maxBytes) {
+            printf("Warning: The JSP is %u bytes over the limit, and can't get under %u bytes even with its leaves as long as they can be, so it was left unpruned\n",
+                   stats->numBytes - stats->maxBytes, stats->minBytes);
+        }
+    }
+
+    if (stats->numTreelets) {
+        printf("Restructured treelets: %d/%d\n", stats->numRestructuredTreelets, stats->numTreelets);
+        printf("Traversal cost: %.2f -> %.2f\n", stats->costBefore, stats->costAfter);
+    }
+}
+
+static const RwChar* gPlatformNames[] = { "gc", "ps2", "xbox" };
+
+// Output paths can have a {platform} in them, which is replaced with the platform's name,
+// so one build can write a JSP for every platform (level_{platform}.jsp -> level_gc.jsp, level_ps2.jsp...)
+#define PLATFORMTOKEN "{platform}"
+
+static std::string GetPlatformOutputPath(const RwChar* path, Platform platform)
+{
+    std::string outputPath = path;
+    size_t pos = outputPath.find(PLATFORMTOKEN);
+
+    if (pos != std::string::npos) {
+        outputPath.replace(pos, strlen(PLATFORMTOKEN), gPlatformNames[platform]);
+    }
+
+    return outputPath;
+}
+
+static RwBool WriteJSP(JSPBuilder* jspBuilder, const RwChar* path, Platform platform)
 {
     RwStream stream;
-    RwBool writeStripVecList;
 
-    if (platform == PLAT_GC) {
-        stream.endian = rwBIGENDIAN;
-        writeStripVecList = TRUE;
-    } else {
-        stream.endian = rwLITTLEENDIAN;
-        writeStripVecList = FALSE;
+    // Write to a temporary file first and then swap it in, so the game or another tool
+    // never sees a half-written JSP (and a failed write doesn't trash the old one).
+    std::string tempPath = std::string(path) + ".tmp";
+
+    if (!stream.Open(tempPath.c_str(), rwSTREAMWRITE)) {
+        return FALSE;
     }
 
-    if (!stream.Open(path, rwSTREAMWRITE)) {
+    if (!JSPGenWrite(jspBuilder, &stream, platform)) {
+        stream.Close();
+        remove(tempPath.c_str());
         return FALSE;
     }
 
-    if (!jsp->Write(&stream, writeStripVecList)) {
+    stream.Close();
+
+    return AtomicReplaceFile(tempPath.c_str(), path);
+}
+
+// Writes the built tree out once for each platform. Writing only reads the builder, so the platforms are written
+// at the same time, and building for every platform costs about the same as building for one.
+static RwBool WriteJSPs(JSPBuilder* jspBuilder, const RwChar* outputPath, const std::vector<Platform>* platforms)
+{
+    RwInt32 numPlatforms = (RwInt32)platforms->size();
+    std::vector<RwBool> results(numPlatforms);
+
+    ParallelForBlocks(numPlatforms, numPlatforms, [&](RwInt32, RwInt32 begin, RwInt32 end) {
+        for (RwInt32 i = begin; i < end; i++) {
+            Platform platform = (*platforms)[i];
+            results[i] = WriteJSP(jspBuilder, GetPlatformOutputPath(outputPath, platform).c_str(), platform);
+        }
+    });
+
+    RwBool success = TRUE;
+
+    for (RwInt32 i = 0; i < numPlatforms; i++) {
+        if (!results[i]) {
+            printf("Error: Failed to write %s\n", GetPlatformOutputPath(outputPath, (*platforms)[i]).c_str());
+            success = FALSE;
+        }
+    }
+
+    return success;
+}
+
+// Queries the tree at every triangle and writes the model colored by what each query cost, for finding slow spots.
+static RwBool WriteHeatmap(const JSP* jsp, const RpClump* clump, const RwChar* path, RwReal queryRadius)
+{
+    JSPHeatmap heatmap;
+    heatmap.queryRadius = queryRadius;
+    heatmap.Init(jsp, clump);
+
+    std::vector<JSPQueryCost> costs;
+    heatmap.QueryTriangles(&costs, GetNumWorkerThreads());
+
+    if (!costs.empty()) {
+        RwInt32 worst = 0;
+        RwReal totalCost = 0.0f;
+
+        for (RwInt32 i = 0; i < (RwInt32)costs.size(); i++) {
+            totalCost += costs[i].cost;
+
+            if (costs[i].cost > costs[worst].cost) {
+                worst = i;
+            }
+        }
+
+        const RwV3d* v = heatmap.GetTriangleVerts(worst);
+
+        printf("Query cost: %.2f average, %.2f worst (%d branch nodes, %d triangles) at (%.2f, %.2f, %.2f)\n",
+               totalCost / costs.size(), costs[worst].cost, costs[worst].numBranchNodes, costs[worst].numTriangles,
+               (v[0].x + v[1].x + v[2].x) / 3.0f, (v[0].y + v[1].y + v[2].y) / 3.0f, (v[0].z + v[1].z + v[2].z) / 3.0f);
+    }
+
+    RwStream stream;
+    std::string tempPath = std::string(path) + ".tmp";
+
+    if (!stream.Open(tempPath.c_str(), rwSTREAMWRITE)) {
+        return FALSE;
+    }
+
+    if (!heatmap.WritePLY(&stream, &costs)) {
+        printf("Error: Failed to write heatmap %s\n", path);
+        stream.Close();
+        remove(tempPath.c_str());
+        return FALSE;
+    }
+
+    stream.Close();
+
+    return AtomicReplaceFile(tempPath.c_str(), path);
+}
+
+static RwBool BuildJSP(JSPBuilder* jspBuilder, const RwChar* inputPath, const RwChar* outputPath,
+                       const std::vector<Platform>* platforms, JSP* vanillaJSP, const RwChar* heatmapPath,
+                       RwReal heatmapRadius, RpGeometryCache* geometryCache)
+{
+    RpClump clump;
+    JSP jsp;
+
+    clump.geometryCache = geometryCache;
+
+    if (!ReadClump(&clump, inputPath)) {
+        return FALSE;
+    }
+
+    if (geometryCache && geometryCache->numReused > 0) {
+        printf("Reused %d unchanged geometries, decoded %d\n", geometryCache->numReused,
+               (RwInt32)clump.geometries.size() - geometryCache->numReused);
+    }
+
+    // The tree is written straight from the builder, so don't bother copying it into the JSP,
+    // unless the heatmap needs it there.
+    jspBuilder->Build(&jsp, &clump, heatmapPath != NULL);
+
+    PrintBuildStats(jspBuilder->GetStats());
+
+    if (!WriteJSPs(jspBuilder, outputPath, platforms)) {
+        return FALSE;
+    }
+
+    if (vanillaJSP) {
+        // Both trees are measured over the same model bounds
+        JSPTreeStats vanillaStats, jspgenStats;
+        vanillaStats.Calculate(&vanillaJSP->colltree, jspBuilder->GetBBox());
+        jspBuilder->CalcTreeStats(&jspgenStats);
+
+        printf("\n");
+        PrintComparison(&vanillaStats, "vanilla", &jspgenStats, "jspgen");
+    }
+
+    if (heatmapPath && !WriteHeatmap(&jsp, &clump, heatmapPath, heatmapRadius)) {
         return FALSE;
     }
 
     return TRUE;
 }
 
+// Keeps rebuilding the JSP whenever the DFF changes, until the process is killed.
+// The builder, its settings and the vanilla JSP are kept around between builds, and saves that
+// didn't change the DFF's contents (like re-exporting the same thing) don't trigger a rebuild.
+static RwBool WatchJSP(JSPBuilder* jspBuilder, const RwChar* inputPath, const RwChar* outputPath,
+                       const std::vector<Platform>* platforms, JSP* vanillaJSP, const RwChar* heatmapPath,
+                       RwReal heatmapRadius)
+{
+    FileWatcher watcher;
+
+    // Start watching before the first build, so we don't miss a save made during it
+    if (!watcher.Open(inputPath)) {
+        return FALSE;
+    }
+
+    RwUInt64 builtHash = 0;
+    RwBool built = FALSE;
+
+    // Geometries that didn't change since the last save are copied from here instead of being decoded again
+    RpGeometryCache geometryCache;
+
+    for (;;) {
+        RwUInt64 hash;
+
+        if (!HashFile(inputPath, &hash)) {
+            printf("Error: Failed to read %s\n", inputPath);
+        } else if (built && hash == builtHash) {
+            printf("%s is unchanged, skipping rebuild\n", inputPath);
+        } else {
+            auto start = std::chrono::steady_clock::now();
+
+            if (BuildJSP(jspBuilder, inputPath, outputPath, platforms, vanillaJSP, heatmapPath, heatmapRadius,
+                         &geometryCache)) {
+                auto end = std::chrono::steady_clock::now();
+                RwInt32 ms = (RwInt32)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+
+                for (Platform platform : *platforms) {
+                    printf("Wrote %s in %d ms\n", GetPlatformOutputPath(outputPath, platform).c_str(), ms);
+                }
+
+                builtHash = hash;
+                built = TRUE;
+            } else {
+                printf("Build failed, the old JSP was left alone\n");
+            }
+        }
+
+        printf("Watching %s for changes (Ctrl+C to quit)...\n", inputPath);
+        fflush(stdout);
+
+        if (!watcher.Wait()) {
+            printf("Error: Failed to watch %s\n", inputPath);
+            return FALSE;
+        }
+
+        printf("\n");
+    }
+}
+
+static RwBool ReadFileData(const RwChar* path, std::vector<RwUInt8>* dataOut)
+{
+    FILE* file = fopen(path, "rb");
+
+    if (!file) {
+        printf("Error: Failed to open file %s\n", path);
+        return FALSE;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    dataOut->resize(length);
+
+    RwBool success = length >= 0 && fread(dataOut->data(), 1, length, file) == (size_t)length;
+
+    fclose(file);
+
+    if (!success) {
+        printf("Error: Failed to read file %s\n", path);
+    }
+
+    return success;
+}
+
+static RwBool WriteFileData(const RwChar* path, const std::vector<RwUInt8>* data)
+{
+    std::string tempPath = std::string(path) + ".tmp";
+    RwStream stream;
+
+    if (!stream.Open(tempPath.c_str(), rwSTREAMWRITE)) {
+        return FALSE;
+    }
+
+    if (stream.Write(data->data(), (RwUInt32)data->size()) != data->size()) {
+        printf("Error: Failed to write file %s\n", path);
+        stream.Close();
+        remove(tempPath.c_str());
+        return FALSE;
+    }
+
+    stream.Close();
+
+    return AtomicReplaceFile(tempPath.c_str(), path);
+}
+
+// Rebuilds the JSP of each archive in place. Archives are processed in parallel, and so are the models
+// within an archive if there's threads to spare.
+static RwBool BuildArchives(char** paths, RwInt32 numPaths, const JSPGenSettings* settings)
+{
+    std::vector<RwBool> results(numPaths);
+    std::vector<std::string> errors(numPaths);
+    std::vector<JSPBuildStats> stats(numPaths);
+
+    RwInt32 numThreads = GetNumWorkerThreads();
+    RwInt32 numModelThreads = (numPaths < numThreads) ? numThreads / numPaths : 1;
+
+    ParallelForBlocks(numPaths, numThreads, [&](RwInt32, RwInt32 begin, RwInt32 end) {
+        for (RwInt32 i = begin; i < end; i++) {
+            std::vector<RwUInt8> data;
+            HipArchive archive;
+
+            results[i] = ReadFileData(paths[i], &data) &&
+                         archive.Read(data.data(), (RwUInt32)data.size()) &&
+                         JSPGenBuildArchive(&archive, settings, numModelThreads, &stats[i], &errors[i]) &&
+                         WriteFileData(paths[i], &archive.data);
+        }
+    });
+
+    RwBool success = TRUE;
+
+    for (RwInt32 i = 0; i < numPaths; i++) {
+        printf("%s:\n", paths[i]);
+
+        if (results[i]) {
+            PrintBuildStats(&stats[i]);
+        } else {
+            if (!errors[i].empty()) {
+                printf("Error: %s\n", errors[i].c_str());
+            }
+
+            printf("Failed, the archive was left alone\n");
+            success = FALSE;
+        }
+    }
+
+    return success;
+}
+
+// Bakes ambient occlusion into a DFF's prelit colors, writing the result to a new DFF.
+static RwBool BakeAO(const RwChar* inputPath, const RwChar* outputPath, const JSPGenSettings* settings,
+                     const JSPBakeSettings* bakeSettings)
+{
+    std::vector<RwUInt8> data;
+
+    if (!ReadFileData(inputPath, &data)) {
+        return FALSE;
+    }
+
+    std::string error;
+
+    if (!JSPGenBakeAO(&data, settings, bakeSettings, GetNumWorkerThreads(), &error)) {
+        printf("Error: Failed to bake %s: %s\n", inputPath, error.c_str());
+        return FALSE;
+    }
+
+    if (!WriteFileData(outputPath, &data)) {
+        return FALSE;
+    }
+
+    printf("Baked ambient occlusion into %s\n", outputPath);
+
+    return TRUE;
+}
+
 int main(int argc, char** argv)
 {
-    Platform platform;
+    JSPGenSettings settings;
+    JSPBakeSettings bakeSettings;
+    char* comparePath = NULL;
+    char* queryPointsPath = NULL;
+    char* rulesPath = NULL;
+    char* heatmapPath = NULL;
+    RwReal heatmapRadius = JSPHeatmap().queryRadius;
+    RwBool watch = FALSE;
+    RwBool hop = FALSE;
+    RwBool bake = FALSE;
 
     if (argc == 1) {
-        printf("Usage: jspgen -p <platform> [input .dff path] [output .jsp path]\n");
-        printf("    -p: Platform (gc, ps2, or xbox)\n");
+        printf("Usage: jspgen -p <platform> [-f] [-o] [-w] [-a] [--time-budget <ms>] [--max-bytes <bytes>] [-q <query points>] [-r <triangle rules>] [-c <vanilla .jsp path>] [--heatmap <.ply path>] [--heatmap-radius <radius>] [--watch] [input .dff path] [output .jsp path]\n");
+        printf("       jspgen -p <platform> [-f] [-o] [-w] [-a] [--time-budget <ms>] [--max-bytes <bytes>] [-q <query points>] [-r <triangle rules>] --hop [.hop paths...]\n");
+        printf("       jspgen -p <platform> [-f] [-o] [-w] [-a] [-r <triangle rules>] --bake [--ao-distance <distance>] [input .dff path] [output .dff path]\n");
+        printf("    -p: Platform (gc, ps2, or xbox). Several platforms (-p gc,ps2,xbox) are built once and written to an\n");
+        printf("        output path with %s in it, which is replaced with each platform's name\n", PLATFORMTOKEN);
+        printf("    -f: Fast build (lower quality tree, for quick previews)\n");
+        printf("    -o: Optimize the tree after building it (treelet restructuring)\n");
+        printf("    -w: Build in world space, applying each atomic's frame hierarchy\n");
+        printf("    -a: Two-level build, a subtree for each atomic under a top-level tree over the atomics\n");
+        printf("    --time-budget: Keep building and optimizing other trees for this many milliseconds, keeping the best one\n");
+        printf("    --max-bytes: Keep the JSP within this many bytes, giving up the branch nodes that help the least\n");
+        printf("    -q: Query density hint, either a point file (one \"x y z\" per line) or \"auto\" for walkable triangles\n");
+        printf("    -r: Triangle rule file, setting the nostand and shadow flags by slope, material and atomic (see README)\n");
+        printf("    -c: Compare the generated tree against an existing JSP for the same model\n");
+        printf("    --heatmap: Write the model colored by how much a collision query at each triangle costs, to find slow spots\n");
+        printf("    --heatmap-radius: Size of the heatmap's queries, out from the triangle's center (default %g)\n", heatmapRadius);
+        printf("    --watch: Keep running and rebuild the JSP every time the DFF is saved\n");
+        printf("    --hop: Rebuild the JSPINFO layer's JSP of each HOP archive from its BSP layers, in place\n");
+        printf("    --bake: Bake ambient occlusion into the DFF's prelit colors, using the collision tree\n");
+        printf("    --ao-distance: How far away geometry still occludes when baking (default %g)\n", bakeSettings.maxDistance);
         return 1;
     }
 
-    bool foundPlatform = false;
+    std::vector<Platform> platforms;
 
     int optsEnd = 0;
     for (int i = 1; i < argc; i++) {
         char* arg = argv[i];
         if (arg[0] == '-') {
-            if (arg[1] == 'p') {
+            if (strcmp(arg, "--watch") == 0) {
+                watch = TRUE;
+            } else if (strcmp(arg, "--hop") == 0) {
+                hop = TRUE;
+            } else if (strcmp(arg, "--time-budget") == 0) {
+                if (argc < i + 2 || atoi(argv[i + 1]) <= 0) {
+                    printf("Error: --time-budget must have a number of milliseconds greater than 0\n");
+                    return 1;
+                }
+                settings.timeBudget = atoi(argv[i + 1]);
+                i++;
+            } else if (strcmp(arg, "--max-bytes") == 0) {
+                if (argc < i + 2 || strtoul(argv[i + 1], NULL, 10) == 0) {
+                    printf("Error: --max-bytes must have a number of bytes greater than 0\n");
+                    return 1;
+                }
+                settings.maxBytes = (RwUInt32)strtoul(argv[i + 1], NULL, 10);
+                i++;
+            } else if (strcmp(arg, "--heatmap") == 0) {
+                if (argc < i + 2) {
+                    printf("Error: --heatmap must have PLY path\n");
+                    return 1;
+                }
+                heatmapPath = argv[i + 1];
+                i++;
+            } else if (strcmp(arg, "--heatmap-radius") == 0) {
+                if (argc < i + 2 || atof(argv[i + 1]) <= 0.0) {
+                    printf("Error: --heatmap-radius must have a radius greater than 0\n");
+                    return 1;
+                }
+                heatmapRadius = (RwReal)atof(argv[i + 1]);
+                i++;
+            } else if (strcmp(arg, "--bake") == 0) {
+                bake = TRUE;
+            } else if (strcmp(arg, "--ao-distance") == 0) {
+                if (argc < i + 2 || atof(argv[i + 1]) <= 0.0) {
+                    printf("Error: --ao-distance must have a distance greater than 0\n");
+                    return 1;
+                }
+                bakeSettings.maxDistance = (RwReal)atof(argv[i + 1]);
+                i++;
+            } else if (arg[1] == 'p') {
                 if (argc < i + 2) {
                     printf("Error: -p must have platform\n");
                     return 1;
                 }
-                char* plat = argv[i + 1];
-                if (strcmp(plat, "gc") == 0) {
-                    platform = PLAT_GC;
-                } else if (strcmp(plat, "ps2") == 0) {
-                    platform = PLAT_PS2;
-                } else if (strcmp(plat, "xbox") == 0) {
-                    platform = PLAT_XBOX;
-                } else {
-                    printf("Error: unknown platform %s\n", plat);
+                // Any number of platforms, either comma separated or with more -p's
+                for (char* plat = strtok(argv[i + 1], ","); plat; plat = strtok(NULL, ",")) {
+                    RwInt32 p = 0;
+                    while (p < PLAT_COUNT && strcmp(plat, gPlatformNames[p]) != 0) p++;
+
+                    if (p == PLAT_COUNT) {
+                        printf("Error: unknown platform %s\n", plat);
+                        return 1;
+                    }
+
+                    if (std::find(platforms.begin(), platforms.end(), (Platform)p) == platforms.end()) {
+                        platforms.push_back((Platform)p);
+                    }
+                }
+                i++;
+            } else if (arg[1] == 'f') {
+                settings.mode = JSPBUILD_MORTON;
+            } else if (arg[1] == 'o') {
+                settings.optimizeTreelets = TRUE;
+            } else if (arg[1] == 'w') {
+                settings.worldSpace = TRUE;
+            } else if (arg[1] == 'a') {
+                settings.twoLevel = TRUE;
+            } else if (arg[1] == 'q') {
+                if (argc < i + 2) {
+                    printf("Error: -q must have query point file or auto\n");
+                    return 1;
+                }
+                queryPointsPath = argv[i + 1];
+                i++;
+            } else if (arg[1] == 'r') {
+                if (argc < i + 2) {
+                    printf("Error: -r must have triangle rule file\n");
+                    return 1;
+                }
+                rulesPath = argv[i + 1];
+                i++;
+            } else if (arg[1] == 'c') {
+                if (argc < i + 2) {
+                    printf("Error: -c must have JSP path\n");
                     return 1;
                 }
-                foundPlatform = true;
+                comparePath = argv[i + 1];
                 i++;
             } else {
                 printf("Error: unknown option %s\n", arg);
@@ -103,11 +702,58 @@ int main(int argc, char** argv)
         }
     }
 
-    if (!foundPlatform) {
+    if (platforms.empty()) {
         printf("Error: platform argument expected\n");
         return 1;
     }
 
+    settings.platform = platforms[0];
+
+    if (platforms.size() > 1 && (hop || bake)) {
+        printf("Error: --hop and --bake only take one platform\n");
+        return 1;
+    }
+
+    if (queryPointsPath) {
+        if (strcmp(queryPointsPath, "auto") == 0) {
+            settings.autoQueryPoints = TRUE;
+        } else if (!ReadQueryPoints(&settings.queryPoints, queryPointsPath)) {
+            return 1;
+        }
+    }
+
+    if (rulesPath && !ReadTriangleRules(&settings.triangleRules, rulesPath)) {
+        return 1;
+    }
+
+    if (bake) {
+        if (hop || watch || comparePath || heatmapPath) {
+            printf("Error: --bake can't be used with --hop, --watch, -c or --heatmap\n");
+            return 1;
+        }
+
+        if (argc - 1 - optsEnd < 2) {
+            printf("Error: input and output paths expected\n");
+            return 1;
+        }
+
+        return BakeAO(argv[optsEnd + 1], argv[optsEnd + 2], &settings, &bakeSettings) ? 0 : 1;
+    }
+
+    if (hop) {
+        if (watch || comparePath || heatmapPath) {
+            printf("Error: --hop can't be used with --watch, -c or --heatmap\n");
+            return 1;
+        }
+
+        if (argc - 1 - optsEnd < 1) {
+            printf("Error: HOP paths expected\n");
+            return 1;
+        }
+
+        return BuildArchives(&argv[optsEnd + 1], argc - 1 - optsEnd, &settings) ? 0 : 1;
+    }
+
     if (argc - 1 - optsEnd < 2) {
         printf("Error: input and output paths expected\n");
         return 1;
@@ -116,17 +762,32 @@ int main(int argc, char** argv)
     char* inputPath = argv[optsEnd + 1];
     char* outputPath = argv[optsEnd + 2];
 
-    RpClump clump;
-    JSP jsp;
-
-    if (!ReadClump(&clump, inputPath)) {
+    if (platforms.size() > 1 && !strstr(outputPath, PLATFORMTOKEN)) {
+        printf("Error: the output path needs a %s in it when building for more than one platform\n", PLATFORMTOKEN);
         return 1;
     }
 
     JSPBuilder jspBuilder;
-    jspBuilder.Build(&jsp, &clump);
+    settings.Apply(&jspBuilder);
+
+    // With several platforms, the byte limit has to hold for all of them, and the GameCube's JSP is the biggest
+    if (std::find(platforms.begin(), platforms.end(), PLAT_GC) != platforms.end()) {
+        jspBuilder.maxBytesStripVecList = TRUE;
+    }
+
+    JSP vanillaJSP;
+
+    if (comparePath && !ReadJSP(&vanillaJSP, comparePath)) {
+        return 1;
+    }
+
+    if (watch) {
+        return WatchJSP(&jspBuilder, inputPath, outputPath, &platforms, comparePath ? &vanillaJSP : NULL,
+                        heatmapPath, heatmapRadius) ? 0 : 1;
+    }
 
-    if (!WriteJSP(&jsp, outputPath, platform)) {
+    if (!BuildJSP(&jspBuilder, inputPath, outputPath, &platforms, comparePath ? &vanillaJSP : NULL,
+                  heatmapPath, heatmapRadius, NULL)) {
         return 1;
     }
 
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "rw.h"
+
+#include <thread>
+#include <vector>
+
+// Number of worker threads to split parallel work across.
+inline RwInt32 GetNumWorkerThreads()
+{
+    RwInt32 numThreads = (RwInt32)std::thread::hardware_concurrency();
+    return (numThreads > 0) ? numThreads : 1;
+}
+
+// Splits [0, count) into numBlocks contiguous blocks and runs func(blockIndex, begin, end) on each block,
+// one thread per block. Block boundaries only depend on count and numBlocks, so results that are combined
+// in block order are deterministic.
+template <typename Func>
+void ParallelForBlocks(RwInt32 count, RwInt32 numBlocks, Func func)
+{
+    if (numBlocks < 1) numBlocks = 1;
+    if (numBlocks > count) numBlocks = (count > 0) ? count : 1;
+
+    if (numBlocks == 1) {
+        func(0, 0, count);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    threads.reserve(numBlocks - 1);
+
+    for (RwInt32 block = 1; block < numBlocks; block++) {
+        RwInt32 begin = (RwInt32)((RwInt64)count * block / numBlocks);
+        RwInt32 end = (RwInt32)((RwInt64)count * (block + 1) / numBlocks);
+        threads.emplace_back([=]() { func(block, begin, end); });
+    }
+
+    // Run the first block on the calling thread
+    func(0, 0, (RwInt32)((RwInt64)count / numBlocks));
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
\ No newline at end of file
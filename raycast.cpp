@@ -0,0 +1,262 @@
+#include "raycast.h"
+#include "jspbuilder.h"
+#include "parallel.h"
+
+#include <math.h>
+#include <assert.h>
+
+#include <algorithm>
+
+#define RAYSTACKSIZE (MAXBSPDEPTH * 2)
+
+void JSPRayPacket::SetRay(RwInt32 index, const RwV3d* rayOrigin, const RwV3d* rayDir, RwReal length)
+{
+    assert(index >= 0 && index < RAYPACKETSIZE);
+
+    origin[0][index] = rayOrigin->x;
+    origin[1][index] = rayOrigin->y;
+    origin[2][index] = rayOrigin->z;
+    dir[0][index] = rayDir->x;
+    dir[1][index] = rayDir->y;
+    dir[2][index] = rayDir->z;
+    tmax[index] = length;
+}
+
+JSPRayCaster::JSPRayCaster()
+{
+    requiredFlags = 0;
+    mJSP = NULL;
+}
+
+void JSPRayCaster::Init(const JSP* jsp, const RpClump* clump)
+{
+    assert(jsp);
+    assert(clump);
+
+    mJSP = jsp;
+
+    RwUInt32 numVerts = JSPBuilder::CalcAtomicStripOffsets(clump, &mAtomicOffsets);
+    assert(numVerts == mJSP->stripVecList.size());
+}
+
+void JSPRayCaster::Intersect(JSPRayPacket* packet) const
+{
+    Traverse(packet, FALSE);
+}
+
+void JSPRayCaster::Occluded(JSPRayPacket* packet) const
+{
+    Traverse(packet, TRUE);
+}
+
+void JSPRayCaster::CastRays(const JSPRay* rays, JSPRayHit* hitsOut, RwInt32 numRays, RwBool anyHit, RwInt32 numThreads) const
+{
+    RwInt32 numPackets = (numRays + RAYPACKETSIZE - 1) / RAYPACKETSIZE;
+
+    ParallelForBlocks(numPackets, numThreads, [&](RwInt32, RwInt32 begin, RwInt32 end) {
+        for (RwInt32 p = begin; p < end; p++) {
+            RwInt32 first = p * RAYPACKETSIZE;
+
+            JSPRayPacket packet;
+            packet.numRays = std::min(RAYPACKETSIZE, numRays - first);
+
+            for (RwInt32 i = 0; i < packet.numRays; i++) {
+                packet.SetRay(i, &rays[first + i].origin, &rays[first + i].dir, rays[first + i].length);
+            }
+
+            Traverse(&packet, anyHit);
+
+            for (RwInt32 i = 0; i < packet.numRays; i++) {
+                hitsOut[first + i].triangle = packet.hit[i];
+                hitsOut[first + i].t = packet.tmax[i];
+            }
+        }
+    });
+}
+
+// Each ray keeps its own [tnear, tfar] interval through the node it's in. A branch node clips it against each child's
+// overlap plane, and the child is visited if any ray in the packet is still inside it.
+void JSPRayCaster::Traverse(JSPRayPacket* packet, RwBool anyHit) const
+{
+    struct StackEntry
+    {
+        RwUInt32 info;
+        RwReal tnear[RAYPACKETSIZE];
+        RwReal tfar[RAYPACKETSIZE];
+    };
+
+    assert(mJSP);
+    assert(packet->numRays >= 0 && packet->numRays <= RAYPACKETSIZE);
+
+    RwInt32 numRays = packet->numRays;
+
+    for (RwInt32 i = 0; i < numRays; i++) {
+        packet->hit[i] = -1;
+    }
+
+    if (mJSP->colltree.branchNodes.empty()) {
+        return;
+    }
+
+    // Rays parallel to an axis get a huge inverse instead of an infinite one, which keeps the plane distances finite
+    RwReal invDir[3][RAYPACKETSIZE];
+
+    for (RwInt32 axis = 0; axis < 3; axis++) {
+        for (RwInt32 i = 0; i < numRays; i++) {
+            RwReal d = packet->dir[axis][i];
+            invDir[axis][i] = 1.0f / ((d != 0.0f) ? d : 1e-30f);
+        }
+    }
+
+    StackEntry stack[RAYSTACKSIZE];
+    RwInt32 stackSize = 1;
+
+    stack[0].info = CLUMPCOLL_MAKEINFO(kCLUMPCOLL_BRANCH, 0, 0);
+
+    for (RwInt32 i = 0; i < numRays; i++) {
+        stack[0].tnear[i] = 0.0f;
+        stack[0].tfar[i] = packet->tmax[i];
+    }
+
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+
+        // Rays may have hit something since this was pushed
+        RwBool active = FALSE;
+
+        for (RwInt32 i = 0; i < numRays; i++) {
+            RwReal tfar = std::min(entry.tfar[i], packet->tmax[i]);
+            if (anyHit && packet->hit[i] >= 0) tfar = -1.0f;
+
+            entry.tfar[i] = tfar;
+            active |= (entry.tnear[i] <= tfar);
+        }
+
+        if (!active) {
+            continue;
+        }
+
+        RwUInt32 index = CLUMPCOLL_GETINDEX(entry.info);
+
+        if (CLUMPCOLL_GETNODETYPE(entry.info) == kCLUMPCOLL_TRIANGLE) {
+            IntersectChain(packet, index, entry.tnear, entry.tfar, anyHit);
+            continue;
+        }
+
+        const ClumpCollBSPBranchNode& node = mJSP->colltree.branchNodes[index];
+        RwInt32 axis = CLUMPCOLL_GETAXIS(node.leftInfo) / 4;
+        const RwReal* origin = packet->origin[axis];
+        const RwReal* inv = invDir[axis];
+
+        StackEntry left, right;
+        left.info = node.leftInfo;
+        right.info = node.rightInfo;
+
+        RwBool anyLeft = FALSE;
+        RwBool anyRight = FALSE;
+
+        // The left child covers everything up to its plane, the right child everything from its plane on.
+        // Infinite (empty) children come out as empty intervals.
+        for (RwInt32 i = 0; i < numRays; i++) {
+            RwReal tLeft = (node.leftValue - origin[i]) * inv[i];
+            RwReal tRight = (node.rightValue - origin[i]) * inv[i];
+
+            if (inv[i] >= 0.0f) {
+                left.tnear[i] = entry.tnear[i];
+                left.tfar[i] = std::min(entry.tfar[i], tLeft);
+                right.tnear[i] = std::max(entry.tnear[i], tRight);
+                right.tfar[i] = entry.tfar[i];
+            } else {
+                left.tnear[i] = std::max(entry.tnear[i], tLeft);
+                left.tfar[i] = entry.tfar[i];
+                right.tnear[i] = entry.tnear[i];
+                right.tfar[i] = std::min(entry.tfar[i], tRight);
+            }
+
+            anyLeft |= (left.tnear[i] <= left.tfar[i]);
+            anyRight |= (right.tnear[i] <= right.tfar[i]);
+        }
+
+        // Push the far side first so the near side is visited first, going by the first ray
+        RwBool leftFirst = (packet->dir[axis][0] >= 0.0f);
+        StackEntry* first = leftFirst ? &left : &right;
+        StackEntry* second = leftFirst ? &right : &left;
+        RwBool anyFirst = leftFirst ? anyLeft : anyRight;
+        RwBool anySecond = leftFirst ? anyRight : anyLeft;
+
+        assert(stackSize + 2 <= RAYSTACKSIZE);
+
+        if (anySecond) {
+            stack[stackSize++] = *second;
+        }
+
+        if (anyFirst) {
+            stack[stackSize++] = *first;
+        }
+    }
+}
+
+// Test every ray that's inside the leaf against its chain of triangles (Moller-Trumbore, both sides).
+void JSPRayCaster::IntersectChain(JSPRayPacket* packet, RwUInt32 index, const RwReal* tnear, const RwReal* tfar, RwBool anyHit) const
+{
+    const std::vector<ClumpCollBSPTriangle>& triangles = mJSP->colltree.triangles;
+    RwInt32 numRays = packet->numRays;
+
+    for (RwUInt32 t = index; t < triangles.size(); t++) {
+        const ClumpCollBSPTriangle& tri = triangles[t];
+
+        if ((tri.flags & requiredFlags) == requiredFlags) {
+            const RwV3d* v = GetAtomicVerts(tri.v.i.atomIndex) + tri.v.i.meshVertIndex;
+
+            RwReal e1x = v[1].x - v[0].x, e1y = v[1].y - v[0].y, e1z = v[1].z - v[0].z;
+            RwReal e2x = v[2].x - v[0].x, e2y = v[2].y - v[0].y, e2z = v[2].z - v[0].z;
+
+            for (RwInt32 i = 0; i < numRays; i++) {
+                if (tnear[i] > tfar[i] || (anyHit && packet->hit[i] >= 0)) {
+                    continue;
+                }
+
+                RwReal dx = packet->dir[0][i], dy = packet->dir[1][i], dz = packet->dir[2][i];
+
+                RwReal px = dy * e2z - dz * e2y;
+                RwReal py = dz * e2x - dx * e2z;
+                RwReal pz = dx * e2y - dy * e2x;
+                RwReal det = e1x * px + e1y * py + e1z * pz;
+
+                if (fabsf(det) < 1e-12f) {
+                    continue;
+                }
+
+                RwReal invDet = 1.0f / det;
+                RwReal sx = packet->origin[0][i] - v[0].x;
+                RwReal sy = packet->origin[1][i] - v[0].y;
+                RwReal sz = packet->origin[2][i] - v[0].z;
+                RwReal u = (sx * px + sy * py + sz * pz) * invDet;
+
+                if (u < 0.0f || u > 1.0f) {
+                    continue;
+                }
+
+                RwReal qx = sy * e1z - sz * e1y;
+                RwReal qy = sz * e1x - sx * e1z;
+                RwReal qz = sx * e1y - sy * e1x;
+                RwReal w = (dx * qx + dy * qy + dz * qz) * invDet;
+
+                if (w < 0.0f || u + w > 1.0f) {
+                    continue;
+                }
+
+                RwReal dist = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+
+                if (dist > 0.0f && dist < packet->tmax[i]) {
+                    packet->tmax[i] = dist;
+                    packet->hit[i] = (RwInt32)t;
+                }
+            }
+        }
+
+        if (!(tri.flags & kCLUMPCOLL_HASNEXT)) {
+            break;
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "rw.h"
+#include "jsp.h"
+
+#include <vector>
+
+#define RAYPACKETSIZE 8
+
+// A packet of rays, stored one array per component so each traversal step runs across all the rays in a loop.
+// Rays work best in packets when they go roughly the same way (like a vertex's occlusion rays).
+struct JSPRayPacket
+{
+    RwInt32 numRays;                            // Up to RAYPACKETSIZE
+    RwReal origin[3][RAYPACKETSIZE];            // [axis][ray]
+    RwReal dir[3][RAYPACKETSIZE];               // Doesn't need to be normalized, distances are in multiples of it
+    RwReal tmax[RAYPACKETSIZE];                 // Length of each ray. Shortened to the hit distance when something's hit
+    RwInt32 hit[RAYPACKETSIZE];                 // Index of the triangle that was hit, -1 if none
+
+    void SetRay(RwInt32 index, const RwV3d* rayOrigin, const RwV3d* rayDir, RwReal length);
+};
+
+struct JSPRay
+{
+    RwV3d origin;
+    RwV3d dir;
+    RwReal length;
+};
+
+struct JSPRayHit
+{
+    RwInt32 triangle;   // -1 if nothing was hit
+    RwReal t;
+};
+
+// Casts rays against a built collision tree, for offline tools like lighting bakes.
+// Uses the JSP's own tree and strip vec list, so the JSP needs to have been built with its tree copied in.
+// Nothing changes after Init, so any number of threads can cast rays at the same time.
+struct JSPRayCaster
+{
+    RwUInt8 requiredFlags;      // Only triangles with all of these flags are hit (kCLUMPCOLL_ISVISIBLE for lighting)
+
+    JSPRayCaster();
+
+    void Init(const JSP* jsp, const RpClump* clump);
+
+    void Intersect(JSPRayPacket* packet) const;     // Finds the closest hit of each ray
+    void Occluded(JSPRayPacket* packet) const;      // Finds any hit of each ray, which is all occlusion needs
+
+    // Casts any number of rays, in packets, spread over numThreads threads
+    void CastRays(const JSPRay* rays, JSPRayHit* hitsOut, RwInt32 numRays, RwBool anyHit, RwInt32 numThreads) const;
+
+    // Vertices of the triangles of an atomic, in the order the tree's meshVertIndex refers to them
+    const RwV3d* GetAtomicVerts(RwInt32 atomIndex) const { return &mJSP->stripVecList[mAtomicOffsets[atomIndex]]; }
+
+private:
+    const JSP* mJSP;
+    std::vector<RwUInt32> mAtomicOffsets;   // Where each atomic's vertices start in the strip vec list
+
+    void Traverse(JSPRayPacket* packet, RwBool anyHit) const;
+    void IntersectChain(JSPRayPacket* packet, RwUInt32 index, const RwReal* tnear, const RwReal* tfar, RwBool anyHit) const;
+};
\ No newline at end of file
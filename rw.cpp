@@ -1,10 +1,13 @@
 #include "rw.h"
+#include "parallel.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
 
+#include <iterator>
+
 /************************************************
 * RwBBox
 */
@@ -30,58 +33,72 @@ void RwBBox::Calculate(const RwV3d* verts, RwInt32 numVerts)
 }
 
 /************************************************
-* RwStream
+* RwMatrix
 */
 
-#define SWAP16(x)                               \
-    (  (((x) & 0xFF00) >> 8)                    \
-     | (((x) & 0x00FF) << 8) )
-
-#define SWAP32(x)                               \
-    (  (((x) & 0xFF000000) >> 24)               \
-     | (((x) & 0x00FF0000) >> 8)                \
-     | (((x) & 0x0000FF00) << 8)                \
-     | (((x) & 0x000000FF) << 24) )
+void RwMatrix::Multiply(const RwMatrix* a, const RwMatrix* b)
+{
+    RwMatrix m = *a;
 
-#define SWAP64(x)                               \
-    (  (((x) & 0xFF00000000000000) >> 56)       \
-     | (((x) & 0x00FF000000000000) >> 40)       \
-     | (((x) & 0x0000FF0000000000) >> 24)       \
-     | (((x) & 0x000000FF00000000) >> 8)        \
-     | (((x) & 0x00000000FF000000) << 8)        \
-     | (((x) & 0x0000000000FF0000) << 24)       \
-     | (((x) & 0x000000000000FF00) << 40)       \
-     | (((x) & 0x00000000000000FF) << 56) )
+    m.right.x = a->right.x * b->right.x + a->right.y * b->up.x + a->right.z * b->at.x;
+    m.right.y = a->right.x * b->right.y + a->right.y * b->up.y + a->right.z * b->at.y;
+    m.right.z = a->right.x * b->right.z + a->right.y * b->up.z + a->right.z * b->at.z;
+    m.up.x = a->up.x * b->right.x + a->up.y * b->up.x + a->up.z * b->at.x;
+    m.up.y = a->up.x * b->right.y + a->up.y * b->up.y + a->up.z * b->at.y;
+    m.up.z = a->up.x * b->right.z + a->up.y * b->up.z + a->up.z * b->at.z;
+    m.at.x = a->at.x * b->right.x + a->at.y * b->up.x + a->at.z * b->at.x;
+    m.at.y = a->at.x * b->right.y + a->at.y * b->up.y + a->at.z * b->at.y;
+    m.at.z = a->at.x * b->right.z + a->at.y * b->up.z + a->at.z * b->at.z;
+    m.pos.x = a->pos.x * b->right.x + a->pos.y * b->up.x + a->pos.z * b->at.x + b->pos.x;
+    m.pos.y = a->pos.x * b->right.y + a->pos.y * b->up.y + a->pos.z * b->at.y + b->pos.y;
+    m.pos.z = a->pos.x * b->right.z + a->pos.y * b->up.z + a->pos.z * b->at.z + b->pos.z;
 
-static void MemSwap16(void* mem, RwUInt32 size)
-{
-    RwUInt16* p;
-    for (p = (RwUInt16*)mem; (char*)p < (char*)mem + size; p++) {
-        *p = SWAP16(*p);
-    }
+    *this = m;
 }
 
-static void MemSwap32(void* mem, RwUInt32 size)
+// Transforms the points in place.
+// The matrix is kept in locals and every point is independent, so the compiler can vectorize the loop.
+void RwMatrix::TransformPoints(RwV3d* points, RwInt32 numPoints) const
 {
-    RwUInt32* p;
-    for (p = (RwUInt32*)mem; (char*)p < (char*)mem + size; p++) {
-        *p = SWAP32(*p);
+    const RwReal rx = right.x, ry = right.y, rz = right.z;
+    const RwReal ux = up.x, uy = up.y, uz = up.z;
+    const RwReal ax = at.x, ay = at.y, az = at.z;
+    const RwReal px = pos.x, py = pos.y, pz = pos.z;
+
+    for (RwInt32 i = 0; i < numPoints; i++) {
+        RwReal x = points[i].x;
+        RwReal y = points[i].y;
+        RwReal z = points[i].z;
+
+        points[i].x = x * rx + y * ux + z * ax + px;
+        points[i].y = x * ry + y * uy + z * ay + py;
+        points[i].z = x * rz + y * uz + z * az + pz;
     }
 }
 
-static void MemSwap64(void* mem, RwUInt32 size)
+RwBool RwMatrix::IsIdentity() const
 {
-    RwUInt64* p;
-    for (p = (RwUInt64*)mem; (char*)p < (char*)mem + size; p++) {
-        *p = SWAP64(*p);
-    }
+    return right.x == 1.0f && right.y == 0.0f && right.z == 0.0f &&
+           up.x == 0.0f && up.y == 1.0f && up.z == 0.0f &&
+           at.x == 0.0f && at.y == 0.0f && at.z == 1.0f &&
+           pos.x == 0.0f && pos.y == 0.0f && pos.z == 0.0f;
 }
 
+/************************************************
+* RwStream
+*/
+
 RwStream::RwStream()
 {
+    type = rwNASTREAM;
     accessType = rwNASTREAMACCESS;
     endian = rwLITTLEENDIAN;
+    quiet = FALSE;
     file = NULL;
+    memory = NULL;
+    memoryOut = NULL;
+    memoryLength = 0;
+    position = 0;
 }
 
 RwStream::~RwStream()
@@ -108,11 +125,37 @@ RwBool RwStream::Open(const RwChar* filename, RwStreamAccessType accessType)
         return FALSE;
     }
 
+    this->type = rwSTREAMFILENAME;
     this->accessType = accessType;
 
     return TRUE;
 }
 
+RwBool RwStream::Open(const void* buffer, RwUInt32 length)
+{
+    assert(buffer || length == 0);
+
+    type = rwSTREAMMEMORY;
+    accessType = rwSTREAMREAD;
+    memory = (const RwUInt8*)buffer;
+    memoryLength = length;
+    position = 0;
+
+    return TRUE;
+}
+
+RwBool RwStream::Open(std::vector<RwUInt8>* buffer)
+{
+    assert(buffer);
+
+    type = rwSTREAMMEMORY;
+    accessType = rwSTREAMWRITE;
+    memoryOut = buffer;
+    position = (RwUInt32)buffer->size();
+
+    return TRUE;
+}
+
 void RwStream::Close()
 {
     if (file) {
@@ -120,12 +163,29 @@ void RwStream::Close()
         file = NULL;
     }
 
+    type = rwNASTREAM;
     accessType = rwNASTREAMACCESS;
+    memory = NULL;
+    memoryOut = NULL;
+    memoryLength = 0;
+    position = 0;
 }
 
 RwUInt32 RwStream::Read(void* buffer, RwUInt32 length)
 {
     assert(accessType == rwSTREAMREAD);
+
+    if (type == rwSTREAMMEMORY) {
+        if (length > memoryLength - position) {
+            length = memoryLength - position;
+        }
+
+        memcpy(buffer, memory + position, length);
+        position += length;
+
+        return length;
+    }
+
     assert(file);
 
     return (RwUInt32)fread(buffer, 1, length, (FILE*)file);
@@ -134,6 +194,18 @@ RwUInt32 RwStream::Read(void* buffer, RwUInt32 length)
 RwUInt32 RwStream::Write(const void* buffer, RwUInt32 length)
 {
     assert(accessType == rwSTREAMWRITE);
+
+    if (type == rwSTREAMMEMORY) {
+        if (position + length > memoryOut->size()) {
+            memoryOut->resize(position + length);
+        }
+
+        memcpy(memoryOut->data() + position, buffer, length);
+        position += length;
+
+        return length;
+    }
+
     assert(file);
 
     return (RwUInt32)fwrite(buffer, 1, length, (FILE*)file);
@@ -141,6 +213,16 @@ RwUInt32 RwStream::Write(const void* buffer, RwUInt32 length)
 
 RwBool RwStream::Seek(RwUInt32 pos)
 {
+    if (type == rwSTREAMMEMORY) {
+        if (accessType == rwSTREAMREAD && pos > memoryLength) {
+            return FALSE;
+        }
+
+        position = pos;
+
+        return TRUE;
+    }
+
     assert(file);
 
     return fseek((FILE*)file, pos, SEEK_SET) == 0;
@@ -148,6 +230,16 @@ RwBool RwStream::Seek(RwUInt32 pos)
 
 RwBool RwStream::Skip(RwUInt32 offset)
 {
+    if (type == rwSTREAMMEMORY) {
+        if (accessType == rwSTREAMREAD && offset > memoryLength - position) {
+            return FALSE;
+        }
+
+        position += offset;
+
+        return TRUE;
+    }
+
     assert(file);
 
     return fseek((FILE*)file, offset, SEEK_CUR) == 0;
@@ -155,6 +247,10 @@ RwBool RwStream::Skip(RwUInt32 offset)
 
 RwUInt32 RwStream::Tell() const
 {
+    if (type == rwSTREAMMEMORY) {
+        return position;
+    }
+
     assert(file);
 
     return (RwUInt32)ftell((FILE*)file);
@@ -167,17 +263,17 @@ RwUInt32 RwStream::Read8(void* buffer, RwUInt32 length)
 
 RwUInt32 RwStream::Read16(void* buffer, RwUInt32 length)
 {
-    return SwapRead(buffer, length, MemSwap16);
+    return (endian == rwBIGENDIAN) ? Read16<rwBIGENDIAN>(buffer, length) : Read16<rwLITTLEENDIAN>(buffer, length);
 }
 
 RwUInt32 RwStream::Read32(void* buffer, RwUInt32 length)
 {
-    return SwapRead(buffer, length, MemSwap32);
+    return (endian == rwBIGENDIAN) ? Read32<rwBIGENDIAN>(buffer, length) : Read32<rwLITTLEENDIAN>(buffer, length);
 }
 
 RwUInt32 RwStream::Read64(void* buffer, RwUInt32 length)
 {
-    return SwapRead(buffer, length, MemSwap64);
+    return (endian == rwBIGENDIAN) ? Read64<rwBIGENDIAN>(buffer, length) : Read64<rwLITTLEENDIAN>(buffer, length);
 }
 
 RwUInt32 RwStream::Write8(const void* buffer, RwUInt32 length)
@@ -187,99 +283,33 @@ RwUInt32 RwStream::Write8(const void* buffer, RwUInt32 length)
 
 RwUInt32 RwStream::Write16(const void* buffer, RwUInt32 length)
 {
-    return SwapWrite(buffer, length, MemSwap16);
+    return (endian == rwBIGENDIAN) ? Write16<rwBIGENDIAN>(buffer, length) : Write16<rwLITTLEENDIAN>(buffer, length);
 }
 
 RwUInt32 RwStream::Write32(const void* buffer, RwUInt32 length)
 {
-    return SwapWrite(buffer, length, MemSwap32);
+    return (endian == rwBIGENDIAN) ? Write32<rwBIGENDIAN>(buffer, length) : Write32<rwLITTLEENDIAN>(buffer, length);
 }
 
 RwUInt32 RwStream::Write64(const void* buffer, RwUInt32 length)
 {
-    return SwapWrite(buffer, length, MemSwap64);
-}
-
-RwUInt32 RwStream::SwapRead(void* buffer, RwUInt32 length, void(*swap)(void*, RwUInt32))
-{
-    assert(accessType == rwSTREAMREAD);
-    assert(file);
-    assert(buffer);
-    assert(length);
-    assert(swap);
-
-    if (endian == rwENDIAN) {
-        return Read(buffer, length);
-    }
-
-    RwUInt32 bytesRead = Read(buffer, length);
-
-    swap(buffer, length);
-
-    return bytesRead;
-}
-
-RwUInt32 RwStream::SwapWrite(const void* buffer, RwUInt32 length, void(*swap)(void*, RwUInt32))
-{
-    assert(accessType == rwSTREAMWRITE);
-    assert(file);
-    assert(buffer);
-    assert(length);
-    assert(swap);
-
-    if (endian == rwENDIAN) {
-        return Write(buffer, length);
-    }
-
-    RwUInt8 convertBuffer[256];
-    RwUInt32 totalBytesWritten = 0;
-    RwUInt32 bytesLeft = length;
-
-    while (bytesLeft) {
-        RwUInt32 bytesToWrite = bytesLeft < sizeof(convertBuffer) ? bytesLeft : sizeof(convertBuffer);
-
-        memcpy(convertBuffer, buffer, bytesToWrite);
-        swap(convertBuffer, bytesToWrite);
-
-        RwUInt32 bytesWritten = Write(convertBuffer, bytesToWrite);
-
-        totalBytesWritten += bytesWritten;
-
-        if (bytesWritten != bytesToWrite) {
-            break;
-        }
-
-        bytesLeft -= bytesWritten;
-        buffer = (RwUInt8*)buffer + bytesWritten;
-    }
-
-    return totalBytesWritten;
+    return (endian == rwBIGENDIAN) ? Write64<rwBIGENDIAN>(buffer, length) : Write64<rwLITTLEENDIAN>(buffer, length);
 }
 
 RwBool RwStream::ReadChunkHeader(RwChunkHeader* header)
 {
     assert(header);
 
-    RwEndian oldEndian = endian;
-
-    endian = rwLITTLEENDIAN;
-    RwUInt32 size = Read32(header, sizeof(RwChunkHeader));
-    endian = oldEndian;
-
-    return size == sizeof(RwChunkHeader);
+    // Chunk headers are always little endian
+    return Read32<rwLITTLEENDIAN>(header, sizeof(RwChunkHeader)) == sizeof(RwChunkHeader);
 }
 
 RwBool RwStream::WriteChunkHeader(RwChunkHeader* header)
 {
     assert(header);
 
-    RwEndian oldEndian = endian;
-
-    endian = rwLITTLEENDIAN;
-    RwUInt32 size = Write32(header, sizeof(RwChunkHeader));
-    endian = oldEndian;
-
-    return size == sizeof(RwChunkHeader);
+    // Chunk headers are always little endian
+    return Write32<rwLITTLEENDIAN>(header, sizeof(RwChunkHeader)) == sizeof(RwChunkHeader);
 }
 
 RwBool RwStream::FindChunk(RwUInt32 type, RwUInt32* lengthOut)
@@ -296,7 +326,7 @@ RwBool RwStream::FindChunk(RwUInt32 type, RwUInt32* lengthOut)
         }
 
         if (!Skip(header.length)) {
-            printf("RwStream error: Failed to skip chunk %d (length %d) while looking for chunk %d\n",
+            if (!quiet) printf("RwStream error: Failed to skip chunk %d (length %d) while looking for chunk %d\n",
                    header.type, header.length, type);
             return FALSE;
         }
@@ -322,13 +352,14 @@ struct BinMesh
     RwInt32 matIndex;
 };
 
+template <RwEndian E>
 RwBool RpMeshHeader::StreamRead(RwStream* stream, RpGeometry* geometry)
 {
     assert(stream);
     assert(geometry);
 
     BinMeshHeader mh;
-    if (stream->Read32(&mh, sizeof(mh)) != sizeof(mh)) {
+    if (stream->Read32<E>(&mh, sizeof(mh)) != sizeof(mh)) {
         return FALSE;
     }
 
@@ -338,7 +369,7 @@ RwBool RpMeshHeader::StreamRead(RwStream* stream, RpGeometry* geometry)
 
     for (RwUInt32 i = 0; i < mh.numMeshes; i++) {
         BinMesh m;
-        if (stream->Read32(&m, sizeof(m)) != sizeof(m)) {
+        if (stream->Read32<E>(&m, sizeof(m)) != sizeof(m)) {
             return FALSE;
         }
 
@@ -354,7 +385,7 @@ RwBool RpMeshHeader::StreamRead(RwStream* stream, RpGeometry* geometry)
                 RwUInt32 readIndices = (remainingIndices < 256) ? remainingIndices : 256;
                 RwUInt32 readSize = readIndices * sizeof(RwUInt32);
 
-                if (stream->Read32(indexBuffer, readSize) != readSize) {
+                if (stream->Read32<E>(indexBuffer, readSize) != readSize) {
                     return FALSE;
                 }
 
@@ -395,6 +426,7 @@ struct BinMorphTarget
     RwBool normalsPresent;
 };
 
+template <RwEndian E>
 RwBool RpGeometry::StreamRead(RwStream* stream)
 {
     assert(stream);
@@ -404,12 +436,13 @@ RwBool RpGeometry::StreamRead(RwStream* stream)
     }
 
     BinGeometry g;
-    if (stream->Read32(&g, sizeof(g)) != sizeof(g)) {
+    if (stream->Read32<E>(&g, sizeof(g)) != sizeof(g)) {
         return FALSE;
     }
 
     format = g.format;
     numVertices = g.numVertices;
+    preLitLumOffset = 0;
 
     if (g.format & 0xFF0000) {
         numTexCoordSets = (g.format & 0xFF0000) >> 16;
@@ -426,6 +459,7 @@ RwBool RpGeometry::StreamRead(RwStream* stream)
             if (g.format & rpGEOMETRYPRELIT) {
                 RwUInt32 size = g.numVertices * sizeof(RwRGBA);
 
+                preLitLumOffset = stream->Tell();
                 preLitLum.resize(g.numVertices);
                 if (stream->Read(&preLitLum[0], size) != size) {
                     return FALSE;
@@ -437,7 +471,7 @@ RwBool RpGeometry::StreamRead(RwStream* stream)
 
                 for (RwInt32 i = 0; i < numTexCoordSets; i++) {
                     texCoords[i].resize(g.numVertices);
-                    if (stream->Read32(&texCoords[i][0], size) != size) {
+                    if (stream->Read32<E>(&texCoords[i][0], size) != size) {
                         return FALSE;
                     }
                 }
@@ -447,7 +481,7 @@ RwBool RpGeometry::StreamRead(RwStream* stream)
                 RwUInt32 size = g.numTriangles * sizeof(BinTriangle);
 
                 triangles.resize(g.numTriangles);
-                if (stream->Read32(&triangles[0], size) != size) {
+                if (stream->Read32<E>(&triangles[0], size) != size) {
                     return FALSE;
                 }
 
@@ -469,7 +503,7 @@ RwBool RpGeometry::StreamRead(RwStream* stream)
 
         for (RwInt32 i = 0; i < g.numMorphTargets; i++) {
             BinMorphTarget mt;
-            if (stream->Read32(&mt, sizeof(mt)) != sizeof(mt)) {
+            if (stream->Read32<E>(&mt, sizeof(mt)) != sizeof(mt)) {
                 return FALSE;
             }
 
@@ -479,7 +513,7 @@ RwBool RpGeometry::StreamRead(RwStream* stream)
                 RwUInt32 size = g.numVertices * sizeof(RwV3d);
 
                 morphTargets[i].verts.resize(g.numVertices);
-                if (stream->Read32(&morphTargets[i].verts[0], size) != size) {
+                if (stream->Read32<E>(&morphTargets[i].verts[0], size) != size) {
                     return FALSE;
                 }
             }
@@ -488,7 +522,7 @@ RwBool RpGeometry::StreamRead(RwStream* stream)
                 RwUInt32 size = g.numVertices * sizeof(RwV3d);
 
                 morphTargets[i].normals.resize(g.numVertices);
-                if (stream->Read32(&morphTargets[i].normals[0], size) != size) {
+                if (stream->Read32<E>(&morphTargets[i].normals[0], size) != size) {
                     return FALSE;
                 }
             }
@@ -499,7 +533,7 @@ RwBool RpGeometry::StreamRead(RwStream* stream)
 
     if (stream->FindChunk(rwID_EXTENSION)) {
         if (stream->FindChunk(rwID_BINMESHPLUGIN)) {
-            if (!mesh.StreamRead(stream, this)) {
+            if (!mesh.StreamRead<E>(stream, this)) {
                 return FALSE;
             }
         }
@@ -512,6 +546,11 @@ RwBool RpGeometry::StreamRead(RwStream* stream)
 * RpClump
 */
 
+RwBool RpGeometry::StreamRead(RwStream* stream)
+{
+    return (stream->endian == rwBIGENDIAN) ? StreamRead<rwBIGENDIAN>(stream) : StreamRead<rwLITTLEENDIAN>(stream);
+}
+
 struct BinClump
 {
     RwInt32 numAtomics;
@@ -534,6 +573,13 @@ struct BinAtomic
     RwInt32 unused;
 };
 
+RpClump::RpClump()
+{
+    numReadThreads = 0;
+    geometryCache = NULL;
+}
+
+template <RwEndian E>
 RwBool RpClump::StreamRead(RwStream* stream)
 {
     assert(stream);
@@ -544,7 +590,7 @@ RwBool RpClump::StreamRead(RwStream* stream)
 
     BinClump c;
 
-    if (stream->Read32(&c, sizeof(c)) != sizeof(c)) {
+    if (stream->Read32<E>(&c, sizeof(c)) != sizeof(c)) {
         return FALSE;
     }
 
@@ -554,7 +600,7 @@ RwBool RpClump::StreamRead(RwStream* stream)
         return FALSE;
     }
 
-    if (!ReadFrameList(stream)) {
+    if (!ReadFrameList<E>(stream)) {
         return FALSE;
     }
 
@@ -562,7 +608,7 @@ RwBool RpClump::StreamRead(RwStream* stream)
         return FALSE;
     }
 
-    if (!ReadGeometryList(stream)) {
+    if (!ReadGeometryList<E>(stream)) {
         return FALSE;
     }
 
@@ -571,7 +617,7 @@ RwBool RpClump::StreamRead(RwStream* stream)
             return FALSE;
         }
 
-        if (!ReadAtomic(stream)) {
+        if (!ReadAtomic<E>(stream)) {
             return FALSE;
         }
     }
@@ -579,6 +625,12 @@ RwBool RpClump::StreamRead(RwStream* stream)
     return TRUE;
 }
 
+RwBool RpClump::StreamRead(RwStream* stream)
+{
+    return (stream->endian == rwBIGENDIAN) ? StreamRead<rwBIGENDIAN>(stream) : StreamRead<rwLITTLEENDIAN>(stream);
+}
+
+template <RwEndian E>
 RwBool RpClump::ReadFrameList(RwStream* stream)
 {
     assert(stream);
@@ -588,7 +640,7 @@ RwBool RpClump::ReadFrameList(RwStream* stream)
     }
 
     RwInt32 numFrames;
-    if (stream->Read32(&numFrames, sizeof(numFrames)) != sizeof(numFrames)) {
+    if (stream->Read32<E>(&numFrames, sizeof(numFrames)) != sizeof(numFrames)) {
         return FALSE;
     }
 
@@ -596,7 +648,7 @@ RwBool RpClump::ReadFrameList(RwStream* stream)
 
     for (RwInt32 i = 0; i < numFrames; i++) {
         BinFrame f;
-        if (stream->Read32(&f, sizeof(f)) != sizeof(f)) {
+        if (stream->Read32<E>(&f, sizeof(f)) != sizeof(f)) {
             return FALSE;
         }
 
@@ -610,6 +662,7 @@ RwBool RpClump::ReadFrameList(RwStream* stream)
     return TRUE;
 }
 
+template <RwEndian E>
 RwBool RpClump::ReadGeometryList(RwStream* stream)
 {
     assert(stream);
@@ -619,25 +672,130 @@ RwBool RpClump::ReadGeometryList(RwStream* stream)
     }
 
     RwInt32 numGeoms;
-    if (stream->Read32(&numGeoms, sizeof(numGeoms)) != sizeof(numGeoms)) {
+    if (stream->Read32<E>(&numGeoms, sizeof(numGeoms)) != sizeof(numGeoms)) {
         return FALSE;
     }
 
     geometries.resize(numGeoms);
 
+    // Find all the geometry chunks first so they can be decoded independently.
+    // Memory streams are decoded in place, file streams are read into a buffer.
+    RwBool inMemory = (stream->type == rwSTREAMMEMORY);
+    std::vector<RwUInt8> buffer;
+    std::vector<RwUInt32> positions(numGeoms);
+    std::vector<RwUInt32> offsets(numGeoms);
+    std::vector<RwUInt32> lengths(numGeoms);
+
     for (RwInt32 i = 0; i < numGeoms; i++) {
-        if (!stream->FindChunk(rwID_GEOMETRY)) {
+        if (!stream->FindChunk(rwID_GEOMETRY, &lengths[i])) {
             return FALSE;
         }
 
-        if (!geometries[i].StreamRead(stream)) {
+        positions[i] = stream->Tell();
+
+        if (inMemory) {
+            offsets[i] = positions[i];
+            if (!stream->Skip(lengths[i])) {
+                return FALSE;
+            }
+        } else {
+            offsets[i] = (RwUInt32)buffer.size();
+            buffer.resize(buffer.size() + lengths[i]);
+            if (stream->Read(buffer.data() + offsets[i], lengths[i]) != lengths[i]) {
+                return FALSE;
+            }
+        }
+    }
+
+    const RwUInt8* data = inMemory ? stream->memory : buffer.data();
+    RwInt32 numThreads = (numReadThreads > 0) ? numReadThreads : GetNumWorkerThreads();
+    std::vector<RwBool> results(numGeoms);
+    std::vector<RwUInt64> hashes(geometryCache ? numGeoms : 0);
+    std::vector<RwUInt8> reused(numGeoms, FALSE);
+
+    ParallelForBlocks(numGeoms, numThreads, [&](RwInt32, RwInt32 begin, RwInt32 end) {
+        for (RwInt32 i = begin; i < end; i++) {
+            const RwUInt8* geomData = data + offsets[i];
+
+            if (geometryCache) {
+                RwUInt64 hash = 0xCBF29CE484222325;
+
+                for (RwUInt32 j = 0; j < lengths[i]; j++) {
+                    hash ^= geomData[j];
+                    hash *= 0x100000001B3;
+                }
+
+                hashes[i] = hash;
+
+                auto it = geometryCache->entries.find(hash);
+
+                if (it != geometryCache->entries.end() && it->second.endian == E &&
+                    it->second.data.size() == lengths[i] && memcmp(it->second.data.data(), geomData, lengths[i]) == 0) {
+                    geometries[i] = it->second.geometry;
+                    geometries[i].preLitLumOffset += positions[i];
+                    results[i] = TRUE;
+                    reused[i] = TRUE;
+                    continue;
+                }
+            }
+
+            RwStream geomStream;
+            geomStream.Open(geomData, lengths[i]);
+            geomStream.endian = E;
+            geomStream.quiet = TRUE;
+
+            results[i] = geometries[i].StreamRead<E>(&geomStream);
+
+            // Make the offset relative to the clump's stream instead of the geometry's
+            geometries[i].preLitLumOffset += positions[i];
+        }
+    });
+
+    // Fail on the first bad geometry in stream order, reading it again here so any errors print the same way every time
+    for (RwInt32 i = 0; i < numGeoms; i++) {
+        if (!results[i]) {
+            RwStream geomStream;
+            geomStream.Open(data + offsets[i], lengths[i]);
+            geomStream.endian = E;
+
+            geometries[i] = RpGeometry();
+            geometries[i].StreamRead<E>(&geomStream);
+
             return FALSE;
         }
     }
 
+    // Keep just this read's geometries for next time, moving over the entries that were reused
+    if (geometryCache) {
+        std::unordered_map<RwUInt64, RpGeometryCache::Entry> entries;
+        geometryCache->numReused = 0;
+
+        for (RwInt32 i = 0; i < numGeoms; i++) {
+            geometryCache->numReused += reused[i];
+
+            if (entries.count(hashes[i])) {
+                continue;
+            }
+
+            RpGeometryCache::Entry& entry = entries[hashes[i]];
+
+            if (reused[i]) {
+                entry = std::move(geometryCache->entries[hashes[i]]);
+            } else {
+                entry.endian = E;
+                entry.data.assign(data + offsets[i], data + offsets[i] + lengths[i]);
+                entry.geometry = geometries[i];
+                entry.geometry.preLitLumOffset -= positions[i];
+            }
+        }
+
+        geometryCache->entries.swap(entries);
+    }
+
     return TRUE;
 }
 
+template <RwEndian E>
 RwBool RpClump::ReadAtomic(RwStream* stream)
 {
     assert(stream);
@@ -647,7 +805,7 @@ RwBool RpClump::ReadAtomic(RwStream* stream)
     }
 
     BinAtomic a;
-    if (stream->Read32(&a, sizeof(a)) != sizeof(a)) {
+    if (stream->Read32<E>(&a, sizeof(a)) != sizeof(a)) {
         return FALSE;
     }
 
@@ -659,4 +817,47 @@ RwBool RpClump::ReadAtomic(RwStream* stream)
     atomics.push_back(atom);
 
     return TRUE;
+}
+
+// Save the frame and geometry each frame and atomic points to as indices, offset by the given bases
+static void GetClumpLinks(RpClump* clump, RwInt32 frameBase, RwInt32 geomBase, std::vector<RwInt32>* frameParents,
+                          std::vector<RwInt32>* atomicFrames, std::vector<RwInt32>* atomicGeoms)
+{
+    for (RwFrame& frame : clump->frames) {
+        frameParents->push_back(frame.parent ? frameBase + (RwInt32)(frame.parent - clump->frames.data()) : -1);
+    }
+
+    for (RpAtomic& atom : clump->atomics) {
+        atomicFrames->push_back(frameBase + (RwInt32)(atom.frame - clump->frames.data()));
+        atomicGeoms->push_back(geomBase + (RwInt32)(atom.geometry - clump->geometries.data()));
+    }
+}
+
+// Moves another clump's frames, geometries and atomics onto the end of this one's, leaving the other clump empty.
+// The atomics stay in order, so the result is the same as if they had all been read from one clump.
+void RpClump::Append(RpClump* other)
+{
+    assert(other && other != this);
+
+    // Growing the vectors moves everything, so remember the links as indices and redo them afterwards
+    std::vector<RwInt32> frameParents, atomicFrames, atomicGeoms;
+    GetClumpLinks(this, 0, 0, &frameParents, &atomicFrames, &atomicGeoms);
+    GetClumpLinks(other, (RwInt32)frames.size(), (RwInt32)geometries.size(), &frameParents, &atomicFrames, &atomicGeoms);
+
+    frames.insert(frames.end(), other->frames.begin(), other->frames.end());
+    geometries.insert(geometries.end(), std::make_move_iterator(other->geometries.begin()), std::make_move_iterator(other->geometries.end()));
+    atomics.insert(atomics.end(), other->atomics.begin(), other->atomics.end());
+
+    other->frames.clear();
+    other->geometries.clear();
+    other->atomics.clear();
+
+    for (size_t i = 0; i < frames.size(); i++) {
+        frames[i].parent = (frameParents[i] >= 0) ? &frames[frameParents[i]] : NULL;
+    }
+
+    for (size_t i = 0; i < atomics.size(); i++) {
+        atomics[i].frame = &frames[atomicFrames[i]];
+        atomics[i].geometry = &geometries[atomicGeoms[i]];
+    }
 }
\ No newline at end of file
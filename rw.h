@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <vector>
+#include <unordered_map>
 
 typedef int8_t RwInt8;
 typedef int16_t RwInt16;
@@ -35,6 +36,30 @@ enum RwEndian
 
 #define rwENDIAN rwLITTLEENDIAN
 
+#define SWAP16(x)                               \
+    (  (((x) & 0xFF00) >> 8)                    \
+     | (((x) & 0x00FF) << 8) )
+
+#define SWAP32(x)                               \
+    (  (((x) & 0xFF000000) >> 24)               \
+     | (((x) & 0x00FF0000) >> 8)                \
+     | (((x) & 0x0000FF00) << 8)                \
+     | (((x) & 0x000000FF) << 24) )
+
+#define SWAP64(x)                               \
+    (  (((x) & 0xFF00000000000000) >> 56)       \
+     | (((x) & 0x00FF000000000000) >> 40)       \
+     | (((x) & 0x0000FF0000000000) >> 24)       \
+     | (((x) & 0x000000FF00000000) >> 8)        \
+     | (((x) & 0x00000000FF000000) << 8)        \
+     | (((x) & 0x0000000000FF0000) << 24)       \
+     | (((x) & 0x000000000000FF00) << 40)       \
+     | (((x) & 0x00000000000000FF) << 56) )
+
+inline RwUInt16 RwSwap(RwUInt16 x) { return (RwUInt16)SWAP16(x); }
+inline RwUInt32 RwSwap(RwUInt32 x) { return SWAP32(x); }
+inline RwUInt64 RwSwap(RwUInt64 x) { return SWAP64(x); }
+
 struct RwChunkHeader
 {
     RwUInt32 type;
@@ -49,16 +74,33 @@ enum RwStreamAccessType
     rwSTREAMWRITE
 };
 
+enum RwStreamType
+{
+    rwNASTREAM,
+    rwSTREAMFILENAME,
+    rwSTREAMMEMORY
+};
+
 struct RwStream
 {
+    RwStreamType type;
     RwStreamAccessType accessType;
     RwEndian endian;
+    RwBool quiet;       // Don't print errors
     void* file;
 
+    // Memory streams read from a caller-provided buffer, or write to a caller-provided vector (growing it as needed)
+    const RwUInt8* memory;
+    std::vector<RwUInt8>* memoryOut;
+    RwUInt32 memoryLength;
+    RwUInt32 position;
+
     RwStream();
     ~RwStream();
 
     RwBool Open(const RwChar* filename, RwStreamAccessType accessType);
+    RwBool Open(const void* buffer, RwUInt32 length);  // Memory stream for reading
+    RwBool Open(std::vector<RwUInt8>* buffer);          // Memory stream for writing, appends to the buffer
     void Close();
     RwUInt32 Read(void* buffer, RwUInt32 length);
     RwUInt32 Write(const void* buffer, RwUInt32 length);
@@ -66,6 +108,7 @@ struct RwStream
     RwBool Skip(RwUInt32 offset);
     RwUInt32 Tell() const;
 
+    // Reads and writes in the stream's byte order (endian)
     RwUInt32 Read8(void* buffer, RwUInt32 length = sizeof(RwUInt8));
     RwUInt32 Read16(void* buffer, RwUInt32 length = sizeof(RwUInt16));
     RwUInt32 Read32(void* buffer, RwUInt32 length = sizeof(RwUInt32));
@@ -75,16 +118,76 @@ struct RwStream
     RwUInt32 Write32(const void* buffer, RwUInt32 length = sizeof(RwUInt32));
     RwUInt32 Write64(const void* buffer, RwUInt32 length = sizeof(RwUInt64));
 
+    // Reads and writes in a byte order fixed at compile time, for code that's instantiated for each byte order.
+    // The native order is a plain Read/Write, and the other order is swapped inline.
+    template <RwEndian E> RwUInt32 Read16(void* buffer, RwUInt32 length = sizeof(RwUInt16)) { return SwapRead<E, RwUInt16>(buffer, length); }
+    template <RwEndian E> RwUInt32 Read32(void* buffer, RwUInt32 length = sizeof(RwUInt32)) { return SwapRead<E, RwUInt32>(buffer, length); }
+    template <RwEndian E> RwUInt32 Read64(void* buffer, RwUInt32 length = sizeof(RwUInt64)) { return SwapRead<E, RwUInt64>(buffer, length); }
+    template <RwEndian E> RwUInt32 Write16(const void* buffer, RwUInt32 length = sizeof(RwUInt16)) { return SwapWrite<E, RwUInt16>(buffer, length); }
+    template <RwEndian E> RwUInt32 Write32(const void* buffer, RwUInt32 length = sizeof(RwUInt32)) { return SwapWrite<E, RwUInt32>(buffer, length); }
+    template <RwEndian E> RwUInt32 Write64(const void* buffer, RwUInt32 length = sizeof(RwUInt64)) { return SwapWrite<E, RwUInt64>(buffer, length); }
+
     RwBool ReadChunkHeader(RwChunkHeader* header);
     RwBool WriteChunkHeader(RwChunkHeader* header);
 
     RwBool FindChunk(RwUInt32 type, RwUInt32* lengthOut = NULL);
 
 private:
-    RwUInt32 SwapRead(void* buffer, RwUInt32 length, void(*swap)(void*, RwUInt32));
-    RwUInt32 SwapWrite(const void* buffer, RwUInt32 length, void(*swap)(void*, RwUInt32));
+    template <RwEndian E, typename T> RwUInt32 SwapRead(void* buffer, RwUInt32 length);
+    template <RwEndian E, typename T> RwUInt32 SwapWrite(const void* buffer, RwUInt32 length);
 };
 
+template <RwEndian E, typename T>
+inline RwUInt32 RwStream::SwapRead(void* buffer, RwUInt32 length)
+{
+    RwUInt32 bytesRead = Read(buffer, length);
+
+    if (E != rwENDIAN) {
+        T* p = (T*)buffer;
+
+        for (RwUInt32 i = 0; i < bytesRead / sizeof(T); i++) {
+            p[i] = RwSwap(p[i]);
+        }
+    }
+
+    return bytesRead;
+}
+
+template <RwEndian E, typename T>
+inline RwUInt32 RwStream::SwapWrite(const void* buffer, RwUInt32 length)
+{
+    if (E == rwENDIAN) {
+        return Write(buffer, length);
+    }
+
+    T convertBuffer[256 / sizeof(T)];
+    const T* p = (const T*)buffer;
+    RwUInt32 totalBytesWritten = 0;
+    RwUInt32 count = length / sizeof(T);
+
+    while (count) {
+        RwUInt32 countToWrite = (count < sizeof(convertBuffer) / sizeof(T)) ? count : sizeof(convertBuffer) / sizeof(T);
+
+        for (RwUInt32 i = 0; i < countToWrite; i++) {
+            convertBuffer[i] = RwSwap(p[i]);
+        }
+
+        RwUInt32 bytesToWrite = countToWrite * sizeof(T);
+        RwUInt32 bytesWritten = Write(convertBuffer, bytesToWrite);
+
+        totalBytesWritten += bytesWritten;
+
+        if (bytesWritten != bytesToWrite) {
+            break;
+        }
+
+        count -= countToWrite;
+        p += countToWrite;
+    }
+
+    return totalBytesWritten;
+}
+
 enum RwPluginID
 {
     rwID_NAOBJECT = 0x00,
@@ -113,6 +216,10 @@ struct RwMatrix
     RwUInt32 pad2;
     RwV3d pos;
     RwUInt32 pad3;
+
+    void Multiply(const RwMatrix* a, const RwMatrix* b);   // Sets this to a transformed by b
+    void TransformPoints(RwV3d* points, RwInt32 numPoints) const;
+    RwBool IsIdentity() const;
 };
 
 struct RwRGBA
@@ -184,7 +291,7 @@ struct RpMeshHeader
     RwUInt32 totalIndicesInMesh;
     std::vector<RpMesh> meshes;
 
-    RwBool StreamRead(RwStream* stream, RpGeometry* geometry);
+    template <RwEndian E> RwBool StreamRead(RwStream* stream, RpGeometry* geometry);
 };
 
 enum RpGeometryFlag
@@ -212,11 +319,13 @@ struct RpGeometry
     RwInt32 numTexCoordSets;
     RpMeshHeader mesh;
     std::vector<RwRGBA> preLitLum;
+    RwUInt32 preLitLumOffset;   // Where preLitLum was in the stream, so it can be patched in place
     std::vector<RwTexCoords> texCoords[rwMAXTEXTURECOORDS];
     std::vector<RpTriangle> triangles;
     std::vector<RpMorphTarget> morphTargets;
 
-    RwBool StreamRead(RwStream* stream);
+    RwBool StreamRead(RwStream* stream);    // Reads in the stream's byte order
+    template <RwEndian E> RwBool StreamRead(RwStream* stream);
 };
 
 enum RpAtomicFlag
@@ -232,16 +341,38 @@ struct RpAtomic
     RpGeometry* geometry;
 };
 
+// Geometries decoded by earlier clump reads, so reading a clump again only decodes the geometries that changed
+// (like when --watch rebuilds after a save). Only the geometries of the last read are kept.
+struct RpGeometryCache
+{
+    struct Entry
+    {
+        RwEndian endian;
+        std::vector<RwUInt8> data;  // The geometry chunk's bytes, compared in full so a hash collision can't match
+        RpGeometry geometry;        // preLitLumOffset is relative to the chunk's data here
+    };
+
+    std::unordered_map<RwUInt64, Entry> entries;    // By FNV-1a hash of the chunk's bytes
+    RwInt32 numReused;                              // Geometries the last read took from the cache
+
+    RpGeometryCache() : numReused(0) {}
+};
+
 struct RpClump
 {
     std::vector<RwFrame> frames;
     std::vector<RpGeometry> geometries;
     std::vector<RpAtomic> atomics;
+    RwInt32 numReadThreads;             // Threads to decode geometries with, 0 for one per hardware thread
+    RpGeometryCache* geometryCache;     // Reuses unchanged geometries from earlier reads, NULL to decode all of them
 
-    RwBool StreamRead(RwStream* stream);
+    RpClump();
+    RwBool StreamRead(RwStream* stream);    // Reads in the stream's byte order
+    template <RwEndian E> RwBool StreamRead(RwStream* stream);
+    void Append(RpClump* other);
 
 private:
-    RwBool ReadFrameList(RwStream* stream);
-    RwBool ReadGeometryList(RwStream* stream);
-    RwBool ReadAtomic(RwStream* stream);
+    template <RwEndian E> RwBool ReadFrameList(RwStream* stream);
+    template <RwEndian E> RwBool ReadGeometryList(RwStream* stream);
+    template <RwEndian E> RwBool ReadAtomic(RwStream* stream);
 };
\ No newline at end of file